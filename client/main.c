@@ -33,7 +33,7 @@
 //   export DISPLAY=:0
 //
 // Compile this file:
-//   gcc -o piframe -O3 $(pkg-config --cflags gtk+-3.0) $(pkg-config --libs gtk+-3.0) $(pkg-config --cflags libcurl) $(pkg-config --libs libcurl) main.c
+//   gcc -o piframe -O3 $(pkg-config --cflags gtk+-3.0) $(pkg-config --libs gtk+-3.0) $(pkg-config --cflags libcurl) $(pkg-config --libs libcurl) main.c -lm
 //
 // Run:
 //   ./piframe "http://10.0.0.84:3000/v1/nextPhoto"
@@ -61,26 +61,189 @@
 
 
 #include <stdlib.h>
+#include <stdio.h>
 #include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <stdarg.h>
+#include <stdint.h>
+#include <math.h>
+#include <signal.h>
+#include <errno.h>
 
 #include <gtk/gtk.h>
+#include <glib-unix.h>
 #include <curl/curl.h>
 
 
-#if defined(DEBUG)
+#if defined(PIFRAME_TRACE)
+
+	////////////////////////////////////////////////////////////////
+	// Trace (build with -DPIFRAME_TRACE): every DebugPrintf() becomes
+	//   an event in a ring buffer of the calling thread's own, which
+	//   records the time and the format string's address and nothing
+	//   else (the arguments aren't evaluated.)  The format's first
+	//   character gives the event's kind, as it does for the log:
+	//   '+' begins a span, '-' ends the innermost one, and anything
+	//   else is an instant.  Each ring has one writer and is read only
+	//   by TraceDump(), which writes them all as Chrome trace JSON for
+	//   chrome://tracing or ui.perfetto.dev.  A ring's head is the only
+	//   shared word, so recording takes no lock; a dump skips events
+	//   their thread may have overwritten while they were being read.
+
+	#include <sys/prctl.h>
+
+	typedef struct TraceEvent
+	{
+		gint64			timeUS;		// g_get_monotonic_time()
+		char const*		format;		// the DebugPrintf() call's (named when dumped)
+
+	} TraceEvent;
+
+	#define kTraceRingEvents (16384)	// per thread, 16 bytes each (on 64-bit)
+
+	typedef struct TraceRing
+	{
+		TraceEvent			events[kTraceRingEvents];
+		guint				head;		// (atomic) events recorded ever: the next goes in events[head % kTraceRingEvents]
+		int					id;			// the trace's tid
+		char				name[17];	// the thread's, when it first recorded
+		struct TraceRing*	next;
+
+	} TraceRing;
+
+	static struct
+	{
+		GMutex			lock;		// (rings are only added)
+		TraceRing*		rings;
+		int				count;
+
+	} gTrace;
+
+	static __thread TraceRing* tTraceRing = 0;
+
+	// a thread's first event: give it a ring (kept until exit, as a thread's last events are worth seeing)
+	static TraceRing*	traceRingNew(void)
+	{
+		TraceRing* ring = g_new0(TraceRing, 1);
+		prctl(PR_GET_NAME, ring->name, 0, 0, 0);
+
+		g_mutex_lock(&gTrace.lock);
+		ring->id = ++gTrace.count;
+		ring->next = gTrace.rings;
+		gTrace.rings = ring;
+		g_mutex_unlock(&gTrace.lock);
+
+		tTraceRing = ring;
+		return(ring);
+	}
+
+	static inline void	TraceRecord(char const* format)
+	{
+		TraceRing* ring = tTraceRing;
+		if(G_UNLIKELY(ring == 0))
+			ring = traceRingNew();
+
+		guint head = ring->head;	// (only this thread writes it)
+		TraceEvent* event = &ring->events[head % kTraceRingEvents];
+		event->timeUS = g_get_monotonic_time();
+		event->format = format;
+		g_atomic_int_set((gint*)&ring->head, (gint)(head + 1));	// (publishes the event)
+	}
+
+	#define DebugPrintf(format, ...) TraceRecord(format)
+
+	// Writes the events every thread still holds to 'path' as Chrome trace JSON.
+	//   Any thread may call it, while the others carry on recording.
+	//   Returns 0 if the file can't be written.
+	int			TraceDump(char const* path)
+	{
+		FILE* file = fopen(path, "w");
+		if(file == 0)
+			return(0);
+
+		TraceEvent* events = g_new(TraceEvent, kTraceRingEvents);
+		int pid = (int)getpid(), written = 0;
+		TraceRing* ring;
+
+		fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+		g_mutex_lock(&gTrace.lock);
+		for(ring = gTrace.rings; ring != 0; ring = ring->next)
+		{
+			fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%i,\"tid\":%i,\"args\":{\"name\":\"%s\"}}", (written++ > 0)? ",\n" : "", pid, ring->id, ring->name);
+
+			// copy the newest events out, then drop any the thread reached while they were copied (and the one it may be writing)
+			guint head = (guint)g_atomic_int_get((gint*)&ring->head);
+			guint count = MIN(head, kTraceRingEvents), first = head - count, e;
+			for(e = 0; e < count; e++)
+				events[e] = ring->events[(first + e) % kTraceRingEvents];
+			guint overrun = (guint)g_atomic_int_get((gint*)&ring->head) - head + 1;
+			guint skip = (overrun > kTraceRingEvents - count)? MIN(overrun - (kTraceRingEvents - count), count) : 0;
+
+			for(e = skip; e < count; e++)
+			{
+				char const* name = events[e].format;
+				char phase = (name[0] == '+')? 'B' : (name[0] == '-')? 'E' : 'i';
+				if((name[0] == '+') || (name[0] == '-') || (name[0] == '*'))
+					name++;
+				int length = (int)strcspn(name, " \t\n%(),:=\"\\");
+				if(length == 0)
+					continue;
+
+				fprintf(file, ",\n{\"name\":\"%.*s\",\"ph\":\"%c\",%s\"ts\":%" G_GINT64_FORMAT ",\"pid\":%i,\"tid\":%i}",
+					length, name, phase, (phase == 'i')? "\"s\":\"t\"," : "", events[e].timeUS, pid, ring->id);
+			}
+		}
+		g_mutex_unlock(&gTrace.lock);
+		fprintf(file, "\n]}\n");
+		g_free(events);
+
+		int ok = (ferror(file) == 0);
+		return((fclose(file) == 0) && ok);
+	}
+
+	#define kTraceDefaultPath "/tmp/piframe-trace.json"
+
+	// where a dump goes when no path is given: $PIFRAME_TRACE, or kTraceDefaultPath
+	char const*	TraceDefaultPath(void)
+	{
+		char const* path = getenv("PIFRAME_TRACE");
+		return(((path != 0) && (path[0] != 0))? path : kTraceDefaultPath);
+	}
+
+	// SIGHUP: dump to the default path
+	static gboolean	onTraceSignal(gpointer user)
+	{
+		(void)user;
+		if(!TraceDump(TraceDefaultPath()))
+			g_warning("Can't write the trace to %s", TraceDefaultPath());
+		return(G_SOURCE_CONTINUE);
+	}
+
+#elif defined(DEBUG)
 
 	int DebugPrintf(char const* fmt, ...)
 	{
-		if((0))	// runtime switch
+		static int enabled = -1;	// runtime switch: set PIFRAME_DEBUG in the environment
+		if(enabled < 0)
+			enabled = (getenv("PIFRAME_DEBUG") != 0);
+
+		int count = 0;
+		if(enabled)
 		{
 			va_list v;
 			va_start(v, fmt);
 
-			vprintf(fmt, v);
+			count = vprintf(fmt, v);
 
 			va_end(v);
 		}
+		return(count);
 	}
 
 #else
@@ -126,28 +289,254 @@
 // END PATCH
 
 
+////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////
+//
+// Metrics subsystem: per-photo timings of each phase, from the
+//   request to the screen, written as InfluxDB line protocol to
+//   a log that's flushed periodically.  A Metrics record is
+//   filled in by each subsystem a photo passes through; each
+//   field is written by one thread only, and the record is
+//   handed along with the photo so the writes are ordered.
+//
+////////////////////////////////////////////////////////////////
+
+typedef struct Metrics
+{
+	// network (curlThread, from curl_easy_getinfo), in microseconds
+	gint64			dnsUS;
+	gint64			connectUS;
+	gint64			tlsUS;
+	gint64			ttfbUS;			// request sent to first byte: includes the server's hold time
+	gint64			transferUS;
+	long			status;			// HTTP status
+	long			connects;		// new connections made (0 when the connection was reused)
+	gint64			bytes;			// body bytes delivered (including from the disk cache)
+	int				cached;			// the body came from the disk cache (304)
+
+	gint64			queueUS;		// time chunks and the result waited for their dispatcher
+	gint64			decodeUS;		// in the GdkPixbufLoader
+	gint64			scaleUS;		// scaling to the screen (or copying from the frame cache)
+
+} Metrics;
+
+#define kMetricsFlushMS (10000)	// 10 seconds
+
+static struct
+{
+	FILE*			file;		// 0 when metrics are off
+	GString*		pending;	// lines not written yet (main thread)
+
+	GMutex			pixelLock;	// (pixel buffers are freed on any thread)
+	gint64			pixelBytes;	// in decoded photos and screen buffers alive now
+	gint64			pixelPeak;
+
+} gMetrics;
+
+static gboolean	onMetricsFlush(gpointer user)
+{
+	(void)user;
+	if(gMetrics.pending->len > 0)
+	{
+		fwrite(gMetrics.pending->str, 1, gMetrics.pending->len, gMetrics.file);
+		fflush(gMetrics.file);
+		g_string_truncate(gMetrics.pending, 0);
+	}
+	return(G_SOURCE_CONTINUE);
+}
+
+// 'path' is the log ("-" for stdout), 0 for no metrics
+void			MetricsInit(char const* path)
+{
+	gMetrics.file = 0;
+	gMetrics.pending = g_string_new(0);
+	if(path == 0)
+		return;
+
+	gMetrics.file = strcmp(path, "-")? fopen(path, "a") : stdout;
+	if(gMetrics.file == 0)
+	{
+		g_warning("Can't open the metrics log \"%s\", metrics are off", path);
+		return;
+	}
+	gdk_threads_add_timeout(kMetricsFlushMS, &onMetricsFlush, 0);
+}
+
+gboolean		MetricsEnabled(void)
+{
+	return(gMetrics.file != 0);
+}
+
+
+////////////////////////////////////////////////////////////////
+// Pixel memory: decoded photos and screen buffers are counted
+//   for as long as they're alive (maxrss can't tell them apart
+//   from everything else), whether or not metrics are on.
+
+static void		metricsPixelsAdd(gint64 bytes)
+{
+	g_mutex_lock(&gMetrics.pixelLock);
+	gMetrics.pixelBytes += bytes;
+	gMetrics.pixelPeak = MAX(gMetrics.pixelPeak, gMetrics.pixelBytes);
+	g_mutex_unlock(&gMetrics.pixelLock);
+}
+
+// any thread: the last reference to a tracked buffer is gone
+static void		onMetricsPixelsFreed(gpointer data)
+{
+	metricsPixelsAdd(-(gint64)GPOINTER_TO_SIZE(data));
+}
+
+// any thread: counts 'pixels' until it's finalized (tracking a buffer again is harmless)
+void			MetricsTrackPixels(GdkPixbuf* pixels)
+{
+	gsize bytes = (gsize)gdk_pixbuf_get_rowstride(pixels) * gdk_pixbuf_get_height(pixels);
+	metricsPixelsAdd((gint64)bytes);
+	g_object_set_qdata_full(G_OBJECT(pixels), g_quark_from_static_string("piframe-metrics-pixels"), GSIZE_TO_POINTER(bytes), &onMetricsPixelsFreed);
+}
+
+// the pixel bytes alive now and at most so far
+void			MetricsGetPixels(gint64* outBytes, gint64* outPeak)
+{
+	g_mutex_lock(&gMetrics.pixelLock);
+	*outBytes = gMetrics.pixelBytes;
+	*outPeak = gMetrics.pixelPeak;
+	g_mutex_unlock(&gMetrics.pixelLock);
+}
+
+
+// main thread: appends a line for one photo; 'source' is how it arrived (a tag)
+void			MetricsRecordImage(char const* source, Metrics const* metrics)
+{
+	if(gMetrics.file == 0)
+		return;
+
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+
+	gint64 pixelBytes, pixelPeak;
+	MetricsGetPixels(&pixelBytes, &pixelPeak);
+
+	g_string_append_printf(gMetrics.pending,
+		"piframe_image,source=%s dns_us=%" G_GINT64_FORMAT "i,connect_us=%" G_GINT64_FORMAT "i,tls_us=%" G_GINT64_FORMAT "i"
+		",ttfb_us=%" G_GINT64_FORMAT "i,transfer_us=%" G_GINT64_FORMAT "i,status=%lii,connects=%lii,bytes=%" G_GINT64_FORMAT "i,cached=%s"
+		",queue_us=%" G_GINT64_FORMAT "i,decode_us=%" G_GINT64_FORMAT "i,scale_us=%" G_GINT64_FORMAT "i,maxrss_kb=%lii"
+		",pixel_kb=%" G_GINT64_FORMAT "i,pixel_peak_kb=%" G_GINT64_FORMAT "i"
+		" %" G_GINT64_FORMAT "000\n",
+		source, metrics->dnsUS, metrics->connectUS, metrics->tlsUS,
+		metrics->ttfbUS, metrics->transferUS, metrics->status, metrics->connects, metrics->bytes, metrics->cached? "true" : "false",
+		metrics->queueUS, metrics->decodeUS, metrics->scaleUS, (long)usage.ru_maxrss,
+		pixelBytes / 1024, pixelPeak / 1024,
+		g_get_real_time()
+	);
+}
+
+// main thread: a frame reached the screen 'presentUS' after it was handed over
+// 'dueTime' is the wall-clock time the server asked for, 0 if it didn't
+void			MetricsRecordPresent(gint64 presentUS, gboolean transition, gint64 dueTime)
+{
+	if(gMetrics.file == 0)
+		return;
+
+	gint64 now = g_get_real_time();
+	g_string_append_printf(gMetrics.pending, "piframe_present,transition=%s present_us=%" G_GINT64_FORMAT "i", transition? "true" : "false", presentUS);
+	if(dueTime != 0)
+		g_string_append_printf(gMetrics.pending, ",late_us=%" G_GINT64_FORMAT "i", now - dueTime);
+	g_string_append_printf(gMetrics.pending, " %" G_GINT64_FORMAT "000\n", now);
+}
+
+
 ////////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////
 //
 // Download subsystem: downloads a URL with cURL asynchronously
 //   with callback progress, completion and failure notification
-//   on the main thread.
+//   on the main thread (or on the thread running the
+//   DownloadDispatcher the download was created with.)
+//   Downloads can be revalidated against a disk cache.
+//
+// Several downloads run at once, all from curlThread; the rest
+//   wait their turn in priority order.
+//
+// A download can be cancelled from any thread through its cancel
+//   flag, and is abandoned if connecting takes too long, if its
+//   body stops arriving partway through, or (optionally) if it
+//   takes too long overall.  Either way it still completes, with
+//   an error; the wait for the server's reply before the body
+//   starts is never timed out, since that's how the server sets
+//   the pace.
 //
 ////////////////////////////////////////////////////////////////
 
 static size_t onCURLDownloadSegment(void* segment, size_t count, size_t elements, void* user);
+static size_t onCURLDownloadHeader(char* buffer, size_t count, size_t elements, void* user);
+
+struct DownloadDispatcher;
 
 typedef struct DownloadOptions
 {
 	char const*		url;		// duplicated, owned by DownloadOptions
+	char**			headers;	// optional extra request headers ("Name: value", 0-terminated), duplicated
 	
 	void			(*progressCallback)(struct DownloadOptions const* download, unsigned char const* data, size_t length, size_t received, size_t expected);
 	void			(*completeCallback)(struct DownloadOptions const* download, int result, char const* reason);
 	
 	void*			context;	// context for callbacks
 
+	struct DownloadDispatcher*	dispatcher;	// where callbacks are invoked, 0 for the main thread
+
+	// Streaming mode (optional): called on curlThread with each
+	//   segment exactly as libcurl delivers it.  No progress items
+	//   are queued and progressCallback is not used.  Return 0 to
+	//   abort the transfer (it completes with CURLE_WRITE_ERROR.)
+	int				(*streamCallback)(struct DownloadOptions const* download, unsigned char const* data, size_t length);
+
+	int				cache;		// revalidate against and store into the disk cache (when configured)
+	char const*		hash;		// optional: the body's hex SHA-256 if known, served from the disk cache without a request if held; duplicated
+
+	// Called on curlThread (optional) with the hex SHA-256 of the body
+	//   once it's known from the disk cache: after a body has been
+	//   stored (cached == 0), or before a 304 is served from disk
+	//   (cached != 0), where returning 0 skips serving the body and the
+	//   download completes successfully without any data.
+	int				(*contentCallback)(struct DownloadOptions const* download, char const* hash, int cached);
+
+	// Called on curlThread (optional) with each response header line,
+	//   stripped, for every response including redirects.
+	void			(*headerCallback)(struct DownloadOptions const* download, char const* line);
+
+	Metrics*		metrics;	// optional: the transfer's timings, filled in by completion
+
+	// Optional: the transfer is aborted (and completes with
+	//   CURLE_ABORTED_BY_CALLBACK) once this is non-0.  Read atomically
+	//   on curlThread, and must stay valid until completion.
+	gint const*		cancel;
+
+	int				idle;		// the body may go quiet indefinitely (a push stream): no stall or total timeout
+
+	int				priority;	// pending downloads start highest first; above 0 is urgent (see kDownloadPriorityUrgent)
+
+	int				failOnError;	// an HTTP error status fails the transfer (CURLE_HTTP_RETURNED_ERROR) before any body
+
 } DownloadOptions;
 
+#define kDownloadPriorityUrgent (1)	// about to be shown
+
+// A DownloadDispatcher delivers progress and completion for the
+//   downloads created with it on the thread that runs its
+//   GMainContext.
+typedef struct DownloadDispatcher
+{
+	GMainContext*	context;	// (referenced)
+
+	// Download instances flow dispatcher <- curl
+	GAsyncQueue*	resultsQueue;
+
+	// DownloadProgressItem instances flow dispatcher <- curl
+	GAsyncQueue*	progressQueue;
+
+} DownloadDispatcher;
+
 struct DownloadProgressItem;
 
 typedef struct Download
@@ -164,54 +553,362 @@ typedef struct Download
 
 	int								outstandingProgressItems;
 
+	gint64							queued;	// when the result was pushed to its dispatcher (for Metrics)
+
+	// stall detection (curlThread only)
+	gint64							lastArrival;	// when the body last grew
+	size_t							lastBytes;
+	char const*						abortReason;	// why the progress callback aborted, 0 if it didn't
+
+	struct curl_slist*				requestHeaders;	// options.headers and the cache's validators (curlThread only)
+	int								served;			// answered from the disk cache by options.hash, without a request
+
+	// disk cache state (curlThread only)
+	struct
+	{
+		int					active;
+		long				status;			// HTTP status of the final response
+		char*				etag;			// validators of the final response, 0 if absent
+		char*				lastModified;
+
+		FILE*				file;			// the body being stored, 0 if not (yet) storing
+		char*				tempPath;
+		GChecksum*			checksum;
+		size_t				stored;
+		int					failed;			// the body won't be stored
+		int					dated;			// the request was If-Modified-Since, so the URL's one entry is what a 304 means
+
+	} cache;
+
+	int								unconditional;	// 1: a 304 named nothing the cache holds, so the transfer restarts without validators (2 once it has; curlThread only)
+
+	// LAN peer fetch (curlThread only, see Peers)
+	struct
+	{
+		int					state;	// kDownloadPeer...
+		char*				url;	// the peer's copy of the body the origin's 304 named
+		char*				etag;	// the origin's, to store it under
+		char*				hash;	// what it must hash to
+
+	} peer;
+
 } Download;
 
+enum
+{
+	kDownloadPeerNone = 0,
+	kDownloadPeerFound,		// the origin's 304 named a peer's body: restart against the peer
+	kDownloadPeerFetching,
+	kDownloadPeerFallback,	// the peer failed: back to the origin, without the peers' ETags
+};
+
 typedef struct DownloadProgressItem
 {
 	Download*		context;
 
-	void*			chunk;
+	void*			chunk;		// kMaxChunksize bytes, allocated with the item
 	size_t			length;
 
 	size_t			bytesExpected;
 	size_t			bytesLoaded;
 
+	gint64			queued;		// when it was pushed to its dispatcher (for Metrics)
+
+	struct DownloadProgressItem*	nextIdle;	// pool free list link (curlThread only)
+
 } DownloadProgressItem;
 
+typedef struct DownloadInitOptions
+{
+	unsigned int	poolHighWater;	// maximum number of progress items allocated at once (0 for the default)
+	unsigned int	maxTransfers;	// transfers in flight at once (0 for the default)
+
+	char const*		cacheDirectory;	// disk cache location, created if needed (0 for no cache)
+	size_t			cacheCapacity;	// disk cache size cap in bytes (0 for no cache)
+
+	// timeouts, 0 for none
+	unsigned int	connectTimeoutMS;	// to connect (including DNS and TLS)
+	unsigned int	stallTimeoutMS;		// without body data, once the body has started
+	unsigned int	totalTimeoutMS;		// for the whole transfer, including the server's hold time
+
+	// LAN peers (see Peers), both need the disk cache
+	char const*		peers;		// "host[:port],..." whose caches to fetch from (0 for none)
+	unsigned int	peerPort;	// serve this cache to peers on this port (0 for not)
+	char const*		peerAddress;	// ... on this local address only (0 for every interface)
+
+} DownloadInitOptions;
+
+typedef struct DownloadPoolStats
+{
+	unsigned int	allocated;	// items currently allocated (in flight + idle)
+	unsigned int	inUse;		// items currently filling or queued for dispatch
+	unsigned int	peak;		// largest number of items allocated at once
+	unsigned int	highWater;	// configured allocation ceiling
+	unsigned int	reused;		// number of acquisitions satisfied from the pool
+	unsigned int	stalls;		// number of times curlThread waited on the ceiling
+
+	unsigned int	downloads;	// downloads created and not yet completed
+	unsigned int	jobs;		// of those, new ones curlThread hasn't taken in yet
+
+} DownloadPoolStats;
+
+typedef struct DownloadCacheStats
+{
+	unsigned int	entries;	// as of the disk cache's last change
+	size_t			size;		// in bytes
+	size_t			capacity;
+
+} DownloadCacheStats;
+
 static struct
 {
 	// Download instances flow main -> curl
 	GAsyncQueue*	jobQueue;
-	
-	// Download instances flow main <- curl
-	GAsyncQueue*	resultsQueue;
 
-	// DownloadProgressItem instances flow main <- curl for dispatch
-	GAsyncQueue*	progressQueue;
+	// runs every transfer on curlThread; made by DownloadInit() so DownloadNew() can wake it
+	CURLM*			multi;
+	unsigned int	maxTransfers;
+
+	// dispatches to the main thread (the default for downloads)
+	DownloadDispatcher*	mainDispatcher;
 
-	// DownloadProgressItem instances flow main -> curl for recycling
+	// DownloadProgressItem instances flow dispatcher -> curl for recycling
 	GAsyncQueue*	progressRecycleQueue;
 
-	unsigned int	count;
+	int				count;	// downloads in flight (atomic)
+
+	// fixed-size pool of progress items; the idle list belongs to
+	//   curlThread, the counters may be read from any thread
+	struct
+	{
+		DownloadProgressItem*	idle;
+
+		int						allocated;
+		int						idleCount;
+		int						peak;
+		int						highWater;
+		int						reused;
+		int						stalls;
+
+	} pool;
+
+	unsigned int	connectTimeoutMS;	// (see DownloadInitOptions)
+	unsigned int	stallTimeoutMS;
+	unsigned int	totalTimeoutMS;
+
+	// disk cache index (curlThread only, see downloadCacheLoad())
+	struct
+	{
+		char*					directory;	// 0 when there's no cache
+		size_t					capacity;
+		size_t					size;
+		GList*					entries;	// DownloadCacheEntry instances, most recently used first
+
+		// (atomic) for any thread
+		int						requestedMB;	// a new capacity from DownloadSetCacheCapacity(), -1 for none
+		int						statEntries;	// for DownloadGetCacheStats(), see downloadCachePublish()
+		int						statKB;
+		int						statCapacityKB;
+
+	} cache;
+
+	// LAN peers (see Peers)
+	GPtrArray*		peers;			// DownloadPeer instances, 0 for none
+	GMutex			peerLock;		// guards their entries
+	GSocketService*	peerService;	// serving this cache to them, 0 if not
 
 } gDownload;
 
+#define kMaxChunksize (128 * 1024)
+#define kDefaultPoolHighWater (16)	// 2 MiB of chunks
+#define kDefaultMaxTransfers (4)
+#define kDownloadShutdown ((Download*)&gDownload)	// pushed to jobQueue, stops curlThread
+#define kDownloadPollMS (1000)		// longest curlThread sleep (libcurl's timers cut it short)
+#define kDownloadIdlePollMS (3600000)	// the same with nothing running (DownloadNew() interrupts it)
+#define kDownloadJobPollMS (50)		// without curl_multi_wakeup(): how long a new job can wait
+#define kDownloadDefaultWeight (16)	// HTTP/2 stream weights (1 to 256)
+#define kDownloadUrgentWeight (256)
+#define kDefaultCacheCapacity (64 * 1024 * 1024)	// 64 MiB
+#define kDownloadCacheMaxValidators (64)	// ETags sent in one request
+
+static void			downloadCacheLoad(void);
+static void			downloadCachePublish(void);
+static void			downloadPeersInit(DownloadInitOptions const* options);
+static char*		downloadPeerFind(char const* url, char const* etag, char** outHash);
+static int			downloadPeerAddValidators(GString* header, char const* url, int etags);
+
 
 static gboolean		onDownloadQueuePoll(gpointer user);
 
-void				DownloadInit(void)
+
+////////////////////////////////////////////////////////////////
+// Dispatch source: instead of polling the queues on a timer,
+//   curlThread wakes the dispatcher's main context whenever it
+//   pushes to progressQueue or resultsQueue.  The source has no
+//   timeout of its own, so the loop sleeps while a transfer is
+//   idle (e.g. while the server holds a long-poll request.)
+
+typedef struct DownloadSource
+{
+	GSource				source;
+	DownloadDispatcher*	dispatcher;
+
+} DownloadSource;
+
+static gboolean		downloadQueuesPending(DownloadDispatcher* dispatcher)
+{
+	return((g_async_queue_length(dispatcher->progressQueue) > 0) || (g_async_queue_length(dispatcher->resultsQueue) > 0));
+}
+
+static gboolean		onDownloadSourcePrepare(GSource* source, gint* timeout)
+{
+	*timeout = -1;	// no timer: wait for curlThread to wake us
+	return(downloadQueuesPending(((DownloadSource*)source)->dispatcher));
+}
+
+static gboolean		onDownloadSourceCheck(GSource* source)
+{
+	return(downloadQueuesPending(((DownloadSource*)source)->dispatcher));
+}
+
+static gboolean		onDownloadSourceDispatch(GSource* source, GSourceFunc callback, gpointer user)
+{
+	(void)source;
+	return(callback(user));
+}
+
+static GSourceFuncs	gDownloadSourceFuncs =
+{
+	.prepare = &onDownloadSourcePrepare,
+	.check = &onDownloadSourceCheck,
+	.dispatch = &onDownloadSourceDispatch,
+};
+
+// called on curlThread after pushing to one of the dispatcher's queues
+static void			downloadWake(DownloadDispatcher* dispatcher)
+{
+	g_main_context_wakeup(dispatcher->context);
+}
+
+// Creates a dispatcher for the given context (0 for the main
+//   context) and attaches its source there.  Dispatchers live
+//   for the lifetime of the process.
+DownloadDispatcher*	DownloadDispatcherNew(GMainContext* context)
+{
+	DebugPrintf("+DownloadDispatcherNew\n");
+	DownloadDispatcher* dispatcher = (DownloadDispatcher*)malloc(sizeof(DownloadDispatcher));
+	DebugPrintf("malloc(DownloadDispatcher) %p\n", dispatcher);
+
+	dispatcher->context = g_main_context_ref((context != 0)? context : g_main_context_default());
+	dispatcher->resultsQueue = g_async_queue_new();
+	dispatcher->progressQueue = g_async_queue_new();
+
+	GSource* source = g_source_new(&gDownloadSourceFuncs, sizeof(DownloadSource));
+	((DownloadSource*)source)->dispatcher = dispatcher;
+	g_source_set_name(source, "piframe-download");
+	g_source_set_callback(source, &onDownloadQueuePoll, (gpointer)dispatcher, 0);
+	g_source_attach(source, dispatcher->context);
+	g_source_unref(source);	// (the context keeps its own reference)
+
+	DebugPrintf("-DownloadDispatcherNew\n");
+	return(dispatcher);
+}
+
+void				DownloadInit(DownloadInitOptions const* options)
 {
 	DebugPrintf("+DownloadInit\n");
 	curl_global_init(CURL_GLOBAL_ALL);
 
 	gDownload.jobQueue = g_async_queue_new();
-	gDownload.resultsQueue = g_async_queue_new();
-	gDownload.progressQueue = g_async_queue_new();
+	gDownload.multi = curl_multi_init();
+	gDownload.maxTransfers = (options->maxTransfers != 0)? options->maxTransfers : kDefaultMaxTransfers;
+#if LIBCURL_VERSION_NUM >= 0x072B00	// (7.43.0)
+	curl_multi_setopt(gDownload.multi, CURLMOPT_PIPELINING, (long)CURLPIPE_MULTIPLEX);
+#endif
+	gDownload.mainDispatcher = DownloadDispatcherNew(0);
 	gDownload.progressRecycleQueue = g_async_queue_new();
 	gDownload.count = 0;
+
+	gDownload.pool.idle = 0;
+	gDownload.pool.allocated = 0;
+	gDownload.pool.idleCount = 0;
+	gDownload.pool.peak = 0;
+	gDownload.pool.reused = 0;
+	gDownload.pool.stalls = 0;
+
+	// the item each transfer is filling and at least one in flight must fit
+	gDownload.pool.highWater = MAX((options->poolHighWater != 0)? options->poolHighWater : kDefaultPoolHighWater, gDownload.maxTransfers + 1);
+
+	gDownload.connectTimeoutMS = options->connectTimeoutMS;
+	gDownload.stallTimeoutMS = options->stallTimeoutMS;
+	gDownload.totalTimeoutMS = options->totalTimeoutMS;
+
+	gDownload.cache.directory = 0;
+	gDownload.cache.capacity = options->cacheCapacity;
+	gDownload.cache.size = 0;
+	gDownload.cache.entries = 0;
+	gDownload.cache.requestedMB = -1;
+	if((options->cacheDirectory != 0) && (options->cacheCapacity > 0))
+	{
+		if(g_mkdir_with_parents(options->cacheDirectory, 0700) == 0)
+		{
+			gDownload.cache.directory = g_strdup(options->cacheDirectory);
+			downloadCacheLoad();
+		}
+		else
+			g_warning("Can't create the cache directory \"%s\", caching is off", options->cacheDirectory);
+	}
+	downloadCachePublish();
+
+	downloadPeersInit(options);
 	DebugPrintf("-DownloadInit\n");
 }
 
+void				DownloadGetPoolStats(DownloadPoolStats* outStats)
+{
+	int allocated = g_atomic_int_get(&gDownload.pool.allocated);
+
+	outStats->allocated = allocated;
+	outStats->inUse = allocated - g_atomic_int_get(&gDownload.pool.idleCount);
+	outStats->peak = g_atomic_int_get(&gDownload.pool.peak);
+	outStats->highWater = gDownload.pool.highWater;
+	outStats->reused = g_atomic_int_get(&gDownload.pool.reused);
+	outStats->stalls = g_atomic_int_get(&gDownload.pool.stalls);
+
+	outStats->downloads = (unsigned int)MAX(g_atomic_int_get(&gDownload.count), 0);
+	outStats->jobs = (unsigned int)MAX(g_async_queue_length(gDownload.jobQueue), 0);
+}
+
+// what's waiting on a dispatcher (0 for the main thread's) to be handed to its callbacks
+void				DownloadDispatcherGetStats(DownloadDispatcher* dispatcher, unsigned int* outProgress, unsigned int* outResults)
+{
+	if(dispatcher == 0)
+		dispatcher = gDownload.mainDispatcher;
+	*outProgress = (unsigned int)MAX(g_async_queue_length(dispatcher->progressQueue), 0);
+	*outResults = (unsigned int)MAX(g_async_queue_length(dispatcher->resultsQueue), 0);
+}
+
+void				DownloadGetCacheStats(DownloadCacheStats* outStats)
+{
+	outStats->entries = (unsigned int)g_atomic_int_get(&gDownload.cache.statEntries);
+	outStats->size = (size_t)g_atomic_int_get(&gDownload.cache.statKB) * 1024;
+	outStats->capacity = (size_t)g_atomic_int_get(&gDownload.cache.statCapacityKB) * 1024;
+}
+
+// Caps the disk cache at 'megabytes' from now on (0 empties it), evicting
+//   on curlThread.  Returns FALSE if there's no disk cache to cap.
+gboolean			DownloadSetCacheCapacity(unsigned int megabytes)
+{
+	if(gDownload.cache.directory == 0)
+		return(FALSE);
+
+	g_atomic_int_set(&gDownload.cache.requestedMB, (int)MIN(megabytes, (unsigned int)G_MAXINT));
+#if LIBCURL_VERSION_NUM >= 0x074400	// (7.68.0)
+	curl_multi_wakeup(gDownload.multi);
+#endif
+	return(TRUE);
+}
+
 Download*			DownloadNew(DownloadOptions const* options)
 {
 	DebugPrintf("+DownloadNew\n");
@@ -220,13 +917,31 @@ Download*			DownloadNew(DownloadOptions const* options)
 
 	download->options.url = strdup(options->url);
 	DebugPrintf("strdup(options->url), %p\n", download->options.url);
+	download->options.headers = g_strdupv(options->headers);	// (0 stays 0)
 
 	download->options.progressCallback = options->progressCallback;
 	download->options.completeCallback = options->completeCallback;
 	download->options.context = options->context;
+	download->options.dispatcher = (options->dispatcher != 0)? options->dispatcher : gDownload.mainDispatcher;
+	download->options.streamCallback = options->streamCallback;
+	download->options.cache = options->cache;
+	download->options.hash = (options->hash != 0)? g_strdup(options->hash) : 0;
+	download->options.contentCallback = options->contentCallback;
+	download->options.headerCallback = options->headerCallback;
+	download->options.metrics = options->metrics;
+	download->options.cancel = options->cancel;
+	download->options.idle = options->idle;
+	download->options.priority = options->priority;
+	download->options.failOnError = options->failOnError;
 
 	download->result = 0;
 	download->reason = 0;
+	download->lastArrival = 0;
+	download->lastBytes = 0;
+	download->abortReason = 0;
+	download->requestHeaders = 0;
+	download->served = 0;
+	download->unconditional = 0;
 	download->bytesExpected = 0;
 	download->bytesLoaded = 0;
 
@@ -234,15 +949,15 @@ Download*			DownloadNew(DownloadOptions const* options)
 
 	download->outstandingProgressItems = 0;
 
-	g_async_queue_push(gDownload.jobQueue, download);
+	memset(&download->cache, 0, sizeof(download->cache));
+	memset(&download->peer, 0, sizeof(download->peer));
 
-	if(gDownload.count == 0)
-	{
-		DebugPrintf("+Download adding queue poller\n");
-		gdk_threads_add_timeout(100, &onDownloadQueuePoll, 0);
-	}
+	g_atomic_int_inc(&gDownload.count);
 
-	gDownload.count++;
+	g_async_queue_push(gDownload.jobQueue, download);
+#if LIBCURL_VERSION_NUM >= 0x074400	// (7.68.0)
+	curl_multi_wakeup(gDownload.multi);
+#endif
 
 	DebugPrintf("-DownloadNew\n");
 	return(download);
@@ -251,20 +966,24 @@ Download*			DownloadNew(DownloadOptions const* options)
 static gboolean		onDownloadQueuePoll(gpointer user)
 {
 	DebugPrintf("+onDownloadQueuePoll\n");
+	DownloadDispatcher* dispatcher = (DownloadDispatcher*)user;
 	
 	// handle progress items
 	DownloadProgressItem* progressItem;
-	while((progressItem = (DownloadProgressItem*)g_async_queue_try_pop(gDownload.progressQueue)) != 0)
+	while((progressItem = (DownloadProgressItem*)g_async_queue_try_pop(dispatcher->progressQueue)) != 0)
 	{
 		DebugPrintf("+onDownloadQueuePoll progressItem\n");
+		if(progressItem->context->options.metrics != 0)
+			progressItem->context->options.metrics->queueUS += g_get_monotonic_time() - progressItem->queued;
+
 		if(progressItem->context->options.progressCallback)
 		{
 			DebugPrintf("*onDownloadQueuePoll progress callback\n");
 			progressItem->context->options.progressCallback(&progressItem->context->options, progressItem->chunk, progressItem->length, progressItem->bytesLoaded, progressItem->bytesExpected);
 		}
 
-		DebugPrintf("*onDownloadQueuePoll outstandingProgressItems %i--\n", progressItem->context->outstandingProgressItems);
-		progressItem->context->outstandingProgressItems--;
+		DebugPrintf("*onDownloadQueuePoll outstandingProgressItems %i--\n", g_atomic_int_get(&progressItem->context->outstandingProgressItems));
+		g_atomic_int_add(&progressItem->context->outstandingProgressItems, -1);
 		progressItem->context = 0;	// burn the reference just in case
 
 		g_async_queue_push(gDownload.progressRecycleQueue, progressItem);
@@ -273,12 +992,14 @@ static gboolean		onDownloadQueuePoll(gpointer user)
 
 	// handle completion items
 	Download* completeItem;
-	while((completeItem = (Download*)g_async_queue_try_pop(gDownload.resultsQueue)) != 0)
+	while((completeItem = (Download*)g_async_queue_try_pop(dispatcher->resultsQueue)) != 0)
 	{
 		DebugPrintf("+onDownloadQueuePoll completeItem\n");
-		if(completeItem->outstandingProgressItems == 0)
+		if(g_atomic_int_get(&completeItem->outstandingProgressItems) == 0)
 		{
 			DebugPrintf("+onDownloadQueuePoll outstandingProgressItems == 0\n");
+			if(completeItem->options.metrics != 0)
+				completeItem->options.metrics->queueUS += g_get_monotonic_time() - completeItem->queued;
 			
 			// call completion callback indicating success
 			if(completeItem->options.completeCallback)
@@ -290,331 +1011,6068 @@ static gboolean		onDownloadQueuePoll(gpointer user)
 
 			DebugPrintf("free((void*)completeItem->options.url) %p\n", (void*)completeItem->options.url);
 			free((void*)completeItem->options.url);
+			g_strfreev(completeItem->options.headers);
+			g_free((void*)completeItem->options.hash);
 			DebugPrintf("free(completeItem) %p\n", completeItem);
 			free(completeItem);
 
-			gDownload.count--;
+			g_atomic_int_add(&gDownload.count, -1);
 			DebugPrintf("-onDownloadQueuePoll outstandingProgressItems == 0\n");
 		}
 		else
 		{
 			DebugPrintf("*onDownloadQueuePoll outstandingProgressItems > 0\n");
-			// defer it until later to allow progress items to be processed first
-			g_async_queue_push_front(gDownload.resultsQueue, completeItem);
+			// defer it until later to allow progress items to be processed first;
+			//   the source stays ready because the results queue is non-empty
+			g_async_queue_push_front(dispatcher->resultsQueue, completeItem);
+			break;
 		}
 	}
 	
-	// handle queue empty: return false when it's empty to stop this callback from being called periodically
-	DebugPrintf("-onDownloadQueuePoll %s\n", (gDownload.count > 0)? "continuing" : "shutting down");
-	return(gDownload.count > 0);
+	// the source is permanent; it costs nothing while the queues are empty
+	DebugPrintf("-onDownloadQueuePoll\n");
+	return(G_SOURCE_CONTINUE);
 }
 
-void			downloadRecycleProgressItems(void)
+////////////////////////////////////////////////////////////////
+// Disk cache: a response with an ETag or Last-Modified is
+//   stored in the cache directory under the SHA-256 of its body
+//   and indexed by URL and validator.  Requests for a cached URL
+//   are made conditional, and a 304 is served from disk through
+//   the same path as a downloaded body, so consumers can't tell
+//   the difference.  If-None-Match lists every ETag stored for
+//   the URL, because a playlist server answers the same URL
+//   with a different photo each time; its 304 names the one it
+//   matched.  Least recently used entries are evicted to stay
+//   under the size cap.  Other than the index being loaded once
+//   by DownloadInit(), this all runs on curlThread.
+
+typedef struct DownloadCacheEntry
 {
-	DebugPrintf("+downloadRecycleProgressItems\n");
-	DownloadProgressItem* progressItem;
-	while((progressItem = g_async_queue_try_pop(gDownload.progressRecycleQueue)) != 0)
-	{
-		DebugPrintf("*downloadRecycleProgressItems item\n");
-		DebugPrintf("free(progressItem->chunk) %p\n", progressItem->chunk);
-		free(progressItem->chunk);
-		DebugPrintf("free(progressItem) %p\n", progressItem);
-		free(progressItem);
-	}
-	DebugPrintf("-downloadRecycleProgressItems\n");
+	char*	url;
+	char*	etag;			// as sent by the server (quoted), "" if none
+	char*	lastModified;	// "" if none
+	char*	hash;			// hex SHA-256 of the body, also its file name
+	size_t	size;
+	gint64	lastUse;		// wall clock microseconds, for LRU across restarts
+
+} DownloadCacheEntry;
+
+static char*	downloadCachePath(char const* name)
+{
+	return(g_build_filename(gDownload.cache.directory, name, NULL));
 }
 
-#define kMaxChunksize (128 * 1024)
+static void		downloadCacheEntryFree(DownloadCacheEntry* entry)
+{
+	g_free(entry->url);
+	g_free(entry->etag);
+	g_free(entry->lastModified);
+	g_free(entry->hash);
+	g_free(entry);
+}
 
-static void		downloadPushProgressItem(Download* context)
+static gboolean	downloadCacheHashInUse(char const* hash)
 {
-	if(context->currentProgressItem != 0)
+	GList* link;
+	for(link = gDownload.cache.entries; link != 0; link = link->next)
+		if(!strcmp(((DownloadCacheEntry*)link->data)->hash, hash))
+			return(TRUE);
+	return(FALSE);
+}
+
+// The index has one line per entry, most recently used first:
+//   hash, size, last use, URL, ETag and Last-Modified, tab-separated.
+// The index is tab-separated lines, and the validators go back out
+//   in headers as they were received: a field is kept only if its
+//   bytes are all within [lowest, highest], so nothing can shift the
+//   fields or put a CR into a request (see downloadCacheEntryValid.)
+static int		downloadCacheFieldValid(char const* field, unsigned char lowest, unsigned char highest)
+{
+	for(; *field != 0; field++)
 	{
-		DebugPrintf("+downloadPushProgressItem len=%i loaded=%i / %i\n", context->currentProgressItem->length, context->bytesLoaded, context->bytesExpected);
-		context->currentProgressItem->bytesExpected = context->bytesExpected;
-		context->currentProgressItem->bytesLoaded = context->bytesLoaded;
+		if(((unsigned char)*field < lowest) || ((unsigned char)*field > highest))
+			return(0);
+	}
+	return(1);
+}
 
-		context->currentProgressItem->context = context;
-		context->outstandingProgressItems++;
+// an ETag is visible ASCII (which includes the quotes and "W/"), a date printable ASCII, a URL anything but controls
+static int		downloadCacheEntryValid(char const* url, char const* etag, char const* lastModified)
+{
+	return(downloadCacheFieldValid(url, 0x20, 0xFF) && downloadCacheFieldValid(etag, 0x21, 0x7E) && downloadCacheFieldValid(lastModified, 0x20, 0x7E));
+}
 
-		g_async_queue_push(gDownload.progressQueue, context->currentProgressItem);
-		context->currentProgressItem = 0;
-		DebugPrintf("-downloadPushProgressItem\n");
+static DownloadCacheEntry*	downloadCacheEntryParse(char const* line)
+{
+	DownloadCacheEntry* entry = 0;
+	gchar** fields = g_strsplit(line, "\t", 6);
+	if((g_strv_length(fields) == 6) && downloadCacheEntryValid(fields[3], fields[4], fields[5]))
+	{
+		entry = g_new(DownloadCacheEntry, 1);
+		entry->hash = g_strdup(fields[0]);
+		entry->size = (size_t)strtoul(fields[1], 0, 10);
+		entry->lastUse = g_ascii_strtoll(fields[2], 0, 10);
+		entry->url = g_strdup(fields[3]);
+		entry->etag = g_strdup(fields[4]);
+		entry->lastModified = g_strdup(fields[5]);
 	}
+	g_strfreev(fields);
+	return(entry);
+}
 
-	g_thread_yield();
+// (curlThread, or before it starts) the cache's numbers, for DownloadGetCacheStats()
+static void		downloadCachePublish(void)
+{
+	g_atomic_int_set(&gDownload.cache.statEntries, (int)g_list_length(gDownload.cache.entries));
+	g_atomic_int_set(&gDownload.cache.statKB, (int)(gDownload.cache.size / 1024));
+	g_atomic_int_set(&gDownload.cache.statCapacityKB, (int)(gDownload.cache.capacity / 1024));
 }
 
-static size_t	onCURLDownloadSegment(void* segment, size_t count, size_t elements, void* user)
+static void		downloadCacheSave(void)
 {
-	DebugPrintf("+onCURLDownloadSegment len=%i\n", count * elements);
-	downloadRecycleProgressItems();
+	downloadCachePublish();	// (every change to the index is saved)
+	GString* index = g_string_new(0);
 
-	Download* context = (Download*)user;
-	size_t segmentLength = count * elements;
+	GList* link;
+	for(link = gDownload.cache.entries; link != 0; link = link->next)
+	{
+		DownloadCacheEntry* entry = (DownloadCacheEntry*)link->data;
+		g_string_append_printf(index, "%s\t%lu\t%" G_GINT64_FORMAT "\t%s\t%s\t%s\n", entry->hash, (unsigned long)entry->size, entry->lastUse, entry->url, entry->etag, entry->lastModified);
+	}
 
-	while(segmentLength > 0)
+	char* path = downloadCachePath("index");
+	if(!g_file_set_contents(path, index->str, index->len, 0))	// (atomic: written aside and renamed)
+		DebugPrintf("*downloadCacheSave failed\n");
+	g_free(path);
+	g_string_free(index, TRUE);
+}
+
+static void		downloadCacheLoad(void)
+{
+	DebugPrintf("+downloadCacheLoad\n");
+	char* path = downloadCachePath("index");
+	gchar* contents = 0;
+
+	if(g_file_get_contents(path, &contents, 0, 0))
 	{
-		DebugPrintf("+onCURLDownloadSegment inner len=%i\n", segmentLength);
-		if(context->currentProgressItem != 0)
+		gchar** lines = g_strsplit(contents, "\n", -1);
+		int i;
+		for(i = 0; lines[i] != 0; i++)
 		{
-			size_t chunkSize = MIN(kMaxChunksize - context->currentProgressItem->length, segmentLength);
-			
-			DebugPrintf("+onCURLDownloadSegment fill chunkSize=%i\n", chunkSize);
-			
-			memcpy(context->currentProgressItem->chunk + context->currentProgressItem->length, segment, chunkSize);
-			context->currentProgressItem->length += segmentLength;
-			context->bytesLoaded += chunkSize;
-			segmentLength -= chunkSize;
-			segment = (void*)(((unsigned char*)segment) + segmentLength);
+			DownloadCacheEntry* entry = downloadCacheEntryParse(lines[i]);
+			if(entry == 0)
+				continue;
 
-			if(context->currentProgressItem->length == kMaxChunksize)
+			char* file = downloadCachePath(entry->hash);
+			if(g_file_test(file, G_FILE_TEST_IS_REGULAR))
 			{
-				DebugPrintf("*onCURLDownloadSegment push\n");
-				downloadPushProgressItem(context);
+				gDownload.cache.entries = g_list_prepend(gDownload.cache.entries, entry);
+				gDownload.cache.size += entry->size;
 			}
-			
-			DebugPrintf("-onCURLDownloadSegment fill\n");
+			else
+				downloadCacheEntryFree(entry);
+			g_free(file);
 		}
+		g_strfreev(lines);
+		g_free(contents);
 
-		if(context->currentProgressItem == 0)
-		{
-			DebugPrintf("+onCURLDownloadSegment reload\n");
-			
-			context->currentProgressItem = (DownloadProgressItem*)malloc(sizeof(DownloadProgressItem));
-			DebugPrintf("malloc(DownloadProgressItem) %p\n", context->currentProgressItem);
-
-			context->currentProgressItem->chunk = malloc(kMaxChunksize);
-			DebugPrintf("malloc(kMaxChunksize) %p\n", context->currentProgressItem->chunk);
-			context->currentProgressItem->length = 0;
+		gDownload.cache.entries = g_list_reverse(gDownload.cache.entries);
+	}
+	g_free(path);
 
-			DebugPrintf("-onCURLDownloadSegment reload\n");
+	// remove bodies the index doesn't know (a transfer or save cut short by a crash)
+	GDir* directory = g_dir_open(gDownload.cache.directory, 0, 0);
+	if(directory != 0)
+	{
+		char const* name;
+		while((name = g_dir_read_name(directory)) != 0)
+		{
+			char* file = downloadCachePath(name);
+			if(strcmp(name, "index") && !downloadCacheHashInUse(name) && g_file_test(file, G_FILE_TEST_IS_REGULAR))
+			{
+				DebugPrintf("*downloadCacheLoad remove stray %s\n", name);
+				remove(file);
+			}
+			g_free(file);
 		}
+		g_dir_close(directory);
+	}
+	DebugPrintf("-downloadCacheLoad %u entries, %lu bytes\n", g_list_length(gDownload.cache.entries), (unsigned long)gDownload.cache.size);
+}
 
-		DebugPrintf("-onCURLDownloadSegment inner len=%i\n", segmentLength);
+// the entry for 'url' with the given ETag, or (etag == 0) the most recently used entry for 'url'
+static GList*	downloadCacheFind(char const* url, char const* etag)
+{
+	GList* link;
+	for(link = gDownload.cache.entries; link != 0; link = link->next)
+	{
+		DownloadCacheEntry* entry = (DownloadCacheEntry*)link->data;
+		if(!strcmp(entry->url, url) && ((etag == 0) || !strcmp(entry->etag, etag)))
+			return(link);
 	}
+	return(0);
+}
 
-	DebugPrintf("-onCURLDownloadSegment\n");
-	return(count * elements);
+static void		downloadCacheRemove(GList* link)
+{
+	DownloadCacheEntry* entry = (DownloadCacheEntry*)link->data;
+	DebugPrintf("*downloadCacheRemove %s\n", entry->hash);
+
+	gDownload.cache.entries = g_list_delete_link(gDownload.cache.entries, link);
+	gDownload.cache.size -= entry->size;
+
+	if(!downloadCacheHashInUse(entry->hash))	// (bodies are shared by content)
+	{
+		char* file = downloadCachePath(entry->hash);
+		remove(file);
+		g_free(file);
+	}
+	downloadCacheEntryFree(entry);
 }
 
-static int		onCURLDownloadProgress(void* user, double dlTotal, double dlCurrent, double ulTotal, double ulCurrent)
+// Sets up the conditional request (adding to the download's
+//   requestHeaders) and response header capture for a download;
+//   called after downloadSetupTransfer().
+static void		downloadCacheBegin(CURL* curl, Download* download)
 {
-	DebugPrintf("+onCURLDownloadProgress\n");
-	(void)ulTotal;
-	(void)ulCurrent;
+	memset(&download->cache, 0, sizeof(download->cache));
+	if(!download->options.cache || (gDownload.cache.directory == 0))
+		return;
 
-	Download* context = (Download*)user;
+	download->cache.active = 1;
+	curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, &onCURLDownloadHeader);
+	curl_easy_setopt(curl, CURLOPT_HEADERDATA, (void*)download);
 
-	context->bytesExpected = (size_t)dlTotal;
-	context->bytesLoaded = (size_t)dlCurrent;
+	if((download->peer.state == kDownloadPeerFetching) || (download->unconditional != 0))
+		return;	// (unconditional: stored under the origin's validator, or after a 304 that named nothing held)
 
-	DebugPrintf("-onCURLDownloadProgress\n");
-	return(0);
+	GString* header = g_string_new("If-None-Match: ");
+	DownloadCacheEntry* newest = 0;
+	int etags = 0;
+
+	GList* link;
+	for(link = gDownload.cache.entries; link != 0; link = link->next)
+	{
+		DownloadCacheEntry* entry = (DownloadCacheEntry*)link->data;
+		if(strcmp(entry->url, download->options.url))
+			continue;
+
+		if(newest == 0)
+			newest = entry;
+		if((entry->etag[0] != 0) && (etags < kDownloadCacheMaxValidators))
+			g_string_append_printf(header, "%s%s", (etags++ > 0)? ", " : "", entry->etag);
+	}
+	if(download->peer.state != kDownloadPeerFallback)
+		etags = downloadPeerAddValidators(header, download->options.url, etags);
+
+	if(etags > 0)
+		download->requestHeaders = curl_slist_append(download->requestHeaders, header->str);
+	else if((newest != 0) && (newest->lastModified[0] != 0))
+	{
+		// no ETags: only dates, which can only describe a single resource
+		char* since = g_strdup_printf("If-Modified-Since: %s", newest->lastModified);
+		download->requestHeaders = curl_slist_append(download->requestHeaders, since);
+		download->cache.dated = 1;
+		g_free(since);
+	}
+	g_string_free(header, TRUE);
 }
 
-static gpointer	curlThread(gpointer info)
+static size_t	onCURLDownloadHeader(char* buffer, size_t count, size_t elements, void* user)
 {
-	DebugPrintf("+curlThread\n");
-	g_async_queue_ref(gDownload.jobQueue);
-	g_async_queue_ref(gDownload.resultsQueue);
-	g_async_queue_ref(gDownload.progressQueue);
-	g_async_queue_ref(gDownload.progressRecycleQueue);
+	Download* download = (Download*)user;
+	size_t length = count * elements;
+	char* line = g_strstrip(g_strndup(buffer, length));
 
-	while(1)
+	if(download->options.headerCallback != 0)
+		download->options.headerCallback(&download->options, line);
+
+	if(!download->cache.active)
 	{
-		DebugPrintf("+curlThread wait\n");
+		g_free(line);
+		return(length);	// (only here for headerCallback)
+	}
 
-		// wait for a new job
-		Download* download = g_async_queue_pop(gDownload.jobQueue);
+	if(!strncmp(line, "HTTP/", 5))
+	{
+		// a new response (e.g. after a redirect): the validators so far were someone else's
+		char const* status = strchr(line, ' ');
+		download->cache.status = (status != 0)? strtol(status + 1, 0, 10) : 0;
 
-		DebugPrintf("-curlThread wait\n");
-		
-		if(download == 0)	// shutdown token
+		g_free(download->cache.etag);
+		g_free(download->cache.lastModified);
+		download->cache.etag = download->cache.lastModified = 0;
+	}
+	else if(!g_ascii_strncasecmp(line, "ETag:", 5))
+	{
+		g_free(download->cache.etag);
+		download->cache.etag = g_strdup(g_strstrip(line + 5));
+	}
+	else if(!g_ascii_strncasecmp(line, "Last-Modified:", 14))
+	{
+		g_free(download->cache.lastModified);
+		download->cache.lastModified = g_strdup(g_strstrip(line + 14));
+	}
+
+	g_free(line);
+	return(length);
+}
+
+// stores a segment of a 200 body that can be revalidated later
+static void		downloadCacheWrite(Download* download, void const* data, size_t length)
+{
+	if(!download->cache.active || download->cache.failed || (download->cache.status != 200))
+		return;
+
+	if(download->cache.file == 0)
+	{
+		if((download->cache.etag == 0) && (download->cache.lastModified == 0) && (download->peer.etag == 0))
 		{
-			DebugPrintf("*curlThread shutdown\n");
-			break;
+			download->cache.failed = 1;	// no validator, so it could never be revalidated
+			return;
+		}
+		if(!downloadCacheEntryValid(download->options.url, (download->cache.etag != 0)? download->cache.etag : "",
+			(download->cache.lastModified != 0)? download->cache.lastModified : ""))
+		{
+			DebugPrintf("*downloadCacheWrite can't index %s\n", download->options.url);
+			download->cache.failed = 1;	// (it couldn't be read back, or sent back)
+			return;
 		}
 
-		CURL* curl = curl_easy_init();
-		if(curl == 0)
+		download->cache.tempPath = downloadCachePath("partial-XXXXXX");
+		int fd = g_mkstemp(download->cache.tempPath);
+		if((fd < 0) || ((download->cache.file = fdopen(fd, "wb")) == 0))
 		{
-			DebugPrintf("*curlThread curl init error\n");
-			download->result = 0;
-			download->reason = "curl-init-error";
-			g_async_queue_push(gDownload.resultsQueue, download);
-			continue;
+			DebugPrintf("*downloadCacheWrite can't create %s\n", download->cache.tempPath);
+			if(fd >= 0)
+				close(fd);
+			g_free(download->cache.tempPath);
+			download->cache.tempPath = 0;
+			download->cache.failed = 1;
+			return;
 		}
+		download->cache.checksum = g_checksum_new(G_CHECKSUM_SHA256);
+	}
+
+	download->cache.stored += length;
+	if((download->cache.stored > gDownload.cache.capacity) || (fwrite(data, 1, length, download->cache.file) != length))
+	{
+		download->cache.failed = 1;	// (too large for the cache, or out of space)
+		return;
+	}
+	g_checksum_update(download->cache.checksum, (guchar const*)data, length);
+}
 
-		// set up the curl session
-		curl_easy_setopt(curl, CURLOPT_URL, (void*)download->options.url);
+// feeds a cached body to the download as if it had just arrived
+static int		downloadCacheReplay(Download* download, DownloadCacheEntry const* entry)
+{
+	char* path = downloadCachePath(entry->hash);
+	FILE* file = fopen(path, "rb");
+	g_free(path);
+	if(file == 0)
+		return(0);
 
-		// register progressive download (write) callback
-		curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, &onCURLDownloadSegment);
-		curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void*)download);
+	unsigned char* buffer = (unsigned char*)malloc(kMaxChunksize);
+	size_t length;
+	int ok = 1;
 
-		curl_easy_setopt(curl, CURLOPT_USERAGENT, "piframe-1.0/libcurl");
+	download->bytesExpected = entry->size;
+	while(ok && ((length = fread(buffer, 1, kMaxChunksize, file)) > 0))
+		ok = (onCURLDownloadSegment(buffer, 1, length, download) == length);
+	ok = ok && !ferror(file);
 
-		curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L);
-		curl_easy_setopt(curl, CURLOPT_PROGRESSFUNCTION, &onCURLDownloadProgress);
-		curl_easy_setopt(curl, CURLOPT_PROGRESSDATA, (void*)download);
+	free(buffer);
+	fclose(file);
+	return(ok);
+}
 
-		DebugPrintf("+curlThread active\n");
-		int result = curl_easy_perform(curl);
-		DebugPrintf("-curlThread active, result=%i\n", result);
+// After the transfer: files a complete body away, or serves a 304
+//   from disk.  Returns the download's result.
+static int		downloadCacheFinish(Download* download, int result)
+{
+	if(!download->cache.active)
+		return(result);
 
-		downloadPushProgressItem(download);
+	if(download->cache.file != 0)
+	{
+		int stored = (fclose(download->cache.file) == 0) && !download->cache.failed && (result == CURLE_OK);
+		if(stored)
+		{
+			char* hash = g_strdup(g_checksum_get_string(download->cache.checksum));
+			char const* etag = (download->peer.etag != 0)? download->peer.etag : (download->cache.etag != 0)? download->cache.etag : "";
+			GList* link;
 
-		curl_easy_cleanup(curl);
+			// (a body from a peer must be the one the origin named)
+			if((download->peer.hash != 0) && strcmp(hash, download->peer.hash))
+			{
+				DebugPrintf("*downloadCacheFinish peer sent %s for %s\n", hash, download->peer.hash);
+				download->abortReason = "peer-mismatch";
+				result = CURLE_READ_ERROR;
+				stored = 0;
+			}
 
-		download->result = result;
-		download->reason = "curl-done";
+			// this replaces what was stored for the same URL and ETag (or date)
+			while(stored && ((link = downloadCacheFind(download->options.url, etag)) != 0))
+				downloadCacheRemove(link);
 
-		g_async_queue_push(gDownload.resultsQueue, download);
+			if(stored)
+			{
+				char* path = downloadCachePath(hash);
+				stored = (rename(download->cache.tempPath, path) == 0);
+				g_free(path);
+			}
 
-		downloadRecycleProgressItems();
+			if(stored)
+			{
+				DownloadCacheEntry* entry = g_new(DownloadCacheEntry, 1);
+				entry->url = g_strdup(download->options.url);
+				entry->etag = g_strdup(etag);
+				entry->lastModified = g_strdup((download->cache.lastModified != 0)? download->cache.lastModified : "");
+				entry->hash = hash;
+				entry->size = download->cache.stored;
+				entry->lastUse = g_get_real_time();
+
+				gDownload.cache.entries = g_list_prepend(gDownload.cache.entries, entry);
+				gDownload.cache.size += entry->size;
+				DebugPrintf("*downloadCacheFinish stored %s, %lu bytes\n", hash, (unsigned long)entry->size);
+
+				if(download->options.contentCallback != 0)
+					download->options.contentCallback(&download->options, hash, 0);
+
+				while((gDownload.cache.size > gDownload.cache.capacity) && (gDownload.cache.entries != 0))
+					downloadCacheRemove(g_list_last(gDownload.cache.entries));
+				downloadCacheSave();
+			}
+			else
+				g_free(hash);
+		}
+		if(!stored)
+			remove(download->cache.tempPath);
 	}
+	else if((result == CURLE_OK) && (download->cache.status == 304))
+	{
+		// Not modified: the ETag names the match, or for a date the URL's
+		//   one entry.  Without an ETag, a 304 to If-None-Match could mean
+		//   any of the entries asked about, so it matches none of them.
+		GList* link = (download->cache.etag != 0)? downloadCacheFind(download->options.url, download->cache.etag)
+			: download->cache.dated? downloadCacheFind(download->options.url, 0) : 0;
+		DebugPrintf("*downloadCacheFinish 304 %s\n", (link != 0)? "hit" : "miss");
+
+		DownloadCacheEntry* entry = (link != 0)? (DownloadCacheEntry*)link->data : 0;
+		if((entry == 0) && (download->cache.etag != 0) && (download->peer.state == kDownloadPeerNone)
+			&& ((download->peer.url = downloadPeerFind(download->options.url, download->cache.etag, &download->peer.hash)) != 0))
+		{
+			DebugPrintf("*downloadCacheFinish 304 from peer %s\n", download->peer.url);
+			download->peer.state = kDownloadPeerFound;	// (downloadFinishTransfer() restarts it)
+			download->peer.etag = g_strdup(download->cache.etag);
+		}
 
-	downloadRecycleProgressItems();
+		int serve = (entry != 0) && ((download->options.contentCallback == 0) || download->options.contentCallback(&download->options, entry->hash, 1));
 
-	g_async_queue_unref(gDownload.jobQueue);
-	g_async_queue_unref(gDownload.resultsQueue);
-	g_async_queue_unref(gDownload.progressQueue);
-	g_async_queue_unref(gDownload.progressRecycleQueue);
+		if((entry != 0) && (!serve || downloadCacheReplay(download, entry)))
+		{
+			((DownloadCacheEntry*)link->data)->lastUse = g_get_real_time();
+			gDownload.cache.entries = g_list_remove_link(gDownload.cache.entries, link);
+			gDownload.cache.entries = g_list_concat(link, gDownload.cache.entries);
+			downloadCacheSave();
+		}
+		else
+		{
+			if(link != 0)
+				downloadCacheRemove(link);	// (its body is gone)
+			result = CURLE_READ_ERROR;
 
-	DebugPrintf("-curlThread\n");
-	return(0);
+			// nothing delivered yet: ask the origin again, for the body itself (see downloadFinishTransfer())
+			if((download->peer.state != kDownloadPeerFound) && (download->unconditional == 0) && (download->bytesLoaded == 0))
+				download->unconditional = 1;
+		}
+	}
+
+	if(download->cache.checksum != 0)
+		g_checksum_free(download->cache.checksum);
+	g_free(download->cache.tempPath);
+	g_free(download->cache.etag);
+	g_free(download->cache.lastModified);
+	memset(&download->cache, 0, sizeof(download->cache));
+
+	return(result);
 }
 
+// Serves a download whose body the cache holds under options.hash
+//   without asking the server, as a 304 is served.  Returns the
+//   download's result, or -1 if it has to be requested after all.
+static int		downloadCacheServe(Download* download)
+{
+	if((download->options.hash == 0) || !download->options.cache || (gDownload.cache.directory == 0))
+		return(-1);
 
+	GList* link;
+	for(link = gDownload.cache.entries; link != 0; link = link->next)
+		if(!strcmp(((DownloadCacheEntry*)link->data)->hash, download->options.hash))
+			break;
+	if(link == 0)
+		return(-1);
 
-////////////////////////////////////////////////////////////////
-////////////////////////////////////////////////////////////////
-//
-// ImageDownload subsystem: uses Download to fetch an image
-//   and incrementally load it into a GdkPixbuf for use in the
-//   application UI.
-//
-////////////////////////////////////////////////////////////////
+	DownloadCacheEntry* entry = (DownloadCacheEntry*)link->data;
+	int serve = (download->options.contentCallback == 0) || download->options.contentCallback(&download->options, entry->hash, 1);
+	DebugPrintf("*downloadCacheServe %s%s\n", entry->hash, serve? "" : " (skipped)");
 
-typedef struct ImageDownloadOptions
-{
-	char const*			url;
-	void				(*completeCallback)(void* context, GdkPixbuf* pixels, GError* error);
-	void*				context;
+	if(serve && !downloadCacheReplay(download, entry))
+	{
+		downloadCacheRemove(link);	// (its body is gone)
+		downloadCacheSave();
+		if(download->bytesLoaded > 0)
+			return(CURLE_READ_ERROR);
+		download->bytesExpected = 0;
+		return(-1);
+	}
 
-} ImageDownloadOptions;
+	entry->lastUse = g_get_real_time();
+	gDownload.cache.entries = g_list_remove_link(gDownload.cache.entries, link);
+	gDownload.cache.entries = g_list_concat(link, gDownload.cache.entries);
+	downloadCacheSave();
 
+	download->served = 1;
+	return(CURLE_OK);
+}
 
-typedef struct ImageDownload
+////////////////////////////////////////////////////////////////
+// Peers: frames on the same LAN can share their disk caches, so
+//   a site fetches each photo over its uplink once.  A frame with
+//   peerPort serves its cache's index and bodies over plain HTTP
+//   (GET /piframe/index, GET /piframe/photo/<hash>) from a small
+//   thread pool of its own.  A frame with peers refreshes their
+//   indexes every kDownloadPeerRefreshMS and adds the ETags they
+//   hold for a URL to its If-None-Match; when the origin's 304
+//   names one that only a peer has, the same Download is restarted
+//   against that peer, stored under the origin's URL and ETag, and
+//   checked against the hash.  If the peer can't deliver before
+//   any of the body arrives, the request goes back to the origin
+//   without the peers' ETags.  Peers are listed, not discovered,
+//   and not authenticated: the service answers anyone who can reach
+//   it (on peerAddress only, when that's given.)
+
+typedef struct DownloadPeer
 {
-	ImageDownloadOptions	options;
-	GdkPixbufLoader*		loader;
-	Download*				download;
-	
-	int						refcount;
+	char*			base;		// "http://host:port"
+	GList*			entries;	// DownloadCacheEntry instances from its last index (under peerLock)
+	GByteArray*		index;		// the index being downloaded, 0 when none is (see onDownloadPeerIndexData)
+
+} DownloadPeer;
+
+#define kDownloadPeerPort (8370)
+#define kDownloadPeerRefreshMS (15000)
+#define kDownloadPeerThreads (4)		// requests served at once
+#define kDownloadPeerTimeout (10)		// seconds a peer connection may sit idle
+#define kDownloadPeerHashLength (64)	// hex SHA-256
+#define kDownloadPeerIndexMaxBytes (8 * 1024 * 1024)	// a longer index fails (and the last one is kept)
+
+// Looks for a peer holding the body the origin named (curlThread).
+//   Returns the URL to fetch it from, and its hash, or 0.
+static char*	downloadPeerFind(char const* url, char const* etag, char** outHash)
+{
+	char* found = 0;
+	unsigned int p;
 
-} ImageDownload;
+	g_mutex_lock(&gDownload.peerLock);
+	for(p = 0; (gDownload.peers != 0) && (p < gDownload.peers->len) && (found == 0); p++)
+	{
+		DownloadPeer* peer = (DownloadPeer*)g_ptr_array_index(gDownload.peers, p);
+		GList* link;
+		for(link = peer->entries; link != 0; link = link->next)
+		{
+			DownloadCacheEntry* entry = (DownloadCacheEntry*)link->data;
+			if(!strcmp(entry->url, url) && !strcmp(entry->etag, etag))
+			{
+				found = g_strdup_printf("%s/piframe/photo/%s", peer->base, entry->hash);
+				*outHash = g_strdup(entry->hash);
+				break;
+			}
+		}
+	}
+	g_mutex_unlock(&gDownload.peerLock);
 
+	return(found);
+}
 
-void	onImageDownloadProgress(DownloadOptions const* download, unsigned char const* data, size_t length, size_t received, size_t expected);
-void	onImageDownloadComplete(DownloadOptions const* download, int result, char const* reason);
+// adds the ETags peers hold for 'url' (and this cache doesn't) to an If-None-Match list (curlThread)
+static int		downloadPeerAddValidators(GString* header, char const* url, int etags)
+{
+	unsigned int p;
 
+	g_mutex_lock(&gDownload.peerLock);
+	for(p = 0; (gDownload.peers != 0) && (p < gDownload.peers->len); p++)
+	{
+		DownloadPeer* peer = (DownloadPeer*)g_ptr_array_index(gDownload.peers, p);
+		GList* link;
+		for(link = peer->entries; (link != 0) && (etags < kDownloadCacheMaxValidators); link = link->next)
+		{
+			DownloadCacheEntry* entry = (DownloadCacheEntry*)link->data;
+			if((entry->etag[0] != 0) && !strcmp(entry->url, url) && (downloadCacheFind(url, entry->etag) == 0))
+				g_string_append_printf(header, "%s%s", (etags++ > 0)? ", " : "", entry->etag);
+		}
+	}
+	g_mutex_unlock(&gDownload.peerLock);
 
-ImageDownload*		ImageDownloadNew(ImageDownloadOptions const* options)
-{
-	DebugPrintf("+ImageDownloadInit\n");
-	ImageDownload* imageDownload = (ImageDownload*)malloc(sizeof(ImageDownload));
-	DebugPrintf("malloc(ImageDownload) %p\n", imageDownload);
-	
-	imageDownload->options.url = strdup(options->url);
-	DebugPrintf("strdup(url), %p\n", imageDownload->options.url);
-	imageDownload->options.completeCallback = options->completeCallback;
-	imageDownload->options.context = options->context;
+	return(etags);
+}
 
-	imageDownload->loader = gdk_pixbuf_loader_new();
+// curlThread: a peer's index arriving
+static int		onDownloadPeerIndexData(DownloadOptions const* download, unsigned char const* data, size_t length)
+{
+	DownloadPeer* peer = (DownloadPeer*)download->context;
+	if(length > kDownloadPeerIndexMaxBytes - peer->index->len)
+		return(0);	// (fails the transfer)
+	g_byte_array_append(peer->index, data, (guint)length);
+	return(1);
+}
 
-	imageDownload->refcount = 2;	// own reference and 
+// main thread: replace what's known of the peer's cache (kept as it was if the peer didn't answer)
+static void		onDownloadPeerIndexComplete(DownloadOptions const* download, int result, char const* reason)
+{
+	DownloadPeer* peer = (DownloadPeer*)download->context;
+	DebugPrintf("*onDownloadPeerIndexComplete %s result=%i (%s), %u bytes\n", peer->base, result, reason, peer->index->len);
 
-	DownloadOptions downloadOptions =
+	if(result == CURLE_OK)
 	{
-		.url = imageDownload->options.url,
-		.progressCallback = &onImageDownloadProgress,
-		.completeCallback = &onImageDownloadComplete,
-		.context = (void*)imageDownload
-	};
-	
-	imageDownload->download = DownloadNew(&downloadOptions);
-	DebugPrintf("-ImageDownloadInit\n");
-	return(imageDownload);
+		GList* entries = 0;
+		g_byte_array_append(peer->index, (guint8 const*)"", 1);
+		gchar** lines = g_strsplit((gchar const*)peer->index->data, "\n", -1);
+		int i;
+		for(i = 0; lines[i] != 0; i++)
+		{
+			DownloadCacheEntry* entry = downloadCacheEntryParse(lines[i]);
+			if(entry != 0)
+				entries = g_list_prepend(entries, entry);
+		}
+		g_strfreev(lines);
+
+		g_mutex_lock(&gDownload.peerLock);
+		GList* old = peer->entries;
+		peer->entries = g_list_reverse(entries);
+		g_mutex_unlock(&gDownload.peerLock);
+
+		g_list_free_full(old, (GDestroyNotify)&downloadCacheEntryFree);
+	}
+
+	g_byte_array_unref(peer->index);
+	peer->index = 0;
 }
 
-void				ImageDownloadStop(ImageDownload* download)
+// main thread: ask every peer that isn't still answering the last time for its index
+static gboolean	onDownloadPeerRefresh(gpointer user)
 {
-	// @@signal Download instance to stop, when it does (asynchronously), --refcount and free if 0
-}
+	(void)user;
+	unsigned int p;
+	for(p = 0; p < gDownload.peers->len; p++)
+	{
+		DownloadPeer* peer = (DownloadPeer*)g_ptr_array_index(gDownload.peers, p);
+		if(peer->index != 0)
+			continue;
 
+		char* url = g_strdup_printf("%s/piframe/index", peer->base);
+		DownloadOptions options =
+		{
+			.url = url,
+			.completeCallback = &onDownloadPeerIndexComplete,
+			.context = (void*)peer,
+			.streamCallback = &onDownloadPeerIndexData,
+			.failOnError = 1,
+			.priority = -1,	// (behind every photo)
+		};
+		peer->index = g_byte_array_new();
+		DownloadNew(&options);
+		g_free(url);
+	}
+	return(G_SOURCE_CONTINUE);
+}
 
-void				onImageDownloadProgress(DownloadOptions const* download, unsigned char const* data, size_t length, size_t received, size_t expected)
+// Serves one request from a peer on one of the service's threads.
+//   Everything served is a file in the cache directory: bodies are
+//   only ever renamed into place, and one evicted while it's being
+//   sent stays readable until it's closed.
+static gboolean	onDownloadPeerRequest(GThreadedSocketService* service, GSocketConnection* connection, GObject* source, gpointer user)
 {
-	DebugPrintf("+onImageDownloadProgress length=%i\n", length);
-	ImageDownload* imageDownload = (ImageDownload*)download->context;
+	(void)service;
+	(void)source;
+	(void)user;
+	g_socket_set_timeout(g_socket_connection_get_socket(connection), kDownloadPeerTimeout);
+
+	GOutputStream* output = g_io_stream_get_output_stream(G_IO_STREAM(connection));
+	GDataInputStream* input = g_data_input_stream_new(g_io_stream_get_input_stream(G_IO_STREAM(connection)));
+	g_data_input_stream_set_newline_type(input, G_DATA_STREAM_NEWLINE_TYPE_ANY);
+
+	// "GET <path> HTTP/1.x", then headers up to an empty line (ignored)
+	char* request = g_data_input_stream_read_line(input, 0, 0, 0);
+	char* line;
+	while(((line = g_data_input_stream_read_line(input, 0, 0, 0)) != 0) && (line[0] != 0))
+		g_free(line);
+	g_free(line);
+
+	char* name = 0;
+	gchar** words = (request != 0)? g_strsplit(request, " ", 3) : 0;
+	if((words != 0) && (g_strv_length(words) >= 2) && !strcmp(words[0], "GET"))
+	{
+		char const* photo = "/piframe/photo/";
+		if(!strcmp(words[1], "/piframe/index"))
+			name = g_strdup("index");
+		else if(g_str_has_prefix(words[1], photo) && (strlen(words[1] + strlen(photo)) == kDownloadPeerHashLength)
+			&& (strspn(words[1] + strlen(photo), "0123456789abcdef") == kDownloadPeerHashLength))
+			name = g_strdup(words[1] + strlen(photo));	// (hex only: nothing outside the cache)
+	}
+	g_strfreev(words);
 
-	GError* error = 0;
-	if(!gdk_pixbuf_loader_write(imageDownload->loader, data, length, &error))
+	char* path = (name != 0)? downloadCachePath(name) : 0;
+	FILE* file = (path != 0)? fopen(path, "rb") : 0;
+	DebugPrintf("*onDownloadPeerRequest \"%s\" %s\n", (request != 0)? request : "", (file != 0)? "ok" : "not found");
+
+	if(file != 0)
 	{
-		DebugPrintf("*onImageDownloadProgress loader err\n");
-		// @@stop download
+		fseek(file, 0, SEEK_END);
+		long size = ftell(file);
+		fseek(file, 0, SEEK_SET);
+
+		char* head = g_strdup_printf("HTTP/1.1 200 OK\r\nContent-Length: %ld\r\nContent-Type: application/octet-stream\r\nConnection: close\r\n\r\n", size);
+		gboolean ok = g_output_stream_write_all(output, head, strlen(head), 0, 0, 0);
+		g_free(head);
+
+		unsigned char* buffer = (unsigned char*)g_malloc(kMaxChunksize);
+		size_t length;
+		while(ok && ((length = fread(buffer, 1, kMaxChunksize, file)) > 0))
+			ok = g_output_stream_write_all(output, buffer, length, 0, 0, 0);
+		g_free(buffer);
+		fclose(file);
 	}
 	else
 	{
-		DebugPrintf("*onImageDownloadProgress loader happy\n");
+		char const* head = "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+		g_output_stream_write_all(output, head, strlen(head), 0, 0, 0);
 	}
-	DebugPrintf("-onImageDownloadProgress\n");
+
+	g_free(path);
+	g_free(name);
+	g_free(request);
+	g_object_unref(input);
+	return(TRUE);	// (the connection closes when it's released)
 }
 
-void				onImageDownloadComplete(DownloadOptions const* download, int result, char const* reason)
+static void		downloadPeersInit(DownloadInitOptions const* options)
 {
-	DebugPrintf("+onImageDownloadComplete result=%i reason=%s\n", result, reason);
-	ImageDownload* imageDownload = (ImageDownload*)download->context;
-	
-	GError* error = 0;
-	if((result == CURLE_OK) && gdk_pixbuf_loader_close(imageDownload->loader, &error))
+	g_mutex_init(&gDownload.peerLock);
+	gDownload.peers = 0;
+	gDownload.peerService = 0;
+
+	if((options->peers != 0) && (options->peers[0] != 0) && (gDownload.cache.directory != 0))
 	{
-		DebugPrintf("+onImageDownloadComplete Download ok\n");
-		GdkPixbuf* pixels = gdk_pixbuf_loader_get_pixbuf(imageDownload->loader);
-		
-		// invoke callback
-		imageDownload->options.completeCallback(imageDownload->options.context, pixels, 0);
-		DebugPrintf("-onImageDownloadComplete Download ok\n");
+		gDownload.peers = g_ptr_array_new();
+		gchar** hosts = g_strsplit(options->peers, ",", -1);
+		int i;
+		for(i = 0; hosts[i] != 0; i++)
+		{
+			char* host = g_strstrip(hosts[i]);
+			if(host[0] == 0)
+				continue;
+
+			// "host", "host:port", "[v6]", "[v6]:port" or a bare v6 address (which gets brackets)
+			DownloadPeer* peer = g_new0(DownloadPeer, 1);
+			char const* colon = strrchr(host, ':');
+			char const* bracket = strrchr(host, ']');
+			if(host[0] == '[')
+				peer->base = ((bracket != 0) && (colon > bracket))? g_strdup_printf("http://%s", host) : g_strdup_printf("http://%s:%i", host, kDownloadPeerPort);
+			else if((colon != 0) && (strchr(host, ':') != colon))
+				peer->base = g_strdup_printf("http://[%s]:%i", host, kDownloadPeerPort);
+			else
+				peer->base = (colon != 0)? g_strdup_printf("http://%s", host) : g_strdup_printf("http://%s:%i", host, kDownloadPeerPort);
+			g_ptr_array_add(gDownload.peers, peer);
+			DebugPrintf("*downloadPeersInit peer %s\n", peer->base);
+		}
+		g_strfreev(hosts);
+
+		onDownloadPeerRefresh(0);	// (queued until curlThread is up)
+		g_timeout_add(kDownloadPeerRefreshMS, &onDownloadPeerRefresh, 0);
 	}
-	else
-	{
-		DebugPrintf("+onImageDownloadComplete Download error %i, \"%s\", loader error: %p\n", result, curl_easy_strerror(result), error);
+	else if(options->peers != 0)
+		g_warning("Peers need the disk cache, not using them");
 
-		if(result != CURLE_OK)
+	if((options->peerPort != 0) && (gDownload.cache.directory != 0))
+	{
+		GError* error = 0;
+		GSocketService* service = g_threaded_socket_service_new(kDownloadPeerThreads);
+		gboolean listening;
+		if(options->peerAddress != 0)
 		{
-			gdk_pixbuf_loader_close(imageDownload->loader, 0);	// (ignore any errors from this)
+			// (the index lists every cached URL, query strings and all: keep it to the LAN's interface)
+			GInetAddress* address = g_inet_address_new_from_string(options->peerAddress);
+			GSocketAddress* socketAddress = (address != 0)? g_inet_socket_address_new(address, (guint16)options->peerPort) : 0;
+			if(socketAddress != 0)
+				listening = g_socket_listener_add_address(G_SOCKET_LISTENER(service), socketAddress, G_SOCKET_TYPE_STREAM, G_SOCKET_PROTOCOL_TCP, 0, 0, &error);
+			else
+			{
+				listening = FALSE;
+				error = g_error_new(g_quark_from_static_string("piframe-peer-error-quark"), 0, "\"%s\" isn't an IP address", options->peerAddress);
+			}
+			if(socketAddress != 0)
+				g_object_unref(socketAddress);
+			if(address != 0)
+				g_object_unref(address);
+		}
+		else
+			listening = g_socket_listener_add_inet_port(G_SOCKET_LISTENER(service), (guint16)options->peerPort, 0, &error);
 
-			error = g_error_new_literal(g_quark_from_static_string("piframe-image-download-error-quark"), result, curl_easy_strerror(result));
+		if(listening)
+		{
+			g_signal_connect(service, "run", G_CALLBACK(&onDownloadPeerRequest), 0);
+			g_socket_service_start(service);
+			gDownload.peerService = service;
 		}
+		else
+		{
+			g_warning("Can't serve peers on port %u: %s", options->peerPort, error->message);
+			g_error_free(error);
+			g_object_unref(service);
+		}
+	}
+	else if(options->peerPort != 0)
+		g_warning("Serving peers needs the disk cache, not serving them");
+}
 
-		// invoke callback
-		imageDownload->options.completeCallback(imageDownload->options.context, 0, error);
+////////////////////////////////////////////////////////////////
+// Progress item pool: items and their chunks are allocated
+//   together, up to poolHighWater of them, and are returned
+//   to curlThread through progressRecycleQueue for reuse.
+//   These functions are only called on curlThread.
 
-		g_error_free(error);
+static void		downloadPoolRelease(DownloadProgressItem* progressItem)
+{
+	progressItem->context = 0;
+	progressItem->length = 0;
+	progressItem->nextIdle = gDownload.pool.idle;
+	gDownload.pool.idle = progressItem;
+	g_atomic_int_inc(&gDownload.pool.idleCount);
+}
 
-		DebugPrintf("-onImageDownloadComplete Download error\n");
+void			downloadRecycleProgressItems(void)
+{
+	DebugPrintf("+downloadRecycleProgressItems\n");
+	DownloadProgressItem* progressItem;
+	while((progressItem = g_async_queue_try_pop(gDownload.progressRecycleQueue)) != 0)
+	{
+		DebugPrintf("*downloadRecycleProgressItems item %p\n", progressItem);
+		downloadPoolRelease(progressItem);
 	}
+	DebugPrintf("-downloadRecycleProgressItems\n");
+}
 
-	g_object_unref(imageDownload->loader);
+static DownloadProgressItem*	downloadPoolAcquire(void)
+{
+	DownloadProgressItem* progressItem = gDownload.pool.idle;
 
-	DebugPrintf("free((void*)imageDownload->options.url) %p\n", (void*)imageDownload->options.url);
-	free((void*)imageDownload->options.url);
-	DebugPrintf("free(imageDownload) %p\n", imageDownload);
-	free(imageDownload);
-	
-	DebugPrintf("-onImageDownloadComplete\n");
+	if((progressItem == 0) && (g_atomic_int_get(&gDownload.pool.allocated) < gDownload.pool.highWater))
+	{
+		progressItem = (DownloadProgressItem*)malloc(sizeof(DownloadProgressItem) + kMaxChunksize);
+		DebugPrintf("malloc(DownloadProgressItem + kMaxChunksize) %p\n", progressItem);
+		progressItem->chunk = (void*)(progressItem + 1);
+		progressItem->context = 0;
+		progressItem->length = 0;
+
+		int allocated = g_atomic_int_get(&gDownload.pool.allocated) + 1;
+		g_atomic_int_set(&gDownload.pool.allocated, allocated);
+		if(allocated > g_atomic_int_get(&gDownload.pool.peak))
+			g_atomic_int_set(&gDownload.pool.peak, allocated);
+
+		return(progressItem);
+	}
+
+	if(progressItem == 0)
+	{
+		// at the ceiling: wait for the main thread to hand one back
+		DebugPrintf("*downloadPoolAcquire stall, %i allocated\n", gDownload.pool.allocated);
+		g_atomic_int_inc(&gDownload.pool.stalls);
+		downloadPoolRelease((DownloadProgressItem*)g_async_queue_pop(gDownload.progressRecycleQueue));
+		progressItem = gDownload.pool.idle;
+	}
+
+	gDownload.pool.idle = progressItem->nextIdle;
+	g_atomic_int_add(&gDownload.pool.idleCount, -1);
+	g_atomic_int_inc(&gDownload.pool.reused);
+
+	return(progressItem);
+}
+
+static void		downloadPoolDrain(void)
+{
+	downloadRecycleProgressItems();
+
+	DownloadProgressItem* progressItem;
+	while((progressItem = gDownload.pool.idle) != 0)
+	{
+		gDownload.pool.idle = progressItem->nextIdle;
+		DebugPrintf("free(progressItem) %p\n", progressItem);
+		free(progressItem);
+
+		g_atomic_int_add(&gDownload.pool.idleCount, -1);
+		g_atomic_int_add(&gDownload.pool.allocated, -1);
+	}
+}
+
+static void		downloadPushProgressItem(Download* context)
+{
+	if(context->currentProgressItem != 0)
+	{
+		DebugPrintf("+downloadPushProgressItem len=%i loaded=%i / %i\n", context->currentProgressItem->length, context->bytesLoaded, context->bytesExpected);
+		context->currentProgressItem->bytesExpected = context->bytesExpected;
+		context->currentProgressItem->bytesLoaded = context->bytesLoaded;
+
+		context->currentProgressItem->context = context;
+		context->currentProgressItem->queued = g_get_monotonic_time();
+		g_atomic_int_inc(&context->outstandingProgressItems);
+
+		g_async_queue_push(context->options.dispatcher->progressQueue, context->currentProgressItem);
+		context->currentProgressItem = 0;
+
+		downloadWake(context->options.dispatcher);
+		DebugPrintf("-downloadPushProgressItem\n");
+	}
+}
+
+static size_t	onCURLDownloadSegment(void* segment, size_t count, size_t elements, void* user)
+{
+	DebugPrintf("+onCURLDownloadSegment len=%i\n", count * elements);
+	downloadRecycleProgressItems();
+
+	Download* context = (Download*)user;
+	size_t segmentLength = count * elements;
+
+	if((context->options.cancel != 0) && g_atomic_int_get(context->options.cancel))
+	{
+		DebugPrintf("-onCURLDownloadSegment cancelled\n");
+		context->abortReason = "cancelled";
+		return(0);
+	}
+
+	downloadCacheWrite(context, segment, segmentLength);
+
+	if(context->options.streamCallback != 0)
+	{
+		// zero-copy: the consumer reads libcurl's own buffer
+		context->bytesLoaded += segmentLength;
+		if(!context->options.streamCallback(&context->options, (unsigned char const*)segment, segmentLength))
+		{
+			DebugPrintf("-onCURLDownloadSegment stream abort\n");
+			return(0);
+		}
+
+		DebugPrintf("-onCURLDownloadSegment stream\n");
+		return(segmentLength);
+	}
+
+	while(segmentLength > 0)
+	{
+		DebugPrintf("+onCURLDownloadSegment inner len=%i\n", segmentLength);
+		if(context->currentProgressItem == 0)
+		{
+			DebugPrintf("*onCURLDownloadSegment reload\n");
+			context->currentProgressItem = downloadPoolAcquire();
+		}
+
+		size_t chunkSize = MIN(kMaxChunksize - context->currentProgressItem->length, segmentLength);
+
+		DebugPrintf("+onCURLDownloadSegment fill chunkSize=%i\n", chunkSize);
+
+		memcpy((unsigned char*)context->currentProgressItem->chunk + context->currentProgressItem->length, segment, chunkSize);
+		context->currentProgressItem->length += chunkSize;
+		context->bytesLoaded += chunkSize;
+		segmentLength -= chunkSize;
+		segment = (void*)(((unsigned char*)segment) + chunkSize);
+
+		if(context->currentProgressItem->length == kMaxChunksize)
+		{
+			DebugPrintf("*onCURLDownloadSegment push\n");
+			downloadPushProgressItem(context);
+		}
+
+		DebugPrintf("-onCURLDownloadSegment fill\n");
+		DebugPrintf("-onCURLDownloadSegment inner len=%i\n", segmentLength);
+	}
+
+	DebugPrintf("-onCURLDownloadSegment\n");
+	return(count * elements);
+}
+
+static int		onCURLDownloadProgress(void* user, double dlTotal, double dlCurrent, double ulTotal, double ulCurrent)
+{
+	DebugPrintf("+onCURLDownloadProgress\n");
+	(void)ulTotal;
+	(void)ulCurrent;
+
+	Download* context = (Download*)user;
+
+	context->bytesExpected = (size_t)dlTotal;
+	context->bytesLoaded = (size_t)dlCurrent;
+
+	if((context->options.cancel != 0) && g_atomic_int_get(context->options.cancel))
+	{
+		DebugPrintf("-onCURLDownloadProgress cancelled\n");
+		context->abortReason = "cancelled";
+		return(1);
+	}
+
+	// (called about once a second even while nothing arrives)
+	gint64 now = g_get_monotonic_time();
+	if((context->lastArrival == 0) || (context->bytesLoaded != context->lastBytes))
+	{
+		context->lastArrival = now;
+		context->lastBytes = context->bytesLoaded;
+	}
+	else if((context->bytesLoaded > 0) && !context->options.idle && (gDownload.stallTimeoutMS > 0)
+		&& (now - context->lastArrival > 1000 * (gint64)gDownload.stallTimeoutMS))
+	{
+		DebugPrintf("-onCURLDownloadProgress stalled at %i bytes\n", context->bytesLoaded);
+		context->abortReason = "stalled";
+		return(1);
+	}
+
+	DebugPrintf("-onCURLDownloadProgress\n");
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////
+// Connection reuse: every transfer runs in curlThread's one
+//   multi handle, whose connection cache all of them share, and
+//   the easy handles are kept for reuse (curl_easy_reset() keeps
+//   their DNS and TLS session caches.)  A CURLSH share adds the
+//   DNS and TLS session caches across handles, so back-to-back
+//   requests to the same server reuse the keep-alive connection
+//   instead of paying a fresh DNS lookup, TCP handshake and TLS
+//   handshake.  Over HTTPS, libcurl negotiates HTTP/2 where the
+//   server supports it, and concurrent transfers to it wait for
+//   that connection and are multiplexed over it.
+
+static GMutex	gDownloadShareLocks[CURL_LOCK_DATA_LAST];
+
+static void		onCURLShareLock(CURL* curl, curl_lock_data data, curl_lock_access access, void* user)
+{
+	(void)curl;
+	(void)access;
+	(void)user;
+	g_mutex_lock(&gDownloadShareLocks[data]);
+}
+
+static void		onCURLShareUnlock(CURL* curl, curl_lock_data data, void* user)
+{
+	(void)curl;
+	(void)user;
+	g_mutex_unlock(&gDownloadShareLocks[data]);
+}
+
+static CURLSH*	downloadNewShare(void)
+{
+	CURLSH* share = curl_share_init();
+	if(share == 0)
+		return(0);
+
+	curl_share_setopt(share, CURLSHOPT_LOCKFUNC, &onCURLShareLock);
+	curl_share_setopt(share, CURLSHOPT_UNLOCKFUNC, &onCURLShareUnlock);
+
+	// (not CURL_LOCK_DATA_CONNECT: the multi handle's own connection cache is the one that multiplexes)
+	curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+	curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+
+	return(share);
+}
+
+// configures the (reset) easy handle for a download
+static void		downloadSetupTransfer(CURL* curl, CURLSH* share, Download* download)
+{
+	// set up the curl session
+	int fromPeer = (download->peer.state == kDownloadPeerFetching);
+	curl_easy_setopt(curl, CURLOPT_URL, (void*)(fromPeer? download->peer.url : download->options.url));
+	curl_easy_setopt(curl, CURLOPT_PRIVATE, (void*)download);
+	if(fromPeer || download->options.failOnError)
+		curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
+
+	if(share != 0)
+		curl_easy_setopt(curl, CURLOPT_SHARE, share);
+
+	// keep idle connections alive while the server holds its next reply
+	curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+	curl_easy_setopt(curl, CURLOPT_DNS_CACHE_TIMEOUT, 300L);
+
+	// HTTP/2 over TLS when the server offers it; rather than opening a
+	//   connection of its own, wait to learn whether a connection being
+	//   set up can be multiplexed
+#if LIBCURL_VERSION_NUM >= 0x072F00	// (7.47.0)
+	curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, (long)CURL_HTTP_VERSION_2TLS);
+	curl_easy_setopt(curl, CURLOPT_PIPEWAIT, 1L);
+
+	// urgent streams get the most of a shared connection
+	curl_easy_setopt(curl, CURLOPT_STREAM_WEIGHT, (long)((download->options.priority > 0)? kDownloadUrgentWeight : kDownloadDefaultWeight));
+#endif
+
+	// register progressive download (write) callback
+	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, &onCURLDownloadSegment);
+	curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void*)download);
+
+	curl_easy_setopt(curl, CURLOPT_USERAGENT, "piframe-1.0/libcurl");
+
+	if(download->options.headerCallback != 0)
+	{
+		curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, &onCURLDownloadHeader);
+		curl_easy_setopt(curl, CURLOPT_HEADERDATA, (void*)download);
+	}
+
+	// (set on the handle once the cache has added its validators)
+	char** header;
+	for(header = download->options.headers; (header != 0) && (*header != 0); header++)
+		download->requestHeaders = curl_slist_append(download->requestHeaders, *header);
+
+	curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L);
+	curl_easy_setopt(curl, CURLOPT_PROGRESSFUNCTION, &onCURLDownloadProgress);
+	curl_easy_setopt(curl, CURLOPT_PROGRESSDATA, (void*)download);
+
+	// a dead server costs seconds, not the kernel's TCP timeout (stalls are caught by the progress callback)
+	curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT_MS, (long)gDownload.connectTimeoutMS);
+	if(!download->options.idle)
+		curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, (long)gDownload.totalTimeoutMS);
+}
+
+// breaks the transfer's cumulative times down into phases
+static void		downloadGetMetrics(CURL* curl, Download* download)
+{
+	double	lookup = 0, connect = 0, appConnect = 0, startTransfer = 0, total = 0;
+
+	curl_easy_getinfo(curl, CURLINFO_NAMELOOKUP_TIME, &lookup);
+	curl_easy_getinfo(curl, CURLINFO_CONNECT_TIME, &connect);
+	curl_easy_getinfo(curl, CURLINFO_APPCONNECT_TIME, &appConnect);	// (0 without TLS)
+	curl_easy_getinfo(curl, CURLINFO_STARTTRANSFER_TIME, &startTransfer);
+	curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME, &total);
+
+	Metrics* metrics = download->options.metrics;
+	double connected = MAX(connect, appConnect);
+
+	metrics->dnsUS = (gint64)(lookup * 1e6);
+	metrics->connectUS = (gint64)(MAX(connect - lookup, 0.0) * 1e6);
+	metrics->tlsUS = (gint64)(((appConnect > 0.0)? (appConnect - connect) : 0.0) * 1e6);
+	metrics->ttfbUS = (gint64)(MAX(startTransfer - connected, 0.0) * 1e6);
+	metrics->transferUS = (gint64)(MAX(total - startTransfer, 0.0) * 1e6);
+
+	curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &metrics->status);
+	curl_easy_getinfo(curl, CURLINFO_NUM_CONNECTS, &metrics->connects);
+}
+
+////////////////////////////////////////////////////////////////
+// Transfers: curlThread runs up to maxTransfers of them at once
+//   from its multi handle, sleeping in curl_multi_poll() until a
+//   socket is ready, one of libcurl's timers is due, or DownloadNew()
+//   wakes it with a new job.  Jobs that don't fit yet wait in a
+//   queue, highest priority first (first come, first served among
+//   equals), so the photo about to be shown starts ahead of
+//   background prefetches.  Everything a transfer's callbacks do
+//   still runs on curlThread, so a write callback waiting on the
+//   progress item pool holds up all of them until the consumer
+//   catches up.
+
+// files a new job behind every pending job of the same or higher priority
+static void		downloadQueueJob(GQueue* pending, Download* download)
+{
+	GList* link = pending->tail;
+	while((link != 0) && (((Download*)link->data)->options.priority < download->options.priority))
+		link = link->prev;
+
+	if(link != 0)
+		g_queue_insert_after(pending, link, download);
+	else
+		g_queue_push_head(pending, download);
+}
+
+// Hands a finished (or never started) download to its dispatcher; 'curl'
+//   is 0 if it never ran.  Returns 0 instead if it's to run again, from
+//   a peer or back from the origin (see Peers): queue it again.
+static int		downloadFinishTransfer(CURL* curl, Download* download, int result)
+{
+	DebugPrintf("*downloadFinishTransfer %p result=%i\n", download, result);
+	if((download->abortReason != 0) && !strcmp(download->abortReason, "stalled"))
+		result = CURLE_OPERATION_TIMEDOUT;
+
+	if((download->options.metrics != 0) && (curl != 0))
+		downloadGetMetrics(curl, download);
+
+	result = downloadCacheFinish(download, result);	// (a 304 replays the cached body here)
+
+	if(download->requestHeaders != 0)
+		curl_slist_free_all(download->requestHeaders);	// (the handle was removed or never ran)
+	download->requestHeaders = 0;
+
+	int again = (download->peer.state == kDownloadPeerFound) || (download->unconditional == 1);
+	if((download->peer.state == kDownloadPeerFetching) && (result != CURLE_OK) && (download->bytesLoaded == 0))
+	{
+		DebugPrintf("*downloadFinishTransfer peer failed, result=%i\n", result);
+		g_free(download->peer.url);
+		g_free(download->peer.etag);
+		g_free(download->peer.hash);
+		memset(&download->peer, 0, sizeof(download->peer));
+		download->peer.state = kDownloadPeerFallback;
+		again = 1;
+	}
+	if(again && (download->abortReason == 0))
+	{
+		if(download->peer.state == kDownloadPeerFound)
+			download->peer.state = kDownloadPeerFetching;
+		else if(download->unconditional == 1)
+			download->unconditional = 2;
+		download->bytesExpected = 0;
+		download->lastArrival = 0;
+		download->lastBytes = 0;
+		return(0);
+	}
+
+	g_free(download->peer.url);
+	g_free(download->peer.etag);
+	g_free(download->peer.hash);
+	memset(&download->peer, 0, sizeof(download->peer));
+
+	downloadPushProgressItem(download);
+
+	download->result = result;
+	download->reason = (download->abortReason != 0)? download->abortReason : (result == CURLE_READ_ERROR)? "cache-miss" : "curl-done";
+
+	if(download->options.metrics != 0)
+	{
+		download->options.metrics->bytes = download->bytesLoaded;	// (including a replayed body)
+		download->options.metrics->cached = download->served || (download->options.metrics->status == 304);
+	}
+
+	download->queued = g_get_monotonic_time();
+	g_async_queue_push(download->options.dispatcher->resultsQueue, download);
+	downloadWake(download->options.dispatcher);
+
+	downloadRecycleProgressItems();
+	DebugPrintf("*downloadFinishTransfer pool allocated=%i idle=%i peak=%i stalls=%i\n", gDownload.pool.allocated, gDownload.pool.idleCount, gDownload.pool.peak, gDownload.pool.stalls);
+	return(1);
+}
+
+// adds a download to the multi handle on an idle easy handle, or finishes it right away
+static int		downloadStartTransfer(CURLSH* share, GSList** idleHandles, Download* download)
+{
+	if((download->options.cancel != 0) && g_atomic_int_get(download->options.cancel))
+	{
+		download->abortReason = "cancelled";	// (before it started)
+		downloadFinishTransfer(0, download, CURLE_ABORTED_BY_CALLBACK);
+		return(0);
+	}
+
+	int served = downloadCacheServe(download);
+	if(served >= 0)
+	{
+		downloadFinishTransfer(0, download, served);
+		return(0);
+	}
+
+	CURL* curl = 0;
+	if(*idleHandles != 0)
+	{
+		curl = (CURL*)(*idleHandles)->data;
+		*idleHandles = g_slist_delete_link(*idleHandles, *idleHandles);
+		curl_easy_reset(curl);	// (keeps its caches)
+	}
+	else
+		curl = curl_easy_init();
+
+	if(curl == 0)
+	{
+		DebugPrintf("*downloadStartTransfer curl init error\n");
+		download->abortReason = "curl-init-error";
+		downloadFinishTransfer(0, download, CURLE_FAILED_INIT);
+		return(0);
+	}
+
+	downloadSetupTransfer(curl, share, download);
+	downloadCacheBegin(curl, download);
+	if(download->requestHeaders != 0)
+		curl_easy_setopt(curl, CURLOPT_HTTPHEADER, download->requestHeaders);
+
+	CURLMcode added = curl_multi_add_handle(gDownload.multi, curl);
+	if(added != CURLM_OK)
+	{
+		DebugPrintf("*downloadStartTransfer add error %i\n", added);
+		download->abortReason = "curl-init-error";
+		downloadFinishTransfer(curl, download, CURLE_FAILED_INIT);
+		*idleHandles = g_slist_prepend(*idleHandles, curl);
+		return(0);
+	}
+
+	DebugPrintf("*downloadStartTransfer %p priority=%i\n", download, download->options.priority);
+	return(1);
+}
+
+static gpointer	curlThread(gpointer info)
+{
+	DebugPrintf("+curlThread\n");
+	g_async_queue_ref(gDownload.jobQueue);
+	g_async_queue_ref(gDownload.progressRecycleQueue);
+
+	CURLSH* share = downloadNewShare();
+	GSList* idleHandles = 0;
+	GQueue pending;	// Downloads waiting for a transfer
+	unsigned int active = 0;
+	int shutdown = 0;
+
+	g_queue_init(&pending);
+
+	while(!shutdown)
+	{
+		// take in new jobs
+		Download* download;
+		while((download = g_async_queue_try_pop(gDownload.jobQueue)) != 0)
+		{
+			if(download == kDownloadShutdown)
+			{
+				DebugPrintf("*curlThread shutdown\n");
+				shutdown = 1;
+				break;
+			}
+			downloadQueueJob(&pending, download);
+		}
+		if(shutdown)
+			break;
+
+		// a new cache capacity (see DownloadSetCacheCapacity())
+		int requestedMB = g_atomic_int_get(&gDownload.cache.requestedMB);
+		if((requestedMB >= 0) && g_atomic_int_compare_and_exchange(&gDownload.cache.requestedMB, requestedMB, -1))
+		{
+			DebugPrintf("*curlThread cache capacity %i MiB\n", requestedMB);
+			gDownload.cache.capacity = (size_t)requestedMB * 1024 * 1024;
+			while((gDownload.cache.size > gDownload.cache.capacity) && (gDownload.cache.entries != 0))
+				downloadCacheRemove(g_list_last(gDownload.cache.entries));
+			downloadCacheSave();
+		}
+
+		// start as many as there's room for, most urgent first
+		while((active < gDownload.maxTransfers) && !g_queue_is_empty(&pending))
+			active += downloadStartTransfer(share, &idleHandles, (Download*)g_queue_pop_head(&pending));
+
+		int running = 0;
+		curl_multi_perform(gDownload.multi, &running);
+
+		// finish what's done; its easy handle goes back for reuse
+		int finished = 0;
+		int left = 0;
+		CURLMsg* message;
+		while((message = curl_multi_info_read(gDownload.multi, &left)) != 0)
+		{
+			if(message->msg != CURLMSG_DONE)
+				continue;
+
+			CURL* curl = message->easy_handle;
+			int result = message->data.result;	// (the message is gone once the handle is removed)
+			char* user = 0;
+			curl_easy_getinfo(curl, CURLINFO_PRIVATE, &user);
+
+			curl_multi_remove_handle(gDownload.multi, curl);
+			if(!downloadFinishTransfer(curl, (Download*)user, result))
+				downloadQueueJob(&pending, (Download*)user);
+			idleHandles = g_slist_prepend(idleHandles, curl);
+
+			active--;
+			finished++;
+		}
+
+		if(finished > 0)
+			continue;	// (a pending job may fit now)
+
+		DebugPrintf("+curlThread wait active=%u pending=%u\n", active, g_queue_get_length(&pending));
+#if LIBCURL_VERSION_NUM >= 0x074400	// (7.68.0: DownloadNew() interrupts the poll)
+		curl_multi_poll(gDownload.multi, 0, 0, ((active > 0) || !g_queue_is_empty(&pending))? kDownloadPollMS : kDownloadIdlePollMS, 0);
+#else
+		curl_multi_wait(gDownload.multi, 0, 0, kDownloadJobPollMS, 0);
+#endif
+		DebugPrintf("-curlThread wait\n");
+	}
+
+	// (transfers still running are abandoned with the process)
+	g_slist_free_full(idleHandles, (GDestroyNotify)&curl_easy_cleanup);
+	if(share != 0)
+		curl_share_cleanup(share);
+
+	downloadPoolDrain();
+
+	g_async_queue_unref(gDownload.jobQueue);
+	g_async_queue_unref(gDownload.progressRecycleQueue);
+
+	DebugPrintf("-curlThread\n");
+	return(0);
+}
+
+
+
+////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////
+//
+// ImageDownload subsystem: uses Download to fetch an image
+//   and incrementally load it into a GdkPixbuf for use in the
+//   application UI.
+//
+// Decoding happens on a dedicated decode thread: its Downloads
+//   dispatch their chunks straight to that thread, where the
+//   ImageDecoder lives.  Only the finished GdkPixbuf is
+//   posted back to the main thread.
+//
+// In streaming mode the decoder is instead written from inside
+//   the libcurl write callback on curlThread, which skips the
+//   copy into pooled chunks and all per-chunk queue traffic;
+//   only the final close happens on the decode thread.
+//
+// ImageDownloadStop() cancels a download from the main thread: the
+//   transfer is aborted on curlThread and completeCallback is never
+//   called.  A photo that fails to decode aborts its own transfer.
+//   Both the client and the download pipeline hold a reference to
+//   the ImageDownload, which is freed when both are dropped.
+//
+// With a previewCallback, the part of the photo decoded so far is
+//   also posted to the main thread as it arrives, at most once per
+//   kImageDownloadPreviewMS and never while the last one is still
+//   waiting there, so the previews can't hold up the decode.
+//
+// An ImageStream receives many images over one long-lived
+//   multipart/x-mixed-replace response, decoding each part as
+//   it streams in, the same way.
+//
+////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////
+// Decoders: an ImageDecoder turns the encoded bytes of a photo
+//   into a GdkPixbuf, at the smallest size that still covers its
+//   target (if it has one.)  The GdkPixbufLoader backend takes
+//   every format and decodes as the bytes arrive.  Builds with
+//   -DPIFRAME_V4L2 can instead hand JPEGs to a V4L2 memory-to-
+//   memory decoder (on the Raspberry Pi, the VideoCore's, at
+//   /dev/video10); whatever it can't take, such as progressive
+//   JPEGs or PNGs, falls back to the loader.  A decoder is used
+//   by one thread at a time.
+//
+// While a photo is still arriving, ImageDecoderPreview() copies out
+//   what has been decoded since it was last called (with the loader:
+//   a band of a baseline JPEG, or another scan of a progressive one.)
+//
+// With a pixel ceiling, the first bytes of each photo are held back
+//   until its declared size is known (JPEG, PNG and GIF headers are
+//   read here), and a photo over the ceiling never reaches a backend
+//   that would allocate it: a JPEG is decoded scaled down to fit, as
+//   long as libjpeg's 1/8 scaling gets it there, and anything else is
+//   rejected with an error.  Other formats are checked when the loader
+//   reports their size, and stopped there before it allocates them.
+
+typedef struct ImageDecoder ImageDecoder;
+
+typedef struct ImageDecoderBackend
+{
+	char const*		name;
+	ImageDecoder*	(*create)(void);
+	gboolean		(*write)(ImageDecoder* decoder, unsigned char const* data, size_t length, GError** error);
+	GdkPixbuf*		(*close)(ImageDecoder* decoder, GError** error);	// frees the decoder; returns a new reference, or 0 and an error
+	void			(*abort)(ImageDecoder* decoder);					// frees the decoder
+
+	// optional: a copy of the area decoded since the last call (see ImageDecoderPreview)
+	GdkPixbuf*		(*preview)(ImageDecoder* decoder, GdkRectangle* outArea, int* outWidth, int* outHeight);
+
+} ImageDecoderBackend;
+
+struct ImageDecoder
+{
+	ImageDecoderBackend const*	backend;
+	int							targetWidth;	// 0 for full resolution
+	int							targetHeight;
+
+	GByteArray*					header;		// held back until the size is known (with a ceiling), else 0
+	GError*						rejection;	// over the ceiling: every write fails, and so does close
+
+	GdkRectangle				updated;	// decoded since the last preview (empty if width is 0)
+};
+
+static struct
+{
+	ImageDecoderBackend const*	backend;	// for new decoders
+	gint64						maxPixels;	// ceiling on decoded width x height, 0 for none
+	char*						device;		// the V4L2 decoder's
+	uint32_t					pixelFormat;	// what it calls JPEG
+
+} gImageDecoder;
+
+#define kImageDecodeHeaderLimit	(1024 * 1024)	// held back at most; past this, the loader's size-prepared is the only check
+#define kImageDecodeJPEGScale	(8)				// libjpeg's smallest DCT scale is 1/8
+
+typedef struct ImageHeader
+{
+	int			width;
+	int			height;
+	int			jpeg;
+	int			baseline;		// JPEG: sequential Huffman (SOF0/1)
+	int			components;		// JPEG
+
+} ImageHeader;
+
+// Reads the declared size from a photo's first bytes: a JPEG's frame
+//   header, or a PNG's or GIF's.  Returns 1 when found, 0 if it needs
+//   more bytes, and -1 for another format or a broken header.
+static int			imageDecodeSniff(unsigned char const* data, size_t length, ImageHeader* out)
+{
+	memset(out, 0, sizeof(*out));
+	if(length < 4)
+		return(0);
+
+	if(!memcmp(data, "\x89PNG", 4))
+	{
+		if(length < 24)
+			return(0);
+		out->width = (int)(((guint32)data[16] << 24) | (data[17] << 16) | (data[18] << 8) | data[19]);
+		out->height = (int)(((guint32)data[20] << 24) | (data[21] << 16) | (data[22] << 8) | data[23]);
+		return(((out->width > 0) && (out->height > 0))? 1 : -1);
+	}
+	if(!memcmp(data, "GIF8", 4))
+	{
+		if(length < 10)
+			return(0);
+		out->width = data[6] | (data[7] << 8);
+		out->height = data[8] | (data[9] << 8);
+		return(1);
+	}
+	if((data[0] != 0xFF) || (data[1] != 0xD8))
+		return(-1);
+
+	// walk the JPEG's segments to its frame header
+	size_t offset = 2;
+	while(offset + 4 <= length)
+	{
+		if(data[offset] != 0xFF)
+			return(-1);
+		unsigned char marker = data[offset + 1];
+		if((marker == 0xFF) || (marker == 0x01) || ((marker >= 0xD0) && (marker <= 0xD7)))
+		{
+			offset += (marker == 0xFF)? 1 : 2;	// (fill byte, or a marker without a segment)
+			continue;
+		}
+
+		size_t segment = ((size_t)data[offset + 2] << 8) | data[offset + 3];
+		if((marker >= 0xC0) && (marker <= 0xCF) && (marker != 0xC4) && (marker != 0xC8) && (marker != 0xCC))
+		{
+			if(offset + 10 > length)
+				return(0);
+			out->jpeg = 1;
+			out->baseline = (marker == 0xC0) || (marker == 0xC1);
+			out->height = (data[offset + 5] << 8) | data[offset + 6];
+			out->width = (data[offset + 7] << 8) | data[offset + 8];
+			out->components = data[offset + 9];
+			return(((out->width > 0) && (out->height > 0))? 1 : -1);
+		}
+		if((marker == 0xDA) || (segment < 2))
+			return(-1);	// (scan data before any frame)
+
+		offset += 2 + segment;
+	}
+	return(0);
+}
+
+// the ceiling's cut, as a dimension scale: 1 for photos under it
+static double		imageDecodeCeilingScale(gint64 width, gint64 height)
+{
+	if((gImageDecoder.maxPixels <= 0) || (width * height <= gImageDecoder.maxPixels))
+		return(1.0);
+	return(sqrt((double)gImageDecoder.maxPixels / ((double)width * (double)height)));
+}
+
+// The JPEG loader decodes at the largest 1/N DCT scale (N = 1, 2, 4 or
+//   8) that still covers the size asked for, then resizes: that
+//   intermediate, not the size asked for, is what has to fit under the
+//   ceiling.  Returns the smallest N whose 1/N decode fits, or 0 if even
+//   1/8 doesn't.
+static int			imageDecodeJPEGFit(gint64 width, gint64 height)
+{
+	int n;
+	for(n = 1; n <= kImageDecodeJPEGScale; n *= 2)
+	{
+		if((gImageDecoder.maxPixels <= 0) || (((width + n - 1) / n) * ((height + n - 1) / n) <= gImageDecoder.maxPixels))
+			return(n);
+	}
+	return(0);
+}
+
+// Ask the loader for the smallest size that still covers the target
+//   under the fill-and-crop policy, so the JPEG loader can use libjpeg's
+//   DCT scaling instead of decoding every source pixel.  The ceiling can
+//   only shrink it further: for a JPEG, to the 1/N scale it decodes at.
+static void			imageDecodeSetSize(GdkPixbufLoader* loader, gint width, gint height, int targetWidth, int targetHeight, int jpeg)
+{
+	double	scale = 1.0;
+	if((targetWidth > 0) && (targetHeight > 0))
+	{
+		scale = MAX(	(double)targetWidth / (double)width,
+						(double)targetHeight / (double)height
+					);
+	}
+	if(!jpeg)
+		scale = MIN(scale, imageDecodeCeilingScale(width, height));
+	scale = MIN(scale, 1.0);	// (never upscale during decode)
+
+	int	requestWidth = MAX((int)ceil(scale * (double)width), 1),
+		requestHeight = MAX((int)ceil(scale * (double)height), 1);
+
+	if(jpeg)
+	{
+		// the N the loader would choose for that, and the smallest that fits
+		int n = 1, fit = MAX(imageDecodeJPEGFit(width, height), 1);	// (0 was rejected)
+		while((n < kImageDecodeJPEGScale) && ((width + 2 * n - 1) / (2 * n) >= requestWidth) && ((height + 2 * n - 1) / (2 * n) >= requestHeight))
+			n *= 2;
+		if(n < fit)
+		{
+			requestWidth = (width + fit - 1) / fit;	// (exactly the 1/fit decode, so that's the N chosen)
+			requestHeight = (height + fit - 1) / fit;
+		}
+	}
+
+	DebugPrintf("*imageDecodeSetSize %ix%i to %ix%i\n", width, height, requestWidth, requestHeight);
+	if((requestWidth < width) || (requestHeight < height))
+		gdk_pixbuf_loader_set_size(loader, requestWidth, requestHeight);
+}
+
+static ImageDecoder*	imageDecoderNewWith(ImageDecoderBackend const* backend, int targetWidth, int targetHeight)
+{
+	ImageDecoder* decoder = backend->create();
+	decoder->backend = backend;
+	decoder->targetWidth = targetWidth;
+	decoder->targetHeight = targetHeight;
+	decoder->header = 0;
+	decoder->rejection = 0;
+	memset(&decoder->updated, 0, sizeof(decoder->updated));
+	return(decoder);
+}
+
+ImageDecoder*		ImageDecoderNew(int targetWidth, int targetHeight)
+{
+	ImageDecoder* decoder = imageDecoderNewWith(gImageDecoder.backend, targetWidth, targetHeight);
+	if(gImageDecoder.maxPixels > 0)
+		decoder->header = g_byte_array_new();
+	return(decoder);
+}
+
+static GError*		imageDecodeRejectionNew(int width, int height)
+{
+	return(g_error_new(g_quark_from_static_string("piframe-image-decode-error-quark"), 0,
+		"%ix%i is over the %" G_GINT64_FORMAT "-pixel ceiling", width, height, gImageDecoder.maxPixels));
+}
+
+// passes the held-back bytes on, unless the size they declare is over the ceiling
+static gboolean		imageDecoderRelease(ImageDecoder* decoder, GError** error)
+{
+	GByteArray* header = decoder->header;
+	decoder->header = 0;
+
+	ImageHeader info;
+	gboolean written = TRUE;
+	if(imageDecodeSniff(header->data, header->len, &info) > 0)
+	{
+		gint64 pixels = (gint64)info.width * info.height;
+		int over = info.jpeg? (imageDecodeJPEGFit(info.width, info.height) == 0) : (pixels > gImageDecoder.maxPixels);
+		DebugPrintf("*imageDecoderRelease %ix%i%s\n", info.width, info.height, over? " rejected" : "");
+		if(over)
+		{
+			decoder->rejection = imageDecodeRejectionNew(info.width, info.height);
+			written = FALSE;
+		}
+	}
+
+	if(written && (header->len > 0))
+		written = decoder->backend->write(decoder, header->data, header->len, error);
+	else if(!written)
+		g_propagate_error(error, g_error_copy(decoder->rejection));
+
+	g_byte_array_free(header, TRUE);
+	return(written);
+}
+
+gboolean			ImageDecoderWrite(ImageDecoder* decoder, unsigned char const* data, size_t length, GError** error)
+{
+	if(decoder->rejection != 0)
+	{
+		g_propagate_error(error, g_error_copy(decoder->rejection));
+		return(FALSE);
+	}
+
+	if(decoder->header != 0)
+	{
+		ImageHeader info;
+		g_byte_array_append(decoder->header, data, length);
+		if((imageDecodeSniff(decoder->header->data, decoder->header->len, &info) == 0) && (decoder->header->len < kImageDecodeHeaderLimit))
+			return(TRUE);	// (not yet)
+		return(imageDecoderRelease(decoder, error));
+	}
+
+	return(decoder->backend->write(decoder, data, length, error));
+}
+
+// frees the decoder; returns the photo (a new reference), or 0 and an error
+GdkPixbuf*			ImageDecoderClose(ImageDecoder* decoder, GError** error)
+{
+	if(decoder->header != 0)
+		imageDecoderRelease(decoder, 0);	// (a short file: what's held back is all there is)
+
+	if(decoder->rejection != 0)
+	{
+		GError* rejection = decoder->rejection;
+		decoder->backend->abort(decoder);
+		g_propagate_error(error, rejection);
+		return(0);
+	}
+
+	GdkPixbuf* pixels = decoder->backend->close(decoder, error);
+	if(pixels != 0)
+		MetricsTrackPixels(pixels);
+	return(pixels);
+}
+
+// Returns a copy of the part of the photo decoded since the last call, and
+//   where it goes in the photo as decoded so far ('outWidth' x 'outHeight'),
+//   or 0 if there's nothing new.
+GdkPixbuf*			ImageDecoderPreview(ImageDecoder* decoder, GdkRectangle* outArea, int* outWidth, int* outHeight)
+{
+	if((decoder->backend->preview == 0) || (decoder->header != 0) || (decoder->rejection != 0))
+		return(0);
+	return(decoder->backend->preview(decoder, outArea, outWidth, outHeight));
+}
+
+void				ImageDecoderAbort(ImageDecoder* decoder)
+{
+	if(decoder->header != 0)
+		g_byte_array_free(decoder->header, TRUE);
+	if(decoder->rejection != 0)
+		g_error_free(decoder->rejection);
+	decoder->backend->abort(decoder);
+}
+
+
+////////////////////////////////////////////////////////////////
+// GdkPixbufLoader backend
+
+typedef struct ImageDecoderLoader
+{
+	ImageDecoder		decoder;
+	GdkPixbufLoader*	loader;
+
+} ImageDecoderLoader;
+
+// JPEG is the only format the loader decodes smaller than it is; the
+//   others are decoded whole, and only then scaled to the size asked for
+static int			imageDecoderLoaderIsJPEG(GdkPixbufLoader* loader)
+{
+	GdkPixbufFormat* format = gdk_pixbuf_loader_get_format(loader);
+	gchar* name = (format != 0)? gdk_pixbuf_format_get_name(format) : 0;
+	int jpeg = (name != 0) && !strcmp(name, "jpeg");
+	g_free(name);
+	return(jpeg);
+}
+
+// The last word on the ceiling, for the formats the header parser
+//   doesn't know (and any it does but couldn't read in time): a photo
+//   that can't be decoded under it gets a size of 0, which tells the
+//   module to allocate nothing and stop.
+static void			onImageDecoderSizePrepared(GdkPixbufLoader* loader, gint width, gint height, gpointer user)
+{
+	ImageDecoder* decoder = (ImageDecoder*)user;
+	int jpeg = imageDecoderLoaderIsJPEG(loader);
+
+	if((gImageDecoder.maxPixels > 0) && (jpeg? (imageDecodeJPEGFit(width, height) == 0) : ((gint64)width * height > gImageDecoder.maxPixels)))
+	{
+		DebugPrintf("*onImageDecoderSizePrepared %ix%i rejected\n", width, height);
+		if(decoder->rejection == 0)
+			decoder->rejection = imageDecodeRejectionNew(width, height);
+		gdk_pixbuf_loader_set_size(loader, 0, 0);
+		return;
+	}
+	imageDecodeSetSize(loader, width, height, decoder->targetWidth, decoder->targetHeight, jpeg);
+}
+
+static void			onImageDecoderAreaUpdated(GdkPixbufLoader* loader, gint x, gint y, gint width, gint height, gpointer user)
+{
+	(void)loader;
+	ImageDecoder* decoder = (ImageDecoder*)user;
+	GdkRectangle area = {.x = x, .y = y, .width = width, .height = height};
+
+	if(decoder->updated.width == 0)
+		decoder->updated = area;
+	else
+		gdk_rectangle_union(&decoder->updated, &area, &decoder->updated);
+}
+
+static ImageDecoder*	imageDecoderLoaderCreate(void)
+{
+	ImageDecoderLoader* decoder = g_new(ImageDecoderLoader, 1);
+	decoder->loader = gdk_pixbuf_loader_new();
+	g_signal_connect(decoder->loader, "size-prepared", G_CALLBACK(&onImageDecoderSizePrepared), (gpointer)decoder);
+	g_signal_connect(decoder->loader, "area-updated", G_CALLBACK(&onImageDecoderAreaUpdated), (gpointer)decoder);
+	return(&decoder->decoder);
+}
+
+static gboolean		imageDecoderLoaderWrite(ImageDecoder* decoder, unsigned char const* data, size_t length, GError** error)
+{
+	GError* written = 0;
+	gboolean ok = gdk_pixbuf_loader_write(((ImageDecoderLoader*)decoder)->loader, data, length, &written);
+	if(decoder->rejection != 0)
+	{
+		// (rejected at size-prepared: say so, rather than what the module made of a size of 0)
+		if(written != 0)
+			g_error_free(written);
+		g_propagate_error(error, g_error_copy(decoder->rejection));
+		return(FALSE);
+	}
+	if(written != 0)
+		g_propagate_error(error, written);
+	return(ok);
+}
+
+static GdkPixbuf*	imageDecoderLoaderClose(ImageDecoder* decoder, GError** error)
+{
+	GdkPixbufLoader* loader = ((ImageDecoderLoader*)decoder)->loader;
+
+	GdkPixbuf* pixels = 0;
+	if(gdk_pixbuf_loader_close(loader, error))
+	{
+		pixels = gdk_pixbuf_loader_get_pixbuf(loader);
+		g_object_ref(pixels);	// (outlives the loader)
+	}
+	g_object_unref(loader);
+	g_free(decoder);
+	return(pixels);
+}
+
+static void			imageDecoderLoaderAbort(ImageDecoder* decoder)
+{
+	GdkPixbufLoader* loader = ((ImageDecoderLoader*)decoder)->loader;
+	gdk_pixbuf_loader_close(loader, 0);	// (ignore any errors from this)
+	g_object_unref(loader);
+	g_free(decoder);
+}
+
+// copies only the updated area: the loader keeps writing to the rest
+static GdkPixbuf*	imageDecoderLoaderPreview(ImageDecoder* decoder, GdkRectangle* outArea, int* outWidth, int* outHeight)
+{
+	GdkPixbuf* partial = gdk_pixbuf_loader_get_pixbuf(((ImageDecoderLoader*)decoder)->loader);
+	if((partial == 0) || (decoder->updated.width <= 0) || (decoder->updated.height <= 0))
+		return(0);
+
+	GdkRectangle whole = {.x = 0, .y = 0, .width = gdk_pixbuf_get_width(partial), .height = gdk_pixbuf_get_height(partial)};
+	gboolean inside = gdk_rectangle_intersect(&decoder->updated, &whole, outArea);
+	memset(&decoder->updated, 0, sizeof(decoder->updated));
+	if(!inside)
+		return(0);
+
+	GdkPixbuf* area = gdk_pixbuf_new_subpixbuf(partial, outArea->x, outArea->y, outArea->width, outArea->height);
+	GdkPixbuf* copy = gdk_pixbuf_copy(area);
+	g_object_unref(area);
+
+	*outWidth = whole.width;
+	*outHeight = whole.height;
+	return(copy);
+}
+
+static ImageDecoderBackend const kImageDecoderLoader =
+{
+	.name = "loader",
+	.create = &imageDecoderLoaderCreate,
+	.write = &imageDecoderLoaderWrite,
+	.close = &imageDecoderLoaderClose,
+	.abort = &imageDecoderLoaderAbort,
+	.preview = &imageDecoderLoaderPreview,
+};
+
+
+////////////////////////////////////////////////////////////////
+// V4L2 backend: a stateful memory-to-memory decoder.  The whole
+//   JPEG is collected, queued as a single OUTPUT buffer, and
+//   decoded to planar YUV 4:2:0 in one CAPTURE buffer.  The
+//   hardware can't scale, so the conversion to RGB box-filters by
+//   the largest whole factor that still covers the target, which
+//   is about what libjpeg's DCT scaling gives the loader.  The
+//   frame is copied out once, into the GdkPixbuf everything else
+//   works on.
+
+#if defined(PIFRAME_V4L2)
+
+#include <errno.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <linux/videodev2.h>
+
+#define kV4L2DecodeTimeoutMS	(2000)	// per step; a stuck decoder falls back to the loader
+#define kV4L2MaxScaleFactor		(8)
+
+typedef struct ImageDecoderV4L2
+{
+	ImageDecoder		decoder;
+	GByteArray*			jpeg;		// the encoded photo so far
+	ImageDecoder*		fallback;	// the loader, once the hardware is ruled out
+
+} ImageDecoderV4L2;
+
+typedef struct V4L2Buffer
+{
+	void*				map;
+	size_t				length;
+	struct v4l2_buffer	buffer;
+	struct v4l2_plane	plane;
+
+} V4L2Buffer;
+
+
+static int			v4l2Ioctl(int fd, unsigned long request, void* argument)
+{
+	int result;
+	do
+		result = ioctl(fd, request, argument);
+	while((result < 0) && (errno == EINTR));
+	return(result);
+}
+
+static gboolean		v4l2Wait(int fd, short events)
+{
+	struct pollfd poller = {.fd = fd, .events = events};
+	int result;
+	do
+		result = poll(&poller, 1, kV4L2DecodeTimeoutMS);
+	while((result < 0) && (errno == EINTR));
+	return((result > 0) && ((poller.revents & events) != 0));
+}
+
+// allocates, maps and describes the only buffer of a queue
+static gboolean		v4l2BufferMap(int fd, enum v4l2_buf_type type, V4L2Buffer* buffer)
+{
+	struct v4l2_requestbuffers request = {.count = 1, .type = type, .memory = V4L2_MEMORY_MMAP};
+	if((v4l2Ioctl(fd, VIDIOC_REQBUFS, &request) < 0) || (request.count < 1))
+		return(FALSE);
+
+	memset(&buffer->buffer, 0, sizeof(buffer->buffer));
+	memset(&buffer->plane, 0, sizeof(buffer->plane));
+	buffer->buffer.type = type;
+	buffer->buffer.memory = V4L2_MEMORY_MMAP;
+	buffer->buffer.index = 0;
+	buffer->buffer.m.planes = &buffer->plane;
+	buffer->buffer.length = 1;
+	if(v4l2Ioctl(fd, VIDIOC_QUERYBUF, &buffer->buffer) < 0)
+		return(FALSE);
+
+	buffer->length = buffer->plane.length;
+	buffer->map = mmap(0, buffer->length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, buffer->plane.m.mem_offset);
+	return(buffer->map != MAP_FAILED);
+}
+
+// finds the frame size in a baseline JPEG that's under the ceiling; 0 for anything else (progressive, arithmetic, not a JPEG)
+static gboolean		v4l2ParseJPEG(unsigned char const* data, size_t length, int* outWidth, int* outHeight)
+{
+	ImageHeader info;
+	if((imageDecodeSniff(data, length, &info) <= 0) || !info.jpeg || !info.baseline || ((info.components != 1) && (info.components != 3)))
+		return(FALSE);
+	if(imageDecodeCeilingScale(info.width, info.height) < 1.0)
+		return(FALSE);	// (the loader can decode it smaller; the hardware can't)
+
+	*outWidth = info.width;
+	*outHeight = info.height;
+	return(TRUE);
+}
+
+static inline unsigned char	v4l2Clamp(int value)
+{
+	return((value < 0)? 0 : (value > 255)? 255 : (unsigned char)value);
+}
+
+// YUV 4:2:0 (full range, as in JFIF) to RGB, averaging 'factor' x 'factor' luma samples per pixel
+static void			v4l2ConvertYUV420(unsigned char const* luma, unsigned char const* cb, unsigned char const* cr, int lumaStride, int chromaStride, int factor, GdkPixbuf* out)
+{
+	int width = gdk_pixbuf_get_width(out);
+	int height = gdk_pixbuf_get_height(out);
+	int rowStride = gdk_pixbuf_get_rowstride(out);
+	unsigned char* pixels = gdk_pixbuf_get_pixels(out);
+	int area = factor * factor;
+	int x, y, i, j;
+
+	for(y = 0; y < height; y++)
+	{
+		unsigned char* o = pixels + (size_t)y * rowStride;
+		unsigned char const* lumaRow = luma + (size_t)(y * factor) * lumaStride;
+		size_t chromaRow = (size_t)((y * factor + factor / 2) >> 1) * chromaStride;
+
+		for(x = 0; x < width; x++)
+		{
+			int sum = 0;
+			for(j = 0; j < factor; j++)
+				for(i = 0; i < factor; i++)
+					sum += lumaRow[(size_t)j * lumaStride + x * factor + i];
+
+			int l = (sum + area / 2) / area;
+			int chroma = (x * factor + factor / 2) >> 1;
+			int u = cb[chromaRow + chroma] - 128;
+			int v = cr[chromaRow + chroma] - 128;
+
+			// BT.601 in 16.16 fixed point
+			o[0] = v4l2Clamp(l + ((91881 * v) >> 16));
+			o[1] = v4l2Clamp(l - ((22554 * u + 46802 * v) >> 16));
+			o[2] = v4l2Clamp(l + ((116130 * u) >> 16));
+			o += 3;
+		}
+	}
+}
+
+// runs the whole photo through the hardware; 0 if it can't
+static GdkPixbuf*	v4l2Decode(ImageDecoderV4L2* decoder)
+{
+	int width = 0, height = 0;
+	if(!v4l2ParseJPEG(decoder->jpeg->data, decoder->jpeg->len, &width, &height))
+		return(0);
+
+	int fd = open(gImageDecoder.device, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+	if(fd < 0)
+		return(0);
+
+	V4L2Buffer output = {.map = MAP_FAILED};
+	V4L2Buffer capture = {.map = MAP_FAILED};
+	GdkPixbuf* pixels = 0;
+	gboolean ok;
+
+	// queue the JPEG
+	struct v4l2_format format;
+	memset(&format, 0, sizeof(format));
+	format.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+	format.fmt.pix_mp.width = width;
+	format.fmt.pix_mp.height = height;
+	format.fmt.pix_mp.pixelformat = gImageDecoder.pixelFormat;
+	format.fmt.pix_mp.num_planes = 1;
+	format.fmt.pix_mp.plane_fmt[0].sizeimage = decoder->jpeg->len;
+
+	struct v4l2_event_subscription subscription = {.type = V4L2_EVENT_SOURCE_CHANGE};
+	int type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+
+	ok = (v4l2Ioctl(fd, VIDIOC_S_FMT, &format) == 0)
+		&& v4l2BufferMap(fd, V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE, &output)
+		&& (output.length >= decoder->jpeg->len)
+		&& (v4l2Ioctl(fd, VIDIOC_SUBSCRIBE_EVENT, &subscription) == 0);
+	if(ok)
+	{
+		memcpy(output.map, decoder->jpeg->data, decoder->jpeg->len);
+		output.plane.bytesused = decoder->jpeg->len;
+		ok = (v4l2Ioctl(fd, VIDIOC_QBUF, &output.buffer) == 0) && (v4l2Ioctl(fd, VIDIOC_STREAMON, &type) == 0);
+	}
+
+	// once the decoder has parsed the header, set up the frame
+	if(ok && v4l2Wait(fd, POLLPRI))
+	{
+		struct v4l2_event event;
+		v4l2Ioctl(fd, VIDIOC_DQEVENT, &event);
+	}
+	if(ok)
+	{
+		memset(&format, 0, sizeof(format));
+		format.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+		ok = (v4l2Ioctl(fd, VIDIOC_G_FMT, &format) == 0);
+		format.fmt.pix_mp.pixelformat = V4L2_PIX_FMT_YUV420;
+		format.fmt.pix_mp.num_planes = 1;
+		ok = ok && (v4l2Ioctl(fd, VIDIOC_S_FMT, &format) == 0)
+			&& (format.fmt.pix_mp.pixelformat == V4L2_PIX_FMT_YUV420) && (format.fmt.pix_mp.num_planes == 1)
+			&& ((int)format.fmt.pix_mp.width >= width) && ((int)format.fmt.pix_mp.height >= height);
+	}
+
+	type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+	ok = ok && v4l2BufferMap(fd, V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE, &capture)
+		&& (v4l2Ioctl(fd, VIDIOC_QBUF, &capture.buffer) == 0)
+		&& (v4l2Ioctl(fd, VIDIOC_STREAMON, &type) == 0)
+		&& v4l2Wait(fd, POLLIN);
+
+	if(ok)
+	{
+		capture.buffer.m.planes = &capture.plane;
+		ok = (v4l2Ioctl(fd, VIDIOC_DQBUF, &capture.buffer) == 0) && !(capture.buffer.flags & V4L2_BUF_FLAG_ERROR);
+	}
+
+	size_t lumaStride = format.fmt.pix_mp.plane_fmt[0].bytesperline;
+	size_t lumaSize = lumaStride * format.fmt.pix_mp.height;
+	if(ok && (lumaSize + 2 * (lumaSize / 4) <= capture.length))
+	{
+		int factor = 1;
+		if((decoder->decoder.targetWidth > 0) && (decoder->decoder.targetHeight > 0))
+		{
+			double scale = MAX(	(double)decoder->decoder.targetWidth / (double)width,
+								(double)decoder->decoder.targetHeight / (double)height
+							);
+			factor = CLAMP((int)(1.0 / scale), 1, kV4L2MaxScaleFactor);
+		}
+
+		unsigned char const* luma = (unsigned char const*)capture.map;
+		pixels = gdk_pixbuf_new(GDK_COLORSPACE_RGB, FALSE, 8, MAX(width / factor, 1), MAX(height / factor, 1));
+		v4l2ConvertYUV420(luma, luma + lumaSize, luma + lumaSize + lumaSize / 4, lumaStride, lumaStride / 2, factor, pixels);
+		DebugPrintf("*v4l2Decode %ix%i /%i\n", width, height, factor);
+	}
+
+	if(capture.map != MAP_FAILED)
+		munmap(capture.map, capture.length);
+	if(output.map != MAP_FAILED)
+		munmap(output.map, output.length);
+	close(fd);	// (stops both queues and frees their buffers)
+	return(pixels);
+}
+
+// hands everything so far to the loader, which takes over from here
+static gboolean		imageDecoderV4L2Fall(ImageDecoderV4L2* decoder, GError** error)
+{
+	decoder->fallback = imageDecoderNewWith(&kImageDecoderLoader, decoder->decoder.targetWidth, decoder->decoder.targetHeight);
+	gboolean written = (decoder->jpeg->len == 0) || ImageDecoderWrite(decoder->fallback, decoder->jpeg->data, decoder->jpeg->len, error);
+	g_byte_array_free(decoder->jpeg, TRUE);
+	decoder->jpeg = 0;
+	return(written);
+}
+
+static ImageDecoder*	imageDecoderV4L2Create(void)
+{
+	ImageDecoderV4L2* decoder = g_new(ImageDecoderV4L2, 1);
+	decoder->jpeg = g_byte_array_new();
+	decoder->fallback = 0;
+	return(&decoder->decoder);
+}
+
+static gboolean		imageDecoderV4L2Write(ImageDecoder* d, unsigned char const* data, size_t length, GError** error)
+{
+	ImageDecoderV4L2* decoder = (ImageDecoderV4L2*)d;
+	if(decoder->fallback != 0)
+		return(ImageDecoderWrite(decoder->fallback, data, length, error));
+
+	g_byte_array_append(decoder->jpeg, data, length);
+	if((decoder->jpeg->len >= 2) && ((decoder->jpeg->data[0] != 0xFF) || (decoder->jpeg->data[1] != 0xD8)))
+		return(imageDecoderV4L2Fall(decoder, error));	// (not a JPEG: let the loader decode it as it comes)
+	return(TRUE);
+}
+
+static GdkPixbuf*	imageDecoderV4L2Close(ImageDecoder* d, GError** error)
+{
+	ImageDecoderV4L2* decoder = (ImageDecoderV4L2*)d;
+	GdkPixbuf* pixels = 0;
+
+	if(decoder->fallback == 0)
+	{
+		pixels = v4l2Decode(decoder);
+		if(pixels == 0)
+		{
+			DebugPrintf("*imageDecoderV4L2Close falling back to the loader\n");
+			imageDecoderV4L2Fall(decoder, 0);	// (the loader's close reports any error)
+		}
+	}
+
+	if(pixels == 0)
+		pixels = ImageDecoderClose(decoder->fallback, error);
+	else
+		g_byte_array_free(decoder->jpeg, TRUE);
+
+	g_free(decoder);
+	return(pixels);
+}
+
+static void			imageDecoderV4L2Abort(ImageDecoder* d)
+{
+	ImageDecoderV4L2* decoder = (ImageDecoderV4L2*)d;
+	if(decoder->fallback != 0)
+		ImageDecoderAbort(decoder->fallback);
+	else
+		g_byte_array_free(decoder->jpeg, TRUE);
+	g_free(decoder);
+}
+
+// (the hardware decodes in one go at close; only a fallback has anything to show before then)
+static GdkPixbuf*	imageDecoderV4L2Preview(ImageDecoder* d, GdkRectangle* outArea, int* outWidth, int* outHeight)
+{
+	ImageDecoderV4L2* decoder = (ImageDecoderV4L2*)d;
+	return((decoder->fallback != 0)? ImageDecoderPreview(decoder->fallback, outArea, outWidth, outHeight) : 0);
+}
+
+static ImageDecoderBackend const kImageDecoderV4L2 =
+{
+	.name = "v4l2",
+	.create = &imageDecoderV4L2Create,
+	.write = &imageDecoderV4L2Write,
+	.close = &imageDecoderV4L2Close,
+	.abort = &imageDecoderV4L2Abort,
+	.preview = &imageDecoderV4L2Preview,
+};
+
+// checks that 'device' is a memory-to-memory decoder that takes JPEG
+static gboolean		v4l2Probe(char const* device)
+{
+	int fd = open(device, O_RDWR | O_CLOEXEC);
+	if(fd < 0)
+	{
+		g_warning("Can't open the JPEG decoder %s: %s", device, g_strerror(errno));
+		return(FALSE);
+	}
+
+	struct v4l2_capability capability;
+	memset(&capability, 0, sizeof(capability));
+	uint32_t caps = 0;
+	if(v4l2Ioctl(fd, VIDIOC_QUERYCAP, &capability) == 0)
+		caps = (capability.capabilities & V4L2_CAP_DEVICE_CAPS)? capability.device_caps : capability.capabilities;
+
+	gImageDecoder.pixelFormat = 0;
+	if((caps & V4L2_CAP_VIDEO_M2M_MPLANE) && (caps & V4L2_CAP_STREAMING))
+	{
+		struct v4l2_fmtdesc description;
+		memset(&description, 0, sizeof(description));
+		description.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+		while((gImageDecoder.pixelFormat == 0) && (v4l2Ioctl(fd, VIDIOC_ENUM_FMT, &description) == 0))
+		{
+			if((description.pixelformat == V4L2_PIX_FMT_JPEG) || (description.pixelformat == V4L2_PIX_FMT_MJPEG))
+				gImageDecoder.pixelFormat = description.pixelformat;
+			description.index++;
+		}
+	}
+	close(fd);
+
+	if(gImageDecoder.pixelFormat == 0)
+		g_warning("%s isn't a V4L2 JPEG decoder, decoding in software", device);
+	return(gImageDecoder.pixelFormat != 0);
+}
+
+#endif	// PIFRAME_V4L2
+
+
+// picks the backend for new decoders: the V4L2 decoder at 'device', if it's usable, or the loader
+static void			imageDecoderInit(char const* device, gint64 maxPixels)
+{
+	gImageDecoder.backend = &kImageDecoderLoader;
+	gImageDecoder.maxPixels = maxPixels;
+#if defined(PIFRAME_V4L2)
+	if((device != 0) && v4l2Probe(device))
+	{
+		gImageDecoder.device = g_strdup(device);
+		gImageDecoder.backend = &kImageDecoderV4L2;
+	}
+#else
+	(void)device;
+#endif
+	DebugPrintf("*imageDecoderInit %s\n", gImageDecoder.backend->name);
+}
+
+
+
+typedef struct ImageDownloadInitOptions
+{
+	char const*			decodeDevice;	// optional: a V4L2 JPEG decoder (PIFRAME_V4L2 builds)
+	gint64				maxPixels;		// ceiling on a decoded photo's width x height, 0 for none (see Decoders)
+	int					clientHints;	// tell the server each photo's target size and the formats decoded here
+
+} ImageDownloadInitOptions;
+
+// Presentation times: a server driving several frames at once can
+//   ask for a photo to be shown at a given instant, with an
+//   "X-PiFrame-Present-At: <Unix time in seconds>" header (fractions
+//   allowed) on the response, or on a push stream's part.  Every frame
+//   on an NTP-synchronized clock then swaps within a frame of the rest,
+//   however long each one's download took.
+#define kImagePresentHeader "X-PiFrame-Present-At:"
+
+// the wall-clock time (as g_get_real_time()) a header line asks for, 0 if it isn't one
+static gint64		imagePresentTimeParse(char const* line)
+{
+	size_t length = strlen(kImagePresentHeader);
+	if(g_ascii_strncasecmp(line, kImagePresentHeader, length))
+		return(0);
+
+	double seconds = g_ascii_strtod(line + length, 0);
+	return((seconds > 0.0)? (gint64)(seconds * 1e6) : 0);
+}
+
+typedef struct ImageDownloadOptions
+{
+	char const*			url;
+	void				(*completeCallback)(void* context, GdkPixbuf* pixels, char const* hash, GError* error, Metrics const* metrics);
+	void*				context;
+
+	// Optional, called on curlThread when the photo with content 'hash'
+	//   is about to be served from the disk cache.  Return non-0 if the
+	//   client already has what it needs of it (a scaled frame, say) to
+	//   skip decoding: completeCallback then gets no pixels and no error.
+	int					(*cachedCallback)(void* context, char const* hash);
+
+	int					streaming;	// feed the decoder from curlThread directly (see Download streamCallback)
+
+	// If set, the image is decoded at the smallest size that still
+	//   covers targetWidth x targetHeight when scaled to fill and
+	//   cropped, rather than at its full resolution.
+	int					targetWidth;
+	int					targetHeight;
+
+	int					metrics;	// time the photo's phases: completeCallback gets them (else 0)
+
+	// Optional, called on the main thread while the photo is still
+	//   arriving with a copy of a newly decoded 'area' of it, and where
+	//   that goes in the photo as decoded so far ('width' x 'height'.)
+	//   Every call comes before completeCallback.
+	void				(*previewCallback)(void* context, GdkPixbuf* area, GdkRectangle const* where, int width, int height);
+
+	int					priority;	// the Download's (see DownloadOptions)
+
+	int					pixelRatio;	// with client hints: device pixels per target pixel (0 for 1)
+
+	// Optional: filled in before completeCallback with when the server
+	//   asked for the photo to be shown (see kImagePresentHeader), 0 if
+	//   it didn't.
+	gint64*				presentTime;
+
+	char const*			hash;		// optional: the photo's, if known (see DownloadOptions; not kept)
+
+} ImageDownloadOptions;
+
+#define kImageDownloadPreviewMS (250)
+
+
+typedef struct ImageDownload
+{
+	ImageDownloadOptions	options;
+	ImageDecoder*			decoder;	// used only on the decode thread
+	Download*				download;
+	
+	int						refcount;	// the client's (until completion or ImageDownloadStop) and the pipeline's (main thread)
+	gint					abort;		// (atomic) the Download's cancel flag
+	int						stopped;	// ImageDownloadStop() was called (main thread)
+
+	GdkPixbuf*				pixels;		// decode result, posted to the main thread
+	GError*					error;
+	char*					hash;		// content hash from the disk cache, 0 if unknown
+	int						skipped;	// cachedCallback declined the body
+	gint64					presentTime;	// from the response headers (curlThread), read after completion
+	Metrics					metrics;	// the photo's timings, with options.metrics (every thread's fields are its own), read after completion
+
+	gint64					previewTime;	// of the last preview posted (decoding thread)
+	gint					previewPending;	// (atomic) a preview is waiting for the main thread
+
+} ImageDownload;
+
+typedef struct ImageDownloadPreview
+{
+	ImageDownload*			imageDownload;
+	GdkPixbuf*				area;
+	GdkRectangle			where;
+	int						width;
+	int						height;
+
+} ImageDownloadPreview;
+
+static struct
+{
+	GMainContext*		context;	// run by the decode thread
+	GMainLoop*			loop;
+	DownloadDispatcher*	dispatcher;	// delivers Download callbacks to the decode thread
+
+	char*				accept;		// the client hints' Accept header, 0 when hints are off
+
+} gImageDecode;
+
+////////////////////////////////////////////////////////////////
+// Client hints: each request can tell the server what the photo
+//   is for, so that it can send one already sized and encoded for
+//   this frame: the target size (Sec-CH-Viewport-Width and -Height)
+//   and pixel ratio (Sec-CH-DPR), and an Accept header listing
+//   only formats that can be decoded here, the cheapest to decode
+//   first.  What's already cached is told by If-None-Match (see the
+//   disk cache.)
+
+static char const* const	kImageDownloadFormats[] = {"image/avif", "image/webp", "image/jpeg", "image/png", 0};
+
+static gboolean		imageDownloadCanDecode(char const* type)
+{
+	gboolean found = FALSE;
+	GSList* formats = gdk_pixbuf_get_formats();
+	GSList* link;
+	for(link = formats; (link != 0) && !found; link = link->next)
+	{
+		gchar** types = gdk_pixbuf_format_get_mime_types((GdkPixbufFormat*)link->data);
+		found = g_strv_contains((gchar const* const*)types, type);
+		g_strfreev(types);
+	}
+	g_slist_free(formats);
+	return(found);
+}
+
+static char*		imageDownloadAcceptNew(void)
+{
+	GString* accept = g_string_new("Accept: ");
+
+	// a hardware decoder only takes JPEG, which makes it the cheapest
+	int jpegFirst = (gImageDecoder.backend != &kImageDecoderLoader);
+	if(jpegFirst)
+		g_string_append(accept, "image/jpeg, ");
+
+	int i;
+	for(i = 0; kImageDownloadFormats[i] != 0; i++)
+	{
+		if((!jpegFirst || strcmp(kImageDownloadFormats[i], "image/jpeg")) && imageDownloadCanDecode(kImageDownloadFormats[i]))
+			g_string_append_printf(accept, "%s, ", kImageDownloadFormats[i]);
+	}
+	g_string_append(accept, "*/*;q=0.1");
+
+	return(g_string_free(accept, FALSE));
+}
+
+// the request headers for a photo of the given target, or 0 when hints are off
+static char**		imageDownloadHintsNew(int targetWidth, int targetHeight, int pixelRatio)
+{
+	if(gImageDecode.accept == 0)
+		return(0);
+
+	GPtrArray* headers = g_ptr_array_new();
+	g_ptr_array_add(headers, g_strdup(gImageDecode.accept));
+	if((targetWidth > 0) && (targetHeight > 0))
+	{
+		g_ptr_array_add(headers, g_strdup_printf("Sec-CH-Viewport-Width: %i", targetWidth));
+		g_ptr_array_add(headers, g_strdup_printf("Sec-CH-Viewport-Height: %i", targetHeight));
+	}
+	g_ptr_array_add(headers, g_strdup_printf("Sec-CH-DPR: %i", MAX(pixelRatio, 1)));
+	g_ptr_array_add(headers, 0);
+
+	return((char**)g_ptr_array_free(headers, FALSE));
+}
+
+
+void	onImageDownloadProgress(DownloadOptions const* download, unsigned char const* data, size_t length, size_t received, size_t expected);
+void	onImageDownloadComplete(DownloadOptions const* download, int result, char const* reason);
+int		onImageDownloadStream(DownloadOptions const* download, unsigned char const* data, size_t length);
+int		onImageDownloadContent(DownloadOptions const* download, char const* hash, int cached);
+void	onImageDownloadHeader(DownloadOptions const* download, char const* line);
+
+
+static gpointer		imageDecodeThread(gpointer info)
+{
+	(void)info;
+	DebugPrintf("+imageDecodeThread\n");
+	g_main_context_push_thread_default(gImageDecode.context);
+
+	g_main_loop_run(gImageDecode.loop);
+
+	g_main_context_pop_thread_default(gImageDecode.context);
+	DebugPrintf("-imageDecodeThread\n");
+	return(0);
+}
+
+void				ImageDownloadInit(ImageDownloadInitOptions const* options)
+{
+	DebugPrintf("+ImageDownloadInit\n");
+	imageDecoderInit(options->decodeDevice, options->maxPixels);
+
+	gImageDecode.accept = options->clientHints? imageDownloadAcceptNew() : 0;
+	DebugPrintf("*ImageDownloadInit hints %s\n", (gImageDecode.accept != 0)? gImageDecode.accept : "off");
+
+	gImageDecode.context = g_main_context_new();
+	gImageDecode.loop = g_main_loop_new(gImageDecode.context, FALSE);
+	gImageDecode.dispatcher = DownloadDispatcherNew(gImageDecode.context);
+
+	g_thread_new("decode-thread", &imageDecodeThread, 0);
+	DebugPrintf("-ImageDownloadInit\n");
+}
+
+
+ImageDownload*		ImageDownloadNew(ImageDownloadOptions const* options)
+{
+	DebugPrintf("+ImageDownloadNew\n");
+	ImageDownload* imageDownload = (ImageDownload*)malloc(sizeof(ImageDownload));
+	DebugPrintf("malloc(ImageDownload) %p\n", imageDownload);
+	
+	imageDownload->options.url = strdup(options->url);
+	DebugPrintf("strdup(url), %p\n", imageDownload->options.url);
+	imageDownload->options.completeCallback = options->completeCallback;
+	imageDownload->options.context = options->context;
+	imageDownload->options.streaming = options->streaming;
+	imageDownload->options.targetWidth = options->targetWidth;
+	imageDownload->options.targetHeight = options->targetHeight;
+	imageDownload->options.cachedCallback = options->cachedCallback;
+	imageDownload->options.metrics = options->metrics;
+	imageDownload->options.previewCallback = options->previewCallback;
+	imageDownload->options.priority = options->priority;
+	imageDownload->options.pixelRatio = options->pixelRatio;
+	imageDownload->options.presentTime = options->presentTime;
+	imageDownload->options.hash = 0;
+
+	imageDownload->decoder = ImageDecoderNew(imageDownload->options.targetWidth, imageDownload->options.targetHeight);
+
+	imageDownload->refcount = 2;	// the client's and the pipeline's
+	imageDownload->abort = 0;
+	imageDownload->stopped = 0;
+
+	imageDownload->pixels = 0;
+	imageDownload->error = 0;
+	imageDownload->hash = 0;
+	imageDownload->skipped = 0;
+	imageDownload->presentTime = 0;
+	memset(&imageDownload->metrics, 0, sizeof(imageDownload->metrics));
+	imageDownload->previewTime = 0;
+	imageDownload->previewPending = 0;
+
+	DownloadOptions downloadOptions =
+	{
+		.url = imageDownload->options.url,
+		.progressCallback = &onImageDownloadProgress,
+		.completeCallback = &onImageDownloadComplete,
+		.context = (void*)imageDownload,
+		.dispatcher = gImageDecode.dispatcher,
+		.cache = 1,
+		.contentCallback = &onImageDownloadContent,
+		.metrics = imageDownload->options.metrics? &imageDownload->metrics : 0,	// (an ImageDownload outlives its Download)
+		.cancel = &imageDownload->abort,
+		.priority = imageDownload->options.priority,
+		.headers = imageDownloadHintsNew(imageDownload->options.targetWidth, imageDownload->options.targetHeight, imageDownload->options.pixelRatio),
+		.headerCallback = (imageDownload->options.presentTime != 0)? &onImageDownloadHeader : 0,
+		.hash = options->hash,
+	};
+
+	if(imageDownload->options.streaming)
+	{
+		downloadOptions.progressCallback = 0;
+		downloadOptions.streamCallback = &onImageDownloadStream;
+	}
+	
+	imageDownload->download = DownloadNew(&downloadOptions);
+	g_strfreev(downloadOptions.headers);	// (duplicated by DownloadNew)
+	DebugPrintf("-ImageDownloadNew\n");
+	return(imageDownload);
+}
+
+// main thread
+static void			imageDownloadRelease(ImageDownload* imageDownload)
+{
+	if(--imageDownload->refcount > 0)
+		return;
+
+	DebugPrintf("free((void*)imageDownload->options.url) %p\n", (void*)imageDownload->options.url);
+	free((void*)imageDownload->options.url);
+	DebugPrintf("free(imageDownload) %p\n", imageDownload);
+	free(imageDownload);
+}
+
+// main thread: cancels the download; its completeCallback won't be called.
+//   Must not be called after completeCallback (which drops the client's reference.)
+void				ImageDownloadStop(ImageDownload* download)
+{
+	if(download->stopped)
+		return;
+
+	DebugPrintf("*ImageDownloadStop %p\n", download);
+	download->stopped = 1;
+	g_atomic_int_set(&download->abort, 1);	// (the rest happens when the Download completes)
+	imageDownloadRelease(download);
+}
+
+// what's waiting on the decode thread: progress items and completions
+void				ImageDownloadGetStats(unsigned int* outProgress, unsigned int* outResults)
+{
+	DownloadDispatcherGetStats(gImageDecode.dispatcher, outProgress, outResults);
+}
+
+
+// main thread (posted before the completion, so the ImageDownload is still there)
+static gboolean		onImageDownloadDeliverPreview(gpointer user)
+{
+	ImageDownloadPreview* preview = (ImageDownloadPreview*)user;
+	ImageDownload* imageDownload = preview->imageDownload;
+
+	if(!imageDownload->stopped)
+		imageDownload->options.previewCallback(imageDownload->options.context, preview->area, &preview->where, preview->width, preview->height);
+	g_atomic_int_set(&imageDownload->previewPending, 0);
+
+	g_object_unref(preview->area);
+	g_free(preview);
+	return(FALSE);	// 1-shot
+}
+
+// decoding thread: posts what's new, unless it's too soon or the last one is still waiting
+static void			imageDownloadPreview(ImageDownload* imageDownload)
+{
+	gint64 now = g_get_monotonic_time();
+	if((imageDownload->options.previewCallback == 0) || g_atomic_int_get(&imageDownload->previewPending) || g_atomic_int_get(&imageDownload->abort)
+		|| (imageDownload->presentTime != 0) || (now - imageDownload->previewTime < 1000 * kImageDownloadPreviewMS))	// (a timed photo isn't shown early)
+		return;
+
+	ImageDownloadPreview* preview = g_new(ImageDownloadPreview, 1);
+	preview->area = ImageDecoderPreview(imageDownload->decoder, &preview->where, &preview->width, &preview->height);
+	if(preview->area == 0)
+	{
+		g_free(preview);
+		return;
+	}
+
+	DebugPrintf("*imageDownloadPreview %ix%i at %i,%i\n", preview->where.width, preview->where.height, preview->where.x, preview->where.y);
+	preview->imageDownload = imageDownload;
+	imageDownload->previewTime = now;
+	g_atomic_int_set(&imageDownload->previewPending, 1);
+	gdk_threads_add_idle(&onImageDownloadDeliverPreview, (gpointer)preview);
+}
+
+void				onImageDownloadProgress(DownloadOptions const* download, unsigned char const* data, size_t length, size_t received, size_t expected)
+{
+	DebugPrintf("+onImageDownloadProgress length=%i\n", length);
+	ImageDownload* imageDownload = (ImageDownload*)download->context;
+
+	if((imageDownload->error != 0) || g_atomic_int_get(&imageDownload->abort))
+	{
+		DebugPrintf("-onImageDownloadProgress aborting\n");	// (chunks still in the queue)
+		return;
+	}
+
+	gint64 start = g_get_monotonic_time();
+	gboolean written = ImageDecoderWrite(imageDownload->decoder, data, length, &imageDownload->error);
+	if(imageDownload->options.metrics)
+		imageDownload->metrics.decodeUS += g_get_monotonic_time() - start;
+
+	if(!written)
+	{
+		// a corrupt (or oversized) photo won't get better: stop the transfer, report the decoder's error
+		DebugPrintf("*onImageDownloadProgress loader err\n");
+		g_atomic_int_set(&imageDownload->abort, 1);
+	}
+	else
+	{
+		DebugPrintf("*onImageDownloadProgress loader happy\n");
+		imageDownloadPreview(imageDownload);
+	}
+	DebugPrintf("-onImageDownloadProgress\n");
+}
+
+// curlThread (streaming mode): write libcurl's buffer straight into the decoder
+int					onImageDownloadStream(DownloadOptions const* download, unsigned char const* data, size_t length)
+{
+	DebugPrintf("+onImageDownloadStream length=%i\n", length);
+	ImageDownload* imageDownload = (ImageDownload*)download->context;
+
+	gint64 start = g_get_monotonic_time();
+	gboolean written = ImageDecoderWrite(imageDownload->decoder, data, length, &imageDownload->error);
+	if(imageDownload->options.metrics)
+		imageDownload->metrics.decodeUS += g_get_monotonic_time() - start;
+
+	if(!written)
+	{
+		// a corrupt stream won't get better: abort the transfer and report the loader's error
+		DebugPrintf("-onImageDownloadStream loader err\n");
+		return(0);
+	}
+	imageDownloadPreview(imageDownload);
+
+	DebugPrintf("-onImageDownloadStream\n");
+	return(1);
+}
+
+// curlThread: remember the content hash, and let the client skip a cached body
+int					onImageDownloadContent(DownloadOptions const* download, char const* hash, int cached)
+{
+	ImageDownload* imageDownload = (ImageDownload*)download->context;
+
+	g_free(imageDownload->hash);
+	imageDownload->hash = g_strdup(hash);	// (read after completion, which is queued after this)
+
+	if(cached && (imageDownload->options.cachedCallback != 0) && imageDownload->options.cachedCallback(imageDownload->options.context, hash))
+	{
+		DebugPrintf("*onImageDownloadContent skip %s\n", hash);
+		imageDownload->skipped = 1;
+		return(0);
+	}
+	return(1);
+}
+
+void				onImageDownloadHeader(DownloadOptions const* download, char const* line)
+{
+	ImageDownload* imageDownload = (ImageDownload*)download->context;
+
+	if(!strncmp(line, "HTTP/", 5))
+		imageDownload->presentTime = 0;	// (a redirect's doesn't count)
+	else if(imagePresentTimeParse(line) != 0)
+		imageDownload->presentTime = imagePresentTimeParse(line);	// (read after completion, which is queued after this)
+}
+
+// main thread: hand the decoded image to the client and free the ImageDownload
+static gboolean		onImageDownloadDeliver(gpointer user)
+{
+	DebugPrintf("+onImageDownloadDeliver\n");
+	ImageDownload* imageDownload = (ImageDownload*)user;
+
+	// invoke callback (which is the end of the client's reference)
+	if(!imageDownload->stopped)
+	{
+		if(imageDownload->options.presentTime != 0)
+			*imageDownload->options.presentTime = imageDownload->presentTime;
+		imageDownload->options.completeCallback(imageDownload->options.context, imageDownload->pixels, imageDownload->hash, imageDownload->error,
+			imageDownload->options.metrics? &imageDownload->metrics : 0);
+		imageDownloadRelease(imageDownload);
+	}
+
+	if(imageDownload->pixels != 0)
+		g_object_unref(imageDownload->pixels);
+	if(imageDownload->error != 0)
+		g_error_free(imageDownload->error);
+	g_free(imageDownload->hash);
+
+	imageDownloadRelease(imageDownload);	// (the pipeline's)
+
+	DebugPrintf("-onImageDownloadDeliver\n");
+	return(FALSE);	// 1-shot
+}
+
+// decode thread: the decoder finishes decoding on close
+static gboolean		imageDownloadClose(ImageDownload* imageDownload, GError** error)
+{
+	gint64 start = g_get_monotonic_time();
+	imageDownload->pixels = ImageDecoderClose(imageDownload->decoder, error);
+	imageDownload->decoder = 0;
+	if(imageDownload->options.metrics)
+		imageDownload->metrics.decodeUS += g_get_monotonic_time() - start;
+	return(imageDownload->pixels != 0);
+}
+
+// decode thread: finish decoding, then post the result to the main thread
+void				onImageDownloadComplete(DownloadOptions const* download, int result, char const* reason)
+{
+	DebugPrintf("+onImageDownloadComplete result=%i reason=%s\n", result, reason);
+	ImageDownload* imageDownload = (ImageDownload*)download->context;
+	
+	GError* error = 0;
+	if(imageDownload->error != 0)
+	{
+		// (the decoder already failed and aborted the transfer)
+		DebugPrintf("*onImageDownloadComplete decoder error\n");
+		ImageDecoderAbort(imageDownload->decoder);
+	}
+	else if(g_atomic_int_get(&imageDownload->abort))
+	{
+		DebugPrintf("*onImageDownloadComplete stopped\n");	// (ImageDownloadStop: nothing else sets it without an error)
+		ImageDecoderAbort(imageDownload->decoder);
+	}
+	else if((result == CURLE_OK) && imageDownload->skipped)
+	{
+		DebugPrintf("*onImageDownloadComplete skipped (cached)\n");
+		ImageDecoderAbort(imageDownload->decoder);	// (it never saw any data)
+	}
+	else if((result == CURLE_OK) && imageDownloadClose(imageDownload, &error))
+	{
+		DebugPrintf("*onImageDownloadComplete Download ok\n");
+	}
+	else
+	{
+		DebugPrintf("+onImageDownloadComplete Download error %i, \"%s\", decoder error: %p\n", result, curl_easy_strerror(result), error);
+
+		if(result != CURLE_OK)
+		{
+			ImageDecoderAbort(imageDownload->decoder);
+
+			error = g_error_new_literal(g_quark_from_static_string("piframe-image-download-error-quark"), result, curl_easy_strerror(result));
+		}
+
+		imageDownload->error = error;
+
+		DebugPrintf("-onImageDownloadComplete Download error\n");
+	}
+
+	imageDownload->decoder = 0;	// (closed or aborted above)
+
+	gdk_threads_add_idle(&onImageDownloadDeliver, (gpointer)imageDownload);
+	
+	DebugPrintf("-onImageDownloadComplete\n");
+}
+
+
+
+////////////////////////////////////////////////////////////////
+// Push streams: one request whose multipart response carries a
+//   photo per part, pushed whenever the server likes.  The parts
+//   are split out on curlThread and each one is streamed into a
+//   decoder of its own; every decoded part is posted to the main
+//   thread as it completes.  A part with a Content-Length is
+//   passed on as-is; without one, the body is searched for the
+//   next boundary.  The boundary is taken from the first line
+//   of the body, so the Content-Type header isn't needed.
+
+typedef struct ImageStreamOptions
+{
+	char const*			url;
+	void				(*partCallback)(void* context, GdkPixbuf* pixels, GError* error, Metrics const* metrics, gint64 presentTime);	// for each part (presentTime as for ImageDownloadOptions)
+	void				(*endCallback)(void* context, GError* error);	// the stream is over, error 0 if it ended cleanly
+	void*				context;
+
+	int					targetWidth;	// as for ImageDownloadOptions
+	int					targetHeight;
+	int					pixelRatio;
+
+} ImageStreamOptions;
+
+typedef enum ImageStreamState
+{
+	kImageStreamPreamble = 0,	// looking for the first boundary
+	kImageStreamHeaders,		// part headers, up to an empty line
+	kImageStreamBody,
+	kImageStreamTrailer,		// after a sized body, looking for the next boundary
+	kImageStreamBoundary,		// the rest of a boundary line found in a body
+	kImageStreamDone,			// the closing boundary was seen
+
+} ImageStreamState;
+
+#define kImageStreamMaxLine (4096)	// longer header lines mean this isn't a multipart stream
+
+typedef struct ImageStream
+{
+	ImageStreamOptions	options;
+	Download*			download;
+	gint				abort;		// (atomic) the Download's cancel flag, see ImageStreamStop()
+
+	// parser (curlThread)
+	ImageStreamState	state;
+	GByteArray*			buffer;		// a partial line, or the end of a body that could be the start of a delimiter
+	char*				delimiter;	// "\r\n--<boundary>"
+	gint64				remaining;	// body bytes left, -1 for a part without a Content-Length
+	ImageDecoder*		decoder;	// the current part's
+	GError*				error;		// the current part's decoder error
+	gint64				presentTime;	// the current part's, 0 if its headers had none
+	Metrics				metrics;	// the current part's (decode and bytes only)
+	unsigned int		parts;
+
+	GError*				result;		// end of stream, posted to the main thread
+
+} ImageStream;
+
+typedef struct ImageStreamPart
+{
+	ImageStream*		stream;
+	GdkPixbuf*			pixels;
+	GError*				error;
+	Metrics				metrics;
+	gint64				presentTime;
+
+} ImageStreamPart;
+
+// main thread
+static gboolean		onImageStreamDeliverPart(gpointer user)
+{
+	ImageStreamPart* part = (ImageStreamPart*)user;
+
+	part->stream->options.partCallback(part->stream->options.context, part->pixels, part->error, &part->metrics, part->presentTime);
+
+	if(part->pixels != 0)
+		g_object_unref(part->pixels);
+	if(part->error != 0)
+		g_error_free(part->error);
+	g_free(part);
+	return(FALSE);	// 1-shot
+}
+
+static void			imageStreamBeginPart(ImageStream* stream)
+{
+	stream->decoder = ImageDecoderNew(stream->options.targetWidth, stream->options.targetHeight);
+	stream->error = 0;
+	memset(&stream->metrics, 0, sizeof(stream->metrics));
+}
+
+static void			imageStreamWrite(ImageStream* stream, unsigned char const* data, size_t length)
+{
+	if((stream->decoder != 0) && (stream->error == 0) && (length > 0))
+	{
+		gint64 start = g_get_monotonic_time();
+		ImageDecoderWrite(stream->decoder, data, length, &stream->error);	// (a bad part only spoils itself)
+		stream->metrics.decodeUS += g_get_monotonic_time() - start;
+		stream->metrics.bytes += length;
+	}
+}
+
+static void			imageStreamEndPart(ImageStream* stream)
+{
+	if(stream->decoder == 0)
+		return;
+
+	ImageStreamPart* part = g_new(ImageStreamPart, 1);
+	part->stream = stream;
+	part->pixels = 0;
+	part->error = stream->error;
+
+	gint64 start = g_get_monotonic_time();
+	if(part->error != 0)
+		ImageDecoderAbort(stream->decoder);
+	else
+		part->pixels = ImageDecoderClose(stream->decoder, &part->error);
+	stream->metrics.decodeUS += g_get_monotonic_time() - start;
+	part->metrics = stream->metrics;
+	part->presentTime = stream->presentTime;
+
+	stream->decoder = 0;
+	stream->error = 0;
+	stream->parts++;
+
+	DebugPrintf("*imageStreamEndPart %u %s\n", stream->parts, (part->pixels != 0)? "ok" : "error");
+	gdk_threads_add_idle(&onImageStreamDeliverPart, (gpointer)part);
+}
+
+static void			imageStreamLine(ImageStream* stream, char* line)
+{
+	switch(stream->state)
+	{
+	case kImageStreamPreamble:
+		if(!strncmp(line, "--", 2))
+		{
+			stream->delimiter = g_strconcat("\r\n", line, NULL);
+			stream->state = kImageStreamHeaders;
+			stream->remaining = -1;
+			stream->presentTime = 0;
+		}
+		break;
+
+	case kImageStreamTrailer:
+		if(strncmp(line, stream->delimiter + 2, strlen(stream->delimiter + 2)))
+			break;	// (not the boundary yet)
+		line += strlen(stream->delimiter + 2);
+		// fall through: the rest of the boundary line
+	case kImageStreamBoundary:
+		stream->state = strncmp(line, "--", 2)? kImageStreamHeaders : kImageStreamDone;
+		stream->remaining = -1;
+		stream->presentTime = 0;
+		break;
+
+	case kImageStreamHeaders:
+		if(line[0] == 0)
+		{
+			imageStreamBeginPart(stream);
+			stream->state = kImageStreamBody;
+		}
+		else if(!g_ascii_strncasecmp(line, "Content-Length:", 15))
+			stream->remaining = g_ascii_strtoll(line + 15, 0, 10);
+		else if(imagePresentTimeParse(line) != 0)
+			stream->presentTime = imagePresentTimeParse(line);
+		break;
+
+	default:
+		break;
+	}
+}
+
+static unsigned char const*	imageStreamFind(unsigned char const* data, size_t length, char const* pattern, size_t patternLength)
+{
+	unsigned char const* end = data + length;
+	while((size_t)(end - data) >= patternLength)
+	{
+		unsigned char const* candidate = memchr(data, pattern[0], (end - data) - patternLength + 1);
+		if(candidate == 0)
+			break;
+		if(!memcmp(candidate, pattern, patternLength))
+			return(candidate);
+		data = candidate + 1;
+	}
+	return(0);
+}
+
+// curlThread: split the multipart response into parts
+static int			onImageStreamData(DownloadOptions const* download, unsigned char const* data, size_t length)
+{
+	ImageStream* stream = (ImageStream*)download->context;
+
+	while((length > 0) && (stream->state != kImageStreamDone))
+	{
+		if((stream->state == kImageStreamBody) && (stream->remaining >= 0))
+		{
+			// sized part: zero-copy
+			size_t count = (size_t)MIN((gint64)length, stream->remaining);
+			imageStreamWrite(stream, data, count);
+			data += count;
+			length -= count;
+			stream->remaining -= count;
+
+			if(stream->remaining == 0)
+			{
+				imageStreamEndPart(stream);
+				stream->state = kImageStreamTrailer;
+			}
+		}
+		else if(stream->state == kImageStreamBody)
+		{
+			// unsized part: hold back whatever could be the start of the delimiter
+			size_t delimiterLength = strlen(stream->delimiter);
+			g_byte_array_append(stream->buffer, data, length);
+			length = 0;
+
+			unsigned char const* found = imageStreamFind(stream->buffer->data, stream->buffer->len, stream->delimiter, delimiterLength);
+			if(found != 0)
+			{
+				size_t before = found - stream->buffer->data;
+				imageStreamWrite(stream, stream->buffer->data, before);
+				imageStreamEndPart(stream);
+				stream->state = kImageStreamBoundary;
+
+				// parse what followed the delimiter again
+				size_t restLength = stream->buffer->len - (before + delimiterLength);
+				unsigned char* rest = (unsigned char*)g_memdup(found + delimiterLength, restLength);
+
+				g_byte_array_set_size(stream->buffer, 0);
+				int ok = onImageStreamData(download, rest, restLength);
+				g_free(rest);
+				return(ok);
+			}
+			else if(stream->buffer->len >= delimiterLength)
+			{
+				size_t safe = stream->buffer->len - (delimiterLength - 1);
+				imageStreamWrite(stream, stream->buffer->data, safe);
+				g_byte_array_remove_range(stream->buffer, 0, safe);
+			}
+		}
+		else
+		{
+			// line by line
+			unsigned char const* newline = memchr(data, '\n', length);
+			size_t count = (newline != 0)? (size_t)(newline - data) + 1 : length;
+
+			g_byte_array_append(stream->buffer, data, count);
+			data += count;
+			length -= count;
+
+			if(newline != 0)
+			{
+				g_byte_array_append(stream->buffer, (guint8 const*)"", 1);
+				imageStreamLine(stream, g_strchomp((char*)stream->buffer->data));
+				g_byte_array_set_size(stream->buffer, 0);
+			}
+			else if(stream->buffer->len > kImageStreamMaxLine)
+			{
+				DebugPrintf("*onImageStreamData not multipart\n");
+				return(0);
+			}
+		}
+	}
+
+	return(1);
+}
+
+// main thread
+static gboolean		onImageStreamDeliverEnd(gpointer user)
+{
+	ImageStream* stream = (ImageStream*)user;
+	DebugPrintf("*onImageStreamDeliverEnd after %u parts\n", stream->parts);
+
+	stream->options.endCallback(stream->options.context, stream->result);
+
+	if(stream->result != 0)
+		g_error_free(stream->result);
+	free((void*)stream->options.url);
+	free(stream);
+	return(FALSE);	// 1-shot
+}
+
+// decode thread: the connection is over
+static void			onImageStreamComplete(DownloadOptions const* download, int result, char const* reason)
+{
+	DebugPrintf("+onImageStreamComplete result=%i reason=%s\n", result, reason);
+	ImageStream* stream = (ImageStream*)download->context;
+
+	if(stream->decoder != 0)
+	{
+		ImageDecoderAbort(stream->decoder);	// (a part cut short)
+		stream->decoder = 0;
+	}
+	if(stream->error != 0)
+		g_error_free(stream->error);
+
+	stream->result = 0;
+	if(result != CURLE_OK)
+		stream->result = g_error_new_literal(g_quark_from_static_string("piframe-image-download-error-quark"), result, curl_easy_strerror(result));
+
+	g_byte_array_free(stream->buffer, TRUE);
+	g_free(stream->delimiter);
+
+	// (posted after the parts, so it arrives after them)
+	gdk_threads_add_idle(&onImageStreamDeliverEnd, (gpointer)stream);
+	DebugPrintf("-onImageStreamComplete\n");
+}
+
+ImageStream*		ImageStreamNew(ImageStreamOptions const* options)
+{
+	DebugPrintf("+ImageStreamNew\n");
+	ImageStream* stream = (ImageStream*)malloc(sizeof(ImageStream));
+	DebugPrintf("malloc(ImageStream) %p\n", stream);
+
+	stream->options = *options;
+	stream->options.url = strdup(options->url);
+
+	stream->state = kImageStreamPreamble;
+	stream->buffer = g_byte_array_new();
+	stream->delimiter = 0;
+	stream->remaining = -1;
+	stream->decoder = 0;
+	stream->error = 0;
+	stream->presentTime = 0;
+	memset(&stream->metrics, 0, sizeof(stream->metrics));
+	stream->parts = 0;
+	stream->result = 0;
+	stream->abort = 0;
+
+	DownloadOptions downloadOptions =
+	{
+		.url = stream->options.url,
+		.completeCallback = &onImageStreamComplete,
+		.context = (void*)stream,
+		.dispatcher = gImageDecode.dispatcher,
+		.streamCallback = &onImageStreamData,
+		.idle = 1,	// (the server sends parts when it likes)
+		.cancel = &stream->abort,
+		.headers = imageDownloadHintsNew(stream->options.targetWidth, stream->options.targetHeight, stream->options.pixelRatio),
+	};
+
+	stream->download = DownloadNew(&downloadOptions);
+	g_strfreev(downloadOptions.headers);
+	DebugPrintf("-ImageStreamNew\n");
+	return(stream);
+}
+
+// main thread: closes the stream.  Parts already decoded are still
+//   delivered, then endCallback as usual (with the cancellation error.)
+void				ImageStreamStop(ImageStream* stream)
+{
+	DebugPrintf("*ImageStreamStop %p\n", stream);
+	g_atomic_int_set(&stream->abort, 1);
+}
+
+
+
+////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////
+//
+// Scale subsystem: a crop-and-resample kernel for 8-bit RGB(A)
+//   images, used in place of gdk_pixbuf_scale() to fill the
+//   screen.
+//
+// The filter is separable.  Each source row a band needs is
+//   filtered horizontally once into a small ring of rows, then
+//   each output row is a weighted sum of ring rows.  The tap
+//   weights are a tent whose support widens when downscaling,
+//   so it behaves like bilinear when enlarging and like an area
+//   filter when reducing.  All arithmetic is in Q14 fixed point,
+//   so the SIMD vertical passes (NEON on ARM, SSE2 on x86) give
+//   exactly the same bytes as the scalar reference.
+//
+// Output rows can be split into bands that run on a thread pool.
+//
+////////////////////////////////////////////////////////////////
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+	#include <arm_neon.h>
+	#define PIFRAME_SCALE_NEON 1
+#elif defined(__SSE2__)
+	#include <emmintrin.h>
+	#define PIFRAME_SCALE_SSE2 1
+#endif
+
+#define kScaleWeightBits (14)
+#define kScaleWeightOne (1 << kScaleWeightBits)
+
+typedef enum ScaleKernel
+{
+	kScaleKernelSIMD = 0,	// SIMD vertical pass where available (the default)
+	kScaleKernelScalar,		// portable reference kernel
+	kScaleKernelGdk,		// gdk_pixbuf_scale(), GDK_INTERP_BILINEAR
+
+} ScaleKernel;
+
+typedef struct ScaleOptions
+{
+	ScaleKernel		kernel;
+	unsigned int	threads;	// bands per image; 0 for one per processor
+
+} ScaleOptions;
+
+// per-axis filter: for output sample i, count[i] taps starting at source index first[i]
+typedef struct ScaleFilter
+{
+	int			taps;		// stride of weights (the largest count)
+	int*		first;
+	int*		count;
+	int16_t*	weights;	// Q14, each output's weights sum to kScaleWeightOne
+
+} ScaleFilter;
+
+typedef struct ScaleJob
+{
+	unsigned char const*	src;
+	int						srcStride;
+	int						srcChannels;
+
+	unsigned char*			dest;
+	int						destWidth;
+	int						destStride;
+
+	ScaleFilter				horizontal;
+	ScaleFilter				vertical;
+
+	int						simd;
+
+} ScaleJob;
+
+typedef struct ScaleBatch
+{
+	GMutex			mutex;
+	GCond			bandDone;
+	int				bandsRemaining;
+
+} ScaleBatch;
+
+typedef struct ScaleBand
+{
+	ScaleJob const*		job;
+	int					y0, y1;	// output rows [y0, y1)
+
+	ScaleBatch*			batch;
+
+} ScaleBand;
+
+static struct
+{
+	ScaleOptions	options;
+
+	GThreadPool*	pool;		// band workers, 0 when single-threaded
+
+} gScale;
+
+
+// Builds the tap table mapping outLength output samples onto inLength
+//   source samples: output i covers source coordinate (i - offset) / scale.
+//   Taps falling off either edge are folded onto the edge sample.
+static void		scaleFilterInit(ScaleFilter* filter, int outLength, int inLength, double offset, double scale)
+{
+	double	radius = (scale < 1.0)? (1.0 / scale) : 1.0;
+	int		taps = (int)ceil(2.0 * radius) + 1,
+			i;
+
+	filter->taps = taps;
+	filter->first = (int*)malloc(sizeof(int) * outLength);
+	filter->count = (int*)malloc(sizeof(int) * outLength);
+	filter->weights = (int16_t*)malloc(sizeof(int16_t) * outLength * taps);
+
+	double* w = (double*)malloc(sizeof(double) * (taps + 1));
+
+	for(i = 0; i < outLength; i++)
+	{
+		double	center = (((double)i + 0.5 - offset) / scale) - 0.5;
+		int		first = (int)floor(center - radius) + 1,
+				last = (int)floor(center + radius),
+				n = 0, k;
+		double	sum = 0.0;
+
+		if(last - first + 1 > taps)
+			last = first + taps - 1;
+
+		// tent weights, folding off-image taps onto the nearest edge
+		int lo = CLAMP(first, 0, inLength - 1),
+			hi = CLAMP(last, 0, inLength - 1);
+
+		for(k = 0; k <= hi - lo; k++)
+			w[k] = 0.0;
+
+		for(k = first; k <= last; k++)
+		{
+			double t = 1.0 - (fabs((double)k - center) / radius);
+			if(t > 0.0)
+			{
+				w[CLAMP(k, 0, inLength - 1) - lo] += t;
+				sum += t;
+			}
+		}
+
+		if(sum <= 0.0)	// (degenerate: use the nearest sample)
+		{
+			lo = hi = CLAMP((int)floor(center + 0.5), 0, inLength - 1);
+			w[0] = sum = 1.0;
+		}
+
+		n = hi - lo + 1;
+
+		// quantize, putting the rounding remainder on the largest tap
+		int16_t*	q = filter->weights + (i * taps);
+		int			total = 0, largest = 0;
+		for(k = 0; k < n; k++)
+		{
+			q[k] = (int16_t)floor((w[k] / sum) * (double)kScaleWeightOne + 0.5);
+			total += q[k];
+			if(q[k] > q[largest])
+				largest = k;
+		}
+		q[largest] += (int16_t)(kScaleWeightOne - total);
+
+		filter->first[i] = lo;
+		filter->count[i] = n;
+	}
+
+	free(w);
+}
+
+static void		scaleFilterFree(ScaleFilter* filter)
+{
+	free(filter->first);
+	free(filter->count);
+	free(filter->weights);
+}
+
+// horizontal pass (scalar): one source row into one RGB ring row
+static void		scaleRowHorizontal(ScaleJob const* job, unsigned char const* srcRow, unsigned char* out)
+{
+	int		x, k,
+			channels = job->srcChannels,
+			taps = job->horizontal.taps;
+
+	for(x = 0; x < job->destWidth; x++)
+	{
+		unsigned char const*	p = srcRow + (job->horizontal.first[x] * channels);
+		int16_t const*			w = job->horizontal.weights + (x * taps);
+		int						n = job->horizontal.count[x];
+		uint32_t				r = kScaleWeightOne / 2, g = r, b = r;
+
+		for(k = 0; k < n; k++, p += channels)
+		{
+			r += (uint32_t)w[k] * p[0];
+			g += (uint32_t)w[k] * p[1];
+			b += (uint32_t)w[k] * p[2];
+		}
+
+		out[0] = (unsigned char)(r >> kScaleWeightBits);
+		out[1] = (unsigned char)(g >> kScaleWeightBits);
+		out[2] = (unsigned char)(b >> kScaleWeightBits);
+		out += 3;
+	}
+}
+
+// vertical pass (scalar reference): out[i] = sum of weights[k] * rows[k][i]
+static void		scaleRowsVerticalScalar(unsigned char const* const* rows, int16_t const* weights, int n, unsigned char* out, int start, int length)
+{
+	int i, k;
+	for(i = start; i < length; i++)
+	{
+		uint32_t acc = kScaleWeightOne / 2;
+		for(k = 0; k < n; k++)
+			acc += (uint32_t)weights[k] * rows[k][i];
+		out[i] = (unsigned char)(acc >> kScaleWeightBits);
+	}
+}
+
+#if defined(PIFRAME_SCALE_NEON)
+
+static void		scaleRowsVerticalSIMD(unsigned char const* const* rows, int16_t const* weights, int n, unsigned char* out, int length)
+{
+	int i, k;
+	for(i = 0; i + 16 <= length; i += 16)
+	{
+		uint32x4_t	a0 = vdupq_n_u32(kScaleWeightOne / 2), a1 = a0, a2 = a0, a3 = a0;
+
+		for(k = 0; k < n; k++)
+		{
+			uint8x16_t	p = vld1q_u8(rows[k] + i);
+			uint16x8_t	lo = vmovl_u8(vget_low_u8(p)),
+						hi = vmovl_u8(vget_high_u8(p));
+			uint16_t	w = (uint16_t)weights[k];
+
+			a0 = vmlal_n_u16(a0, vget_low_u16(lo), w);
+			a1 = vmlal_n_u16(a1, vget_high_u16(lo), w);
+			a2 = vmlal_n_u16(a2, vget_low_u16(hi), w);
+			a3 = vmlal_n_u16(a3, vget_high_u16(hi), w);
+		}
+
+		uint16x8_t	lo = vcombine_u16(vshrn_n_u32(a0, kScaleWeightBits), vshrn_n_u32(a1, kScaleWeightBits)),
+					hi = vcombine_u16(vshrn_n_u32(a2, kScaleWeightBits), vshrn_n_u32(a3, kScaleWeightBits));
+		vst1q_u8(out + i, vcombine_u8(vmovn_u16(lo), vmovn_u16(hi)));
+	}
+
+	scaleRowsVerticalScalar(rows, weights, n, out, i, length);
+}
+
+#elif defined(PIFRAME_SCALE_SSE2)
+
+static void		scaleRowsVerticalSIMD(unsigned char const* const* rows, int16_t const* weights, int n, unsigned char* out, int length)
+{
+	__m128i const	zero = _mm_setzero_si128();
+	int i, k;
+	for(i = 0; i + 16 <= length; i += 16)
+	{
+		__m128i	a0 = _mm_set1_epi32(kScaleWeightOne / 2), a1 = a0, a2 = a0, a3 = a0;
+
+		// rows are taken in pairs so that _mm_madd_epi16 does two taps at once
+		for(k = 0; k < n; k += 2)
+		{
+			int			last = (k + 1 >= n);
+			__m128i		p = _mm_loadu_si128((__m128i const*)(rows[k] + i)),
+						q = last? zero : _mm_loadu_si128((__m128i const*)(rows[k + 1] + i)),
+						w = _mm_set1_epi32((int)(((uint32_t)(last? 0 : (uint16_t)weights[k + 1]) << 16) | (uint16_t)weights[k])),
+						pLo = _mm_unpacklo_epi8(p, zero), pHi = _mm_unpackhi_epi8(p, zero),
+						qLo = _mm_unpacklo_epi8(q, zero), qHi = _mm_unpackhi_epi8(q, zero);
+
+			a0 = _mm_add_epi32(a0, _mm_madd_epi16(_mm_unpacklo_epi16(pLo, qLo), w));
+			a1 = _mm_add_epi32(a1, _mm_madd_epi16(_mm_unpackhi_epi16(pLo, qLo), w));
+			a2 = _mm_add_epi32(a2, _mm_madd_epi16(_mm_unpacklo_epi16(pHi, qHi), w));
+			a3 = _mm_add_epi32(a3, _mm_madd_epi16(_mm_unpackhi_epi16(pHi, qHi), w));
+		}
+
+		__m128i	lo = _mm_packs_epi32(_mm_srli_epi32(a0, kScaleWeightBits), _mm_srli_epi32(a1, kScaleWeightBits)),
+				hi = _mm_packs_epi32(_mm_srli_epi32(a2, kScaleWeightBits), _mm_srli_epi32(a3, kScaleWeightBits));
+		_mm_storeu_si128((__m128i*)(out + i), _mm_packus_epi16(lo, hi));
+	}
+
+	scaleRowsVerticalScalar(rows, weights, n, out, i, length);
+}
+
+#else
+
+static void		scaleRowsVerticalSIMD(unsigned char const* const* rows, int16_t const* weights, int n, unsigned char* out, int length)
+{
+	scaleRowsVerticalScalar(rows, weights, n, out, 0, length);
+}
+
+#endif
+
+// scales output rows [band->y0, band->y1)
+static void		scaleBand(ScaleBand const* band)
+{
+	ScaleJob const*	job = band->job;
+	int				taps = job->vertical.taps,
+					rowBytes = job->destWidth * 3,
+					y, k;
+
+	// ring of horizontally-filtered source rows, indexed by source row % taps
+	unsigned char*			ring = (unsigned char*)malloc((size_t)rowBytes * taps);
+	int*					ringRow = (int*)malloc(sizeof(int) * taps);
+	unsigned char const**	rows = (unsigned char const**)malloc(sizeof(unsigned char*) * taps);
+
+	for(k = 0; k < taps; k++)
+		ringRow[k] = -1;
+
+	for(y = band->y0; y < band->y1; y++)
+	{
+		int first = job->vertical.first[y],
+			n = job->vertical.count[y];
+
+		for(k = 0; k < n; k++)
+		{
+			int				sy = first + k;
+			unsigned char*	slot = ring + ((size_t)(sy % taps) * rowBytes);
+
+			if(ringRow[sy % taps] != sy)
+			{
+				scaleRowHorizontal(job, job->src + ((size_t)sy * job->srcStride), slot);
+				ringRow[sy % taps] = sy;
+			}
+			rows[k] = slot;
+		}
+
+		unsigned char* out = job->dest + ((size_t)y * job->destStride);
+		if(job->simd)
+			scaleRowsVerticalSIMD(rows, job->vertical.weights + (y * taps), n, out, rowBytes);
+		else
+			scaleRowsVerticalScalar(rows, job->vertical.weights + (y * taps), n, out, 0, rowBytes);
+	}
+
+	free(rows);
+	free(ringRow);
+	free(ring);
+}
+
+static void		onScaleBandWork(gpointer data, gpointer user)
+{
+	(void)user;
+	ScaleBand const* band = (ScaleBand const*)data;
+	ScaleBatch* batch = band->batch;
+
+	DebugPrintf("+onScaleBandWork\n");
+	scaleBand(band);
+	DebugPrintf("-onScaleBandWork\n");
+
+	g_mutex_lock(&batch->mutex);
+	if(--batch->bandsRemaining == 0)
+		g_cond_signal(&batch->bandDone);
+	g_mutex_unlock(&batch->mutex);
+}
+
+void			ScaleInit(ScaleOptions const* options)
+{
+	DebugPrintf("+ScaleInit\n");
+	gScale.options = *options;
+	if(gScale.options.threads == 0)
+		gScale.options.threads = g_get_num_processors();
+
+	gScale.pool = 0;
+	if(gScale.options.threads > 1)
+		gScale.pool = g_thread_pool_new(&onScaleBandWork, 0, gScale.options.threads, TRUE, 0);
+	DebugPrintf("-ScaleInit threads=%i\n", gScale.options.threads);
+}
+
+// Scales 8-bit RGB or RGBA 'src' into 8-bit RGB 'dest' (alpha is
+//   dropped) with the same offset and scale semantics as
+//   gdk_pixbuf_scale(): destination pixel (x, y) samples source
+//   coordinate ((x - xOff) / scale, (y - yOff) / scale).
+void			ScaleCropRGB(	unsigned char const* src, int srcWidth, int srcHeight, int srcStride, int srcChannels,
+								unsigned char* dest, int destWidth, int destHeight, int destStride,
+								double xOff, double yOff, double scale, ScaleKernel kernel
+							)
+{
+	ScaleJob job =
+	{
+		.src = src,
+		.srcStride = srcStride,
+		.srcChannels = srcChannels,
+		.dest = dest,
+		.destWidth = destWidth,
+		.destStride = destStride,
+		.simd = (kernel == kScaleKernelSIMD),
+	};
+
+	scaleFilterInit(&job.horizontal, destWidth, srcWidth, xOff, scale);
+	scaleFilterInit(&job.vertical, destHeight, srcHeight, yOff, scale);
+
+	int bands = (gScale.pool != 0)? MIN((int)gScale.options.threads, destHeight) : 1;
+
+	if(bands <= 1)
+	{
+		ScaleBand band = { .job = &job, .y0 = 0, .y1 = destHeight };
+		scaleBand(&band);
+	}
+	else
+	{
+		ScaleBand* band = (ScaleBand*)malloc(sizeof(ScaleBand) * bands);
+		ScaleBatch batch;
+		int i;
+
+		g_mutex_init(&batch.mutex);
+		g_cond_init(&batch.bandDone);
+		batch.bandsRemaining = bands;
+
+		for(i = 0; i < bands; i++)
+		{
+			band[i].job = &job;
+			band[i].y0 = (destHeight * i) / bands;
+			band[i].y1 = (destHeight * (i + 1)) / bands;
+			band[i].batch = &batch;
+			g_thread_pool_push(gScale.pool, &band[i], 0);
+		}
+
+		g_mutex_lock(&batch.mutex);
+		while(batch.bandsRemaining > 0)
+			g_cond_wait(&batch.bandDone, &batch.mutex);
+		g_mutex_unlock(&batch.mutex);
+
+		g_mutex_clear(&batch.mutex);
+		g_cond_clear(&batch.bandDone);
+		free(band);
+	}
+
+	scaleFilterFree(&job.horizontal);
+	scaleFilterFree(&job.vertical);
+}
+
+// gdk_pixbuf_scale() equivalent for the whole of 'dest', using the configured kernel
+void			ScalePixbuf(GdkPixbuf const* src, GdkPixbuf* dest, double xOff, double yOff, double scale)
+{
+	DebugPrintf("+ScalePixbuf kernel=%i\n", gScale.options.kernel);
+	if((gScale.options.kernel == kScaleKernelGdk) || (gdk_pixbuf_get_bits_per_sample(src) != 8) || (gdk_pixbuf_get_n_channels(dest) != 3))
+	{
+		gdk_pixbuf_scale(	src, dest,
+							0, 0, gdk_pixbuf_get_width(dest), gdk_pixbuf_get_height(dest),
+							xOff, yOff, scale, scale,
+							GDK_INTERP_BILINEAR
+						);
+	}
+	else
+	{
+		ScaleCropRGB(	gdk_pixbuf_read_pixels(src), gdk_pixbuf_get_width(src), gdk_pixbuf_get_height(src), gdk_pixbuf_get_rowstride(src), gdk_pixbuf_get_n_channels(src),
+						gdk_pixbuf_get_pixels(dest), gdk_pixbuf_get_width(dest), gdk_pixbuf_get_height(dest), gdk_pixbuf_get_rowstride(dest),
+						xOff, yOff, scale, gScale.options.kernel
+					);
+	}
+	DebugPrintf("-ScalePixbuf\n");
+}
+
+
+
+////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////
+//
+// Transition subsystem: composites the frame on screen and the
+//   next frame into one screen-sized buffer for each step of a
+//   crossfade or slide.  Steps are driven by the frame clock
+//   and their progress comes from the frame time, so a slow
+//   frame makes the transition skip ahead, never slow down.
+//
+// The crossfade uses an 8.8 fixed-point blend with NEON and
+//   SSE2 versions that match the scalar code exactly.
+//
+////////////////////////////////////////////////////////////////
+
+typedef enum Transition
+{
+	kTransitionNone = 0,	// instant swap
+	kTransitionFade,		// crossfade
+	kTransitionSlide,		// the new frame pushes the old one out to the left
+
+} Transition;
+
+#define kDefaultTransitionMS (1000)
+
+// out = ((256 - weight) * a + weight * b + 128) / 256, for weight in [0, 256]
+static void		transitionBlendScalar(unsigned char const* a, unsigned char const* b, unsigned char* out, size_t start, size_t length, unsigned int weight)
+{
+	size_t i;
+	for(i = start; i < length; i++)
+		out[i] = (unsigned char)(((a[i] * (256 - weight)) + (b[i] * weight) + 128) >> 8);
+}
+
+void			TransitionBlend(unsigned char const* a, unsigned char const* b, unsigned char* out, size_t length, unsigned int weight)
+{
+	size_t i = 0;
+
+#if defined(PIFRAME_SCALE_NEON)
+	uint16x8_t const	round = vdupq_n_u16(128);
+	uint16_t const		wa = (uint16_t)(256 - weight), wb = (uint16_t)weight;
+
+	for(; i + 16 <= length; i += 16)
+	{
+		uint8x16_t	pa = vld1q_u8(a + i),
+					pb = vld1q_u8(b + i);
+		uint16x8_t	lo = vmlaq_n_u16(vmlaq_n_u16(round, vmovl_u8(vget_low_u8(pa)), wa), vmovl_u8(vget_low_u8(pb)), wb),
+					hi = vmlaq_n_u16(vmlaq_n_u16(round, vmovl_u8(vget_high_u8(pa)), wa), vmovl_u8(vget_high_u8(pb)), wb);
+
+		vst1q_u8(out + i, vcombine_u8(vshrn_n_u16(lo, 8), vshrn_n_u16(hi, 8)));
+	}
+#elif defined(PIFRAME_SCALE_SSE2)
+	// (the sums fit in 16 unsigned bits, so the signed multiplies' low halves are exact)
+	__m128i const	zero = _mm_setzero_si128(),
+					round = _mm_set1_epi16(128),
+					wa = _mm_set1_epi16((short)(256 - weight)),
+					wb = _mm_set1_epi16((short)weight);
+
+	for(; i + 16 <= length; i += 16)
+	{
+		__m128i	pa = _mm_loadu_si128((__m128i const*)(a + i)),
+				pb = _mm_loadu_si128((__m128i const*)(b + i)),
+				lo = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(pa, zero), wa), _mm_mullo_epi16(_mm_unpacklo_epi8(pb, zero), wb)), round),
+				hi = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(pa, zero), wa), _mm_mullo_epi16(_mm_unpackhi_epi8(pb, zero), wb)), round);
+
+		_mm_storeu_si128((__m128i*)(out + i), _mm_packus_epi16(_mm_srli_epi16(lo, 8), _mm_srli_epi16(hi, 8)));
+	}
+#endif
+
+	transitionBlendScalar(a, b, out, i, length, weight);
+}
+
+// Composites one step of 'transition' from 'from' to 'to' into 'out'
+//   (all 8-bit RGB of the same size) at 'progress' in [0, 1].
+void			TransitionCompose(Transition transition, GdkPixbuf const* from, GdkPixbuf const* to, GdkPixbuf* out, double progress)
+{
+	int		width = gdk_pixbuf_get_width(out),
+			height = gdk_pixbuf_get_height(out),
+			stride = gdk_pixbuf_get_rowstride(out),
+			y;
+
+	unsigned char const*	a = gdk_pixbuf_read_pixels(from);
+	unsigned char const*	b = gdk_pixbuf_read_pixels(to);
+	unsigned char*			o = gdk_pixbuf_get_pixels(out);
+
+	if(transition == kTransitionSlide)
+	{
+		int shift = CLAMP((int)((progress * (double)width) + 0.5), 0, width);
+		for(y = 0; y < height; y++)
+		{
+			size_t row = (size_t)y * stride;
+			memcpy(o + row, a + row + (shift * 3), (size_t)(width - shift) * 3);
+			memcpy(o + row + ((width - shift) * 3), b + row, (size_t)shift * 3);
+		}
+	}
+	else
+	{
+		// one pass over the whole image, row padding included
+		size_t length = ((size_t)(height - 1) * stride) + ((size_t)width * 3);
+		TransitionBlend(a, b, o, length, (unsigned int)CLAMP((int)((progress * 256.0) + 0.5), 0, 256));
+	}
+}
+
+
+
+////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////
+//
+// FrameCache subsystem: keeps finished, screen-sized RGB frames
+//   keyed by the content hash of the photo they came from (see
+//   the Download disk cache) and the screen geometry, so that a
+//   photo shown before costs one copy instead of a decode and a
+//   resample.
+//
+// Frames are kept either in memory or as raw files that are
+//   memory-mapped when used.  Either way the total is capped and
+//   the least recently used frames go first.  All functions are
+//   thread-safe.
+//
+////////////////////////////////////////////////////////////////
+
+typedef struct FrameCacheOptions
+{
+	size_t			capacity;	// in bytes; 0 disables the cache
+	char const*		directory;	// keep frames as files here (created if needed), 0 to keep them in memory
+
+} FrameCacheOptions;
+
+typedef struct FrameCacheEntry
+{
+	char*			key;		// "<hash>-<width>x<height>"
+	size_t			size;		// width * height * 3 (packed rows)
+	unsigned char*	pixels;		// in memory only, 0 for files
+	time_t			modified;	// (files found at startup, for their order)
+
+} FrameCacheEntry;
+
+static struct
+{
+	GMutex			lock;
+	size_t			capacity;
+	size_t			size;
+	char*			directory;
+	GList*			entries;	// FrameCacheEntry instances, most recently used first
+
+} gFrameCache;
+
+static char*	frameCacheKey(char const* hash, int width, int height)
+{
+	return(g_strdup_printf("%s-%ix%i", hash, width, height));
+}
+
+static char*	frameCachePath(char const* key)
+{
+	char* name = g_strconcat(key, ".rgb", NULL);
+	char* path = g_build_filename(gFrameCache.directory, name, NULL);
+	g_free(name);
+	return(path);
+}
+
+// (lock held)
+static GList*	frameCacheFind(char const* key)
+{
+	GList* link;
+	for(link = gFrameCache.entries; link != 0; link = link->next)
+		if(!strcmp(((FrameCacheEntry*)link->data)->key, key))
+			return(link);
+	return(0);
+}
+
+// (lock held)
+static void		frameCacheRemove(GList* link)
+{
+	FrameCacheEntry* entry = (FrameCacheEntry*)link->data;
+	DebugPrintf("*frameCacheRemove %s\n", entry->key);
+
+	gFrameCache.entries = g_list_delete_link(gFrameCache.entries, link);
+	gFrameCache.size -= entry->size;
+
+	if(entry->pixels != 0)
+		free(entry->pixels);
+	else
+	{
+		char* path = frameCachePath(entry->key);
+		remove(path);
+		g_free(path);
+	}
+	g_free(entry->key);
+	g_free(entry);
+}
+
+static gint		frameCacheCompareAge(gconstpointer a, gconstpointer b)
+{
+	time_t modifiedA = ((FrameCacheEntry const*)a)->modified, modifiedB = ((FrameCacheEntry const*)b)->modified;
+	return((modifiedA < modifiedB) - (modifiedA > modifiedB));	// (newest first)
+}
+
+void			FrameCacheInit(FrameCacheOptions const* options)
+{
+	DebugPrintf("+FrameCacheInit\n");
+	g_mutex_init(&gFrameCache.lock);
+	gFrameCache.capacity = options->capacity;
+	gFrameCache.size = 0;
+	gFrameCache.directory = 0;
+	gFrameCache.entries = 0;
+
+	if((options->capacity == 0) || (options->directory == 0))
+	{
+		DebugPrintf("-FrameCacheInit memory\n");
+		return;
+	}
+
+	if(g_mkdir_with_parents(options->directory, 0700) != 0)
+	{
+		g_warning("Can't create the frame cache directory \"%s\", frames are kept in memory", options->directory);
+		return;
+	}
+	gFrameCache.directory = g_strdup(options->directory);
+
+	// pick up the frames from previous runs, oldest evicted first
+	GDir* directory = g_dir_open(gFrameCache.directory, 0, 0);
+	if(directory != 0)
+	{
+		char const* name;
+		while((name = g_dir_read_name(directory)) != 0)
+		{
+			char* path = g_build_filename(gFrameCache.directory, name, NULL);
+			struct stat info;
+
+			if(g_str_has_suffix(name, ".rgb") && (stat(path, &info) == 0) && S_ISREG(info.st_mode))
+			{
+				FrameCacheEntry* entry = g_new(FrameCacheEntry, 1);
+				entry->key = g_strndup(name, strlen(name) - 4);
+				entry->size = (size_t)info.st_size;
+				entry->pixels = 0;
+				entry->modified = info.st_mtime;
+
+				gFrameCache.entries = g_list_prepend(gFrameCache.entries, entry);
+				gFrameCache.size += entry->size;
+			}
+			else if(g_str_has_suffix(name, ".part"))
+				remove(path);	// (a store cut short)
+			g_free(path);
+		}
+		g_dir_close(directory);
+	}
+
+	gFrameCache.entries = g_list_sort(gFrameCache.entries, &frameCacheCompareAge);
+
+	while((gFrameCache.size > gFrameCache.capacity) && (gFrameCache.entries != 0))
+		frameCacheRemove(g_list_last(gFrameCache.entries));
+
+	DebugPrintf("-FrameCacheInit %u frames, %lu bytes\n", g_list_length(gFrameCache.entries), (unsigned long)gFrameCache.size);
+}
+
+// Caps the cache at 'capacity' bytes from now on, evicting the least
+//   recently used frames to fit (0 empties it.)  A cache that started
+//   with no capacity keeps its frames in memory.
+void			FrameCacheSetCapacity(size_t capacity)
+{
+	g_mutex_lock(&gFrameCache.lock);
+	gFrameCache.capacity = capacity;
+	while((gFrameCache.size > gFrameCache.capacity) && (gFrameCache.entries != 0))
+		frameCacheRemove(g_list_last(gFrameCache.entries));
+	g_mutex_unlock(&gFrameCache.lock);
+	DebugPrintf("*FrameCacheSetCapacity %lu bytes\n", (unsigned long)capacity);
+}
+
+void			FrameCacheGetStats(unsigned int* outEntries, size_t* outSize, size_t* outCapacity)
+{
+	g_mutex_lock(&gFrameCache.lock);
+	*outEntries = g_list_length(gFrameCache.entries);
+	*outSize = gFrameCache.size;
+	*outCapacity = gFrameCache.capacity;
+	g_mutex_unlock(&gFrameCache.lock);
+}
+
+gboolean		FrameCacheHas(char const* hash, int width, int height)
+{
+	if(gFrameCache.capacity == 0)
+		return(FALSE);
+
+	char* key = frameCacheKey(hash, width, height);
+	g_mutex_lock(&gFrameCache.lock);
+	gboolean found = (frameCacheFind(key) != 0);
+	g_mutex_unlock(&gFrameCache.lock);
+	g_free(key);
+	return(found);
+}
+
+// Copies the frame for 'hash' at dest's size into 'dest' (RGB, no alpha).
+//   Returns FALSE if there's no such frame (any more.)
+gboolean		FrameCacheFetch(char const* hash, GdkPixbuf* dest)
+{
+	if(gFrameCache.capacity == 0)
+		return(FALSE);
+
+	int		width = gdk_pixbuf_get_width(dest),
+			height = gdk_pixbuf_get_height(dest),
+			stride = gdk_pixbuf_get_rowstride(dest),
+			y;
+	size_t	rowLength = (size_t)width * 3;
+
+	unsigned char* out = gdk_pixbuf_get_pixels(dest);
+	char* key = frameCacheKey(hash, width, height);
+	gboolean ok = FALSE;
+
+	g_mutex_lock(&gFrameCache.lock);
+	GList* link = frameCacheFind(key);
+	if(link != 0)
+	{
+		FrameCacheEntry* entry = (FrameCacheEntry*)link->data;
+		unsigned char const* pixels = entry->pixels;
+		void* mapping = MAP_FAILED;
+
+		if(pixels == 0)
+		{
+			char* path = frameCachePath(key);
+			int fd = open(path, O_RDONLY);
+			g_free(path);
+			if(fd >= 0)
+			{
+				mapping = mmap(0, entry->size, PROT_READ, MAP_PRIVATE, fd, 0);
+				close(fd);	// (the mapping stays)
+			}
+			if(mapping != MAP_FAILED)
+			{
+				madvise(mapping, entry->size, MADV_SEQUENTIAL);
+				pixels = (unsigned char const*)mapping;
+			}
+		}
+
+		if((pixels != 0) && (gdk_pixbuf_get_n_channels(dest) == 3) && (entry->size == rowLength * height))
+		{
+			for(y = 0; y < height; y++)
+				memcpy(out + (size_t)y * stride, pixels + (size_t)y * rowLength, rowLength);
+
+			gFrameCache.entries = g_list_remove_link(gFrameCache.entries, link);
+			gFrameCache.entries = g_list_concat(link, gFrameCache.entries);
+			ok = TRUE;
+		}
+
+		if(mapping != MAP_FAILED)
+			munmap(mapping, entry->size);
+		if(!ok)
+			frameCacheRemove(link);	// (unreadable)
+	}
+	g_mutex_unlock(&gFrameCache.lock);
+
+	DebugPrintf("*FrameCacheFetch %s %s\n", key, ok? "hit" : "miss");
+	g_free(key);
+	return(ok);
+}
+
+// Keeps a copy of 'frame' (RGB, no alpha) for the photo with content 'hash'.
+//   The copy is made without holding the lock, so lookups from other
+//   threads don't wait for it.
+void			FrameCacheStore(char const* hash, GdkPixbuf const* frame)
+{
+	int		width = gdk_pixbuf_get_width(frame),
+			height = gdk_pixbuf_get_height(frame),
+			stride = gdk_pixbuf_get_rowstride(frame),
+			y;
+	size_t	rowLength = (size_t)width * 3,
+			size = rowLength * height;
+
+	if((gFrameCache.capacity < size) || (gdk_pixbuf_get_n_channels(frame) != 3) || FrameCacheHas(hash, width, height))
+		return;
+
+	unsigned char const* pixels = gdk_pixbuf_read_pixels(frame);
+
+	FrameCacheEntry* entry = g_new(FrameCacheEntry, 1);
+	entry->key = frameCacheKey(hash, width, height);
+	entry->size = size;
+	entry->pixels = 0;
+	entry->modified = 0;
+
+	if(gFrameCache.directory == 0)
+	{
+		entry->pixels = (unsigned char*)malloc(size);
+		for(y = 0; y < height; y++)
+			memcpy(entry->pixels + (size_t)y * rowLength, pixels + (size_t)y * stride, rowLength);
+	}
+	else
+	{
+		// written aside and renamed, so a frame file is always complete
+		char* path = frameCachePath(entry->key);
+		char* partPath = g_strconcat(path, ".part", NULL);
+		FILE* file = fopen(partPath, "wb");
+		int written = (file != 0);
+
+		for(y = 0; written && (y < height); y++)
+			written = (fwrite(pixels + (size_t)y * stride, 1, rowLength, file) == rowLength);
+		if(file != 0)
+			written = (fclose(file) == 0) && written;
+		written = written && (rename(partPath, path) == 0);
+		if(!written)
+			remove(partPath);
+
+		g_free(partPath);
+		g_free(path);
+
+		if(!written)
+		{
+			DebugPrintf("*FrameCacheStore can't write %s\n", entry->key);
+			g_free(entry->key);
+			g_free(entry);
+			return;
+		}
+	}
+
+	g_mutex_lock(&gFrameCache.lock);
+	int stored = (frameCacheFind(entry->key) != 0);	// meanwhile by another thread (a file would have the same contents)
+	if(stored || (gFrameCache.capacity < size))	// (or the capacity shrank meanwhile)
+	{
+		g_mutex_unlock(&gFrameCache.lock);
+		DebugPrintf("*FrameCacheStore %s %s\n", entry->key, stored? "stored meanwhile" : "over capacity");
+		if(!stored && (entry->pixels == 0))	// (its file was written)
+		{
+			char* path = frameCachePath(entry->key);
+			remove(path);
+			g_free(path);
+		}
+		if(entry->pixels != 0)
+			free(entry->pixels);
+		g_free(entry->key);
+		g_free(entry);
+		return;
+	}
+
+	gFrameCache.entries = g_list_prepend(gFrameCache.entries, entry);
+	gFrameCache.size += size;
+	DebugPrintf("*FrameCacheStore %s, %lu bytes cached\n", entry->key, (unsigned long)gFrameCache.size);
+	while(gFrameCache.size > gFrameCache.capacity)	// (never 'entry': it fits by itself)
+		frameCacheRemove(g_list_last(gFrameCache.entries));
+	g_mutex_unlock(&gFrameCache.lock);
+}
+
+
+////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////
+//
+// GL renderer (optional, build with -DPIFRAME_GL and epoxy):
+//   instead of two stacked GtkImage widgets, a single GtkGLArea
+//   shows each photo as a texture.  The fill-and-crop is done
+//   by the GPU with texture coordinates, so the CPU never
+//   scales or blits screen-sized buffers, and new frames are
+//   shown on the next frame-clock cycle (vsync) after upload.
+//   Transitions are done in the fragment shader between the
+//   previous and the current texture.
+//
+// On the Raspberry Pi this runs on the VideoCore through Mesa's
+//   EGL/GLES driver (set GDK_GL=gles if GTK+ doesn't pick GLES
+//   on its own.)
+//
+////////////////////////////////////////////////////////////////
+
+#if defined(PIFRAME_GL)
+
+#include <epoxy/gl.h>
+
+typedef struct GLRenderer
+{
+	GtkWidget*	area;
+
+	GLuint		program;
+	GLuint		vertexArray;	// (desktop GL and GLES 3 only)
+	GLuint		vertexBuffer;
+	GLuint		texture;
+	GLuint		previousTexture;	// what 'texture' held before the last upload
+	GLint		imageCropLocation;
+	GLint		previousCropLocation;
+	GLint		progressLocation;
+	GLint		slideLocation;
+	GLint		maxTextureSize;
+
+	int			textureWidth;	// size of the image in 'texture', 0 when empty
+	int			textureHeight;
+	int			previousWidth;	// size of the image in 'previousTexture', 0 when empty
+	int			previousHeight;
+
+	GdkPixbuf*	pending;		// uploaded at the next render (owned)
+
+	Transition	transition;
+	unsigned	int	transitionMS;
+	double		progress;		// of the transition from previousTexture to texture, 1 when idle
+	gint64		transitionStart;	// frame time of the transition's first frame, 0 until then
+	guint		transitionTick;	// tick callback driving the transition, 0 when idle
+
+} GLRenderer;
+
+// 'base' is the screen position in [0, 1] (top left origin); each
+//   texture's crop (xy scale, zw offset) maps it to fill and crop.
+//   The slide puts the new image in [1 - progress, 1] and what's
+//   left of the previous one in [0, 1 - progress].
+#define PIFRAME_GL_FRAGMENT_BODY(texture2D, OUT)																\
+	"void main() {\n"																							\
+	"	if((slide > 0.5) && (base.x < (1.0 - progress)))\n"														\
+	"		" OUT " = " texture2D "(previous, vec2(base.x + progress, base.y) * previousCrop.xy + previousCrop.zw);\n"	\
+	"	else if(slide > 0.5)\n"																					\
+	"		" OUT " = " texture2D "(image, vec2(base.x - (1.0 - progress), base.y) * imageCrop.xy + imageCrop.zw);\n"	\
+	"	else\n"																									\
+	"		" OUT " = mix(" texture2D "(previous, base * previousCrop.xy + previousCrop.zw), " texture2D "(image, base * imageCrop.xy + imageCrop.zw), progress);\n"	\
+	"}\n"
+
+#define PIFRAME_GL_FRAGMENT_UNIFORMS	\
+	"uniform sampler2D image;\n"		\
+	"uniform sampler2D previous;\n"		\
+	"uniform vec4 imageCrop;\n"			\
+	"uniform vec4 previousCrop;\n"		\
+	"uniform float progress;\n"			\
+	"uniform float slide;\n"
+
+static char const* const	kGLVertexShaderDesktop =
+	"#version 150\n"
+	"in vec2 position;\n"
+	"out vec2 base;\n"
+	"void main() {\n"
+	"	gl_Position = vec4(position, 0.0, 1.0);\n"
+	"	base = position * vec2(0.5, -0.5) + 0.5;\n"
+	"}\n";
+
+static char const* const	kGLFragmentShaderDesktop =
+	"#version 150\n"
+	"in vec2 base;\n"
+	"out vec4 color;\n"
+	PIFRAME_GL_FRAGMENT_UNIFORMS
+	PIFRAME_GL_FRAGMENT_BODY("texture", "color");
+
+static char const* const	kGLVertexShaderES =
+	"#version 100\n"
+	"attribute vec2 position;\n"
+	"varying vec2 base;\n"
+	"void main() {\n"
+	"	gl_Position = vec4(position, 0.0, 1.0);\n"
+	"	base = position * vec2(0.5, -0.5) + 0.5;\n"
+	"}\n";
+
+static char const* const	kGLFragmentShaderES =
+	"#version 100\n"
+	"precision mediump float;\n"
+	"varying vec2 base;\n"
+	PIFRAME_GL_FRAGMENT_UNIFORMS
+	PIFRAME_GL_FRAGMENT_BODY("texture2D", "gl_FragColor");
+
+static GLuint	glRendererCompile(GLenum type, char const* source)
+{
+	GLuint shader = glCreateShader(type);
+	glShaderSource(shader, 1, &source, 0);
+	glCompileShader(shader);
+
+	GLint ok = GL_FALSE;
+	glGetShaderiv(shader, GL_COMPILE_STATUS, &ok);
+	if(!ok)
+	{
+		char log[512];
+		glGetShaderInfoLog(shader, sizeof(log), 0, log);
+		g_warning("GL shader compile failed: %s", log);
+		glDeleteShader(shader);
+		return(0);
+	}
+	return(shader);
+}
+
+static void		onGLRendererRealize(GtkWidget* widget, gpointer user)
+{
+	DebugPrintf("+onGLRendererRealize\n");
+	GLRenderer* renderer = (GLRenderer*)user;
+
+	gtk_gl_area_make_current(GTK_GL_AREA(widget));
+	if(gtk_gl_area_get_error(GTK_GL_AREA(widget)) != 0)
+	{
+		g_warning("Can't create a GL context for the display");
+		return;
+	}
+
+	int desktop = epoxy_is_desktop_gl(),
+		vertexArrays = desktop || (epoxy_gl_version() >= 30);
+
+	GLuint	vertexShader = glRendererCompile(GL_VERTEX_SHADER, desktop? kGLVertexShaderDesktop : kGLVertexShaderES),
+			fragmentShader = glRendererCompile(GL_FRAGMENT_SHADER, desktop? kGLFragmentShaderDesktop : kGLFragmentShaderES);
+
+	renderer->program = glCreateProgram();
+	glAttachShader(renderer->program, vertexShader);
+	glAttachShader(renderer->program, fragmentShader);
+	glBindAttribLocation(renderer->program, 0, "position");
+	glLinkProgram(renderer->program);
+	glDeleteShader(vertexShader);
+	glDeleteShader(fragmentShader);
+
+	renderer->imageCropLocation = glGetUniformLocation(renderer->program, "imageCrop");
+	renderer->previousCropLocation = glGetUniformLocation(renderer->program, "previousCrop");
+	renderer->progressLocation = glGetUniformLocation(renderer->program, "progress");
+	renderer->slideLocation = glGetUniformLocation(renderer->program, "slide");
+
+	glUseProgram(renderer->program);
+	glUniform1i(glGetUniformLocation(renderer->program, "image"), 0);	// (texture units)
+	glUniform1i(glGetUniformLocation(renderer->program, "previous"), 1);
+
+	// one full-screen quad
+	static GLfloat const quad[] = { -1.0f, -1.0f,  1.0f, -1.0f,  -1.0f, 1.0f,  1.0f, 1.0f };
+
+	renderer->vertexArray = 0;
+	if(vertexArrays)
+	{
+		glGenVertexArrays(1, &renderer->vertexArray);
+		glBindVertexArray(renderer->vertexArray);
+	}
+	glGenBuffers(1, &renderer->vertexBuffer);
+	glBindBuffer(GL_ARRAY_BUFFER, renderer->vertexBuffer);
+	glBufferData(GL_ARRAY_BUFFER, sizeof(quad), quad, GL_STATIC_DRAW);
+
+	GLuint textures[2];
+	int i;
+	glGenTextures(2, textures);
+	for(i = 0; i < 2; i++)
+	{
+		glBindTexture(GL_TEXTURE_2D, textures[i]);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	}
+	renderer->texture = textures[0];
+	renderer->previousTexture = textures[1];
+
+	glGetIntegerv(GL_MAX_TEXTURE_SIZE, &renderer->maxTextureSize);
+	DebugPrintf("-onGLRendererRealize max texture %i\n", renderer->maxTextureSize);
+}
+
+static void		onGLRendererUnrealize(GtkWidget* widget, gpointer user)
+{
+	GLRenderer* renderer = (GLRenderer*)user;
+
+	gtk_gl_area_make_current(GTK_GL_AREA(widget));
+	glDeleteTextures(1, &renderer->texture);
+	glDeleteTextures(1, &renderer->previousTexture);
+	glDeleteBuffers(1, &renderer->vertexBuffer);
+	if(renderer->vertexArray != 0)
+		glDeleteVertexArrays(1, &renderer->vertexArray);
+	glDeleteProgram(renderer->program);
+	renderer->textureWidth = renderer->textureHeight = 0;
+	renderer->previousWidth = renderer->previousHeight = 0;
+}
+
+static gboolean	onGLRendererTransitionTick(GtkWidget* widget, GdkFrameClock* clock, gpointer user)
+{
+	GLRenderer* renderer = (GLRenderer*)user;
+	gint64 now = gdk_frame_clock_get_frame_time(clock);
+
+	if(renderer->transitionStart == 0)
+		renderer->transitionStart = now;
+
+	renderer->progress = MIN((double)(now - renderer->transitionStart) / (1000.0 * (double)renderer->transitionMS), 1.0);
+	gtk_gl_area_queue_render(GTK_GL_AREA(widget));
+
+	if(renderer->progress >= 1.0)
+	{
+		renderer->transitionTick = 0;
+		return(G_SOURCE_REMOVE);
+	}
+	return(G_SOURCE_CONTINUE);
+}
+
+// uploads the pending image (gdk-pixbuf rows are 4-byte aligned, as GL unpacks by default)
+static void		glRendererUpload(GLRenderer* renderer)
+{
+	GdkPixbuf* pixels = renderer->pending;
+	renderer->pending = 0;
+
+	int width = gdk_pixbuf_get_width(pixels),
+		height = gdk_pixbuf_get_height(pixels);
+
+	if((width > renderer->maxTextureSize) || (height > renderer->maxTextureSize))
+	{
+		// too big for the GPU (2048 on VideoCore IV): reduce on the CPU first
+		double scale = (double)renderer->maxTextureSize / (double)MAX(width, height);
+		GdkPixbuf* reduced = gdk_pixbuf_new(GDK_COLORSPACE_RGB, FALSE, 8, MAX((int)(width * scale), 1), MAX((int)(height * scale), 1));
+		ScalePixbuf(pixels, reduced, 0.0, 0.0, scale);
+		g_object_unref(pixels);
+		pixels = reduced;
+		width = gdk_pixbuf_get_width(pixels);
+		height = gdk_pixbuf_get_height(pixels);
+	}
+
+	GLenum format = gdk_pixbuf_get_has_alpha(pixels)? GL_RGBA : GL_RGB;
+
+	// what's on screen now becomes the transition's starting point
+	GLuint temp = renderer->previousTexture;
+	renderer->previousTexture = renderer->texture;
+	renderer->texture = temp;
+	renderer->previousWidth = renderer->textureWidth;
+	renderer->previousHeight = renderer->textureHeight;
+
+	glBindTexture(GL_TEXTURE_2D, renderer->texture);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+	glTexImage2D(GL_TEXTURE_2D, 0, format, width, height, 0, format, GL_UNSIGNED_BYTE, gdk_pixbuf_read_pixels(pixels));
+
+	renderer->textureWidth = width;
+	renderer->textureHeight = height;
+	g_object_unref(pixels);
+
+	renderer->progress = 1.0;
+	if((renderer->transition != kTransitionNone) && (renderer->previousWidth != 0))
+	{
+		renderer->progress = 0.0;
+		renderer->transitionStart = 0;
+		if(renderer->transitionTick == 0)
+			renderer->transitionTick = gtk_widget_add_tick_callback(renderer->area, &onGLRendererTransitionTick, (gpointer)renderer, 0);
+	}
+}
+
+// fill and crop: the centred part of a width x height texture with the screen's aspect
+static void		glRendererSetCrop(GLint location, int width, int height, double screenAspect)
+{
+	double	imageAspect = (double)width / (double)MAX(height, 1);
+	GLfloat	scaleU = 1.0f, scaleV = 1.0f;
+
+	if(imageAspect > screenAspect)
+		scaleU = (GLfloat)(screenAspect / imageAspect);
+	else
+		scaleV = (GLfloat)(imageAspect / screenAspect);
+
+	glUniform4f(location, scaleU, scaleV, (1.0f - scaleU) / 2.0f, (1.0f - scaleV) / 2.0f);
+}
+
+static gboolean	onGLRendererRender(GtkGLArea* area, GdkGLContext* context, gpointer user)
+{
+	(void)context;
+	GLRenderer* renderer = (GLRenderer*)user;
+
+	if(renderer->pending != 0)
+		glRendererUpload(renderer);
+
+	glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+	glClear(GL_COLOR_BUFFER_BIT);
+
+	if(renderer->textureWidth == 0)
+		return(TRUE);
+
+	double	screenAspect = (double)gtk_widget_get_allocated_width(GTK_WIDGET(area)) / (double)MAX(gtk_widget_get_allocated_height(GTK_WIDGET(area)), 1);
+	int		transitioning = (renderer->progress < 1.0);
+
+	glUseProgram(renderer->program);
+	glRendererSetCrop(renderer->imageCropLocation, renderer->textureWidth, renderer->textureHeight, screenAspect);
+	glRendererSetCrop(renderer->previousCropLocation, transitioning? renderer->previousWidth : renderer->textureWidth, transitioning? renderer->previousHeight : renderer->textureHeight, screenAspect);
+	glUniform1f(renderer->progressLocation, (GLfloat)renderer->progress);
+	glUniform1f(renderer->slideLocation, (transitioning && (renderer->transition == kTransitionSlide))? 1.0f : 0.0f);
+
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_2D, renderer->texture);
+	glActiveTexture(GL_TEXTURE1);
+	glBindTexture(GL_TEXTURE_2D, transitioning? renderer->previousTexture : renderer->texture);
+	glActiveTexture(GL_TEXTURE0);
+
+	if(renderer->vertexArray != 0)
+		glBindVertexArray(renderer->vertexArray);
+	glBindBuffer(GL_ARRAY_BUFFER, renderer->vertexBuffer);
+	glEnableVertexAttribArray(0);
+	glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, 0);
+
+	glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+	return(TRUE);
+}
+
+GLRenderer*		GLRendererNew(Transition transition, unsigned int transitionMS)
+{
+	DebugPrintf("+GLRendererNew\n");
+	GLRenderer* renderer = (GLRenderer*)malloc(sizeof(GLRenderer));
+	DebugPrintf("malloc(GLRenderer) %p\n", renderer);
+
+	renderer->area = gtk_gl_area_new();
+	renderer->vertexArray = 0;
+	renderer->maxTextureSize = 2048;	// (until realized)
+	renderer->textureWidth = renderer->textureHeight = 0;
+	renderer->previousWidth = renderer->previousHeight = 0;
+	renderer->pending = 0;
+
+	renderer->transition = (transitionMS > 0)? transition : kTransitionNone;
+	renderer->transitionMS = transitionMS;
+	renderer->progress = 1.0;
+	renderer->transitionStart = 0;
+	renderer->transitionTick = 0;
+
+	g_signal_connect(renderer->area, "realize", G_CALLBACK(&onGLRendererRealize), (gpointer)renderer);
+	g_signal_connect(renderer->area, "unrealize", G_CALLBACK(&onGLRendererUnrealize), (gpointer)renderer);
+	g_signal_connect(renderer->area, "render", G_CALLBACK(&onGLRendererRender), (gpointer)renderer);
+
+	DebugPrintf("-GLRendererNew\n");
+	return(renderer);
+}
+
+// Shows 'pixels' (unscaled; a reference is taken) from the next frame on.
+//   Only the most recent image is kept if several arrive within a frame.
+void			GLRendererShow(GLRenderer* renderer, GdkPixbuf* pixels)
+{
+	if(renderer->pending != 0)
+		g_object_unref(renderer->pending);
+
+	renderer->pending = pixels;
+	g_object_ref(renderer->pending);
+
+	gtk_gl_area_queue_render(GTK_GL_AREA(renderer->area));
+}
+
+#endif	// PIFRAME_GL
+
+
+
+////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////
+//
+// PiFrame application: requests images from a HTTP server and
+//   scales them to fill the screen.  After each image is
+//   downloaded and displayed, the application makes the next
+//   request immediately.  Therefore, timing is controlled by
+//   the HTTP server, which can wait for some time with an open
+//   connection before sending the image data.  Crucially, this
+//   allows for simple, flexible central coordination of many
+//   PiFrame instances.
+//
+// The application uses two GtkImage widgets that each fill the
+//   screen - one behind and one in front.  The widget behind
+//   is filled with new image data when a download is complete,
+//   the two widgets are swapped in z-order then the cycle
+//   starts again.  With several outputs (monitors), each one has
+//   its own window, widgets and URL; downloads, decoding and the
+//   caches are shared between them.
+//
+// The screen-filling policy chosen crops part of the source
+//   image (if necessary) in order to ensure all screen pixels
+//   are filled.
+//
+////////////////////////////////////////////////////////////////
+
+
+// Screen geometry is cached for each output (a monitor, or the
+//   whole screen) and refreshed only when GDK reports a change,
+//   instead of being queried for every image.
+typedef struct ScreenGeometry
+{
+	int		monitor;	// GDK's monitor number, or kScreenWhole
+	int		x;			// where the output is on the screen
+	int		y;
+	int		width;
+	int		height;
+	int		scale;		// device pixels per screen pixel
+
+} ScreenGeometry;
+
+#define kScreenWhole (-1)	// every monitor together, as one output
+
+// (re)reads the geometry of 'geometry->monitor'; a monitor that's gone keeps what it had
+void			ScreenGeometryUpdate(ScreenGeometry* geometry)
+{
+	GdkScreen* screen = gdk_screen_get_default();
+	int monitor = geometry->monitor;
+
+	if(monitor == kScreenWhole)
+	{
+		geometry->x = 0;
+		geometry->y = 0;
+		geometry->width = gdk_screen_get_width(screen);
+		geometry->height = gdk_screen_get_height(screen);
+		monitor = gdk_screen_get_primary_monitor(screen);
+	}
+	else if(monitor < gdk_screen_get_n_monitors(screen))
+	{
+		GdkRectangle area;
+		gdk_screen_get_monitor_geometry(screen, monitor, &area);
+		geometry->x = area.x;
+		geometry->y = area.y;
+		geometry->width = area.width;
+		geometry->height = area.height;
+	}
+	else
+		return;
+
+	geometry->scale = MAX(gdk_screen_get_monitor_scale_factor(screen, monitor), 1);
+	DebugPrintf("*ScreenGeometryUpdate %i: %ix%i+%i+%i @%ix\n", geometry->monitor, geometry->width, geometry->height, geometry->x, geometry->y, geometry->scale);
+}
+
+// scales and crops 'pixels' to fill all of 'scaledPixels', in place
+void		scaleToFill(GdkPixbuf* pixels, GdkPixbuf* scaledPixels)
+{
+	DebugPrintf("+scaleToFill\n");
+	
+	// calculate scale and crop dimensions
+	int		screenWidth = gdk_pixbuf_get_width(scaledPixels),
+			screenHeight = gdk_pixbuf_get_height(scaledPixels);
+
+	double	scale, xOff, yOff,
+			pWidth = (double)gdk_pixbuf_get_width(pixels),
+			pHeight = (double)gdk_pixbuf_get_height(pixels),
+			pAspect = pWidth / pHeight;
+
+	if(pAspect < ((double)screenWidth / (double)screenHeight))
+	{
+		scale = (double)screenWidth / pWidth;
+		yOff = ((scale * pHeight) - (double)screenHeight) / -2.0;
+		xOff = 0.0;
+	}
+	else
+	{
+		scale = ((double)screenHeight / pHeight);
+		xOff = ((scale * pWidth) - (double)screenWidth) / -2.0;
+		yOff = 0.0;
+	}
+
+	ScalePixbuf(pixels, scaledPixels, xOff, yOff, scale);
+
+	DebugPrintf("-scaleToFill\n");
+}
+
+// reuses 'spare' if it's non-0 and still matches the output, otherwise allocates
+GdkPixbuf*	screenBufferNew(GdkPixbuf* spare, ScreenGeometry const* geometry)
+{
+	if(spare != 0)
+	{
+		if((gdk_pixbuf_get_width(spare) == geometry->width) && (gdk_pixbuf_get_height(spare) == geometry->height))
+			return(spare);
+
+		g_object_unref(spare);	// (stale geometry)
+	}
+
+	DebugPrintf("*screenBufferNew %ix%i\n", geometry->width, geometry->height);
+	GdkPixbuf* buffer = gdk_pixbuf_new(GDK_COLORSPACE_RGB, FALSE, 8, geometry->width, geometry->height);
+	MetricsTrackPixels(buffer);
+	return(buffer);
+}
+
+GdkPixbuf*	scaleToFillScreen(GdkPixbuf* pixels, ScreenGeometry const* geometry)
+{
+	GdkPixbuf* scaledPixels = screenBufferNew(0, geometry);
+	scaleToFill(pixels, scaledPixels);
+	return(scaledPixels);
+}
+
+
+// The startup screen is compiled into the binary, so starting doesn't
+//   depend on the working directory or on the SD card being quick.
+//   The assembler finds the file through its include path: build in
+//   its directory, or pass -Wa,-I<dir> (see README.md.)
+#if !defined(PIFRAME_STARTUP_JPEG)
+	#define PIFRAME_STARTUP_JPEG "startup.jpg"
+#endif
+
+__asm__(
+	"	.section .rodata\n"
+	"	.balign 16\n"
+	"gStartupJPEG:\n"
+	"	.incbin \"" PIFRAME_STARTUP_JPEG "\"\n"
+	"gStartupJPEGEnd:\n"
+	"	.previous\n"
+);
+
+extern unsigned char const	gStartupJPEG[];
+extern unsigned char const	gStartupJPEGEnd[];
+
+// decodes the startup screen at (about) the output's size; black if that fails
+GdkPixbuf*	startupPixelsNew(ScreenGeometry const* geometry)
+{
+	DebugPrintf("+startupPixelsNew\n");
+	ImageDecoder* decoder = ImageDecoderNew(geometry->width, geometry->height);
+
+	GdkPixbuf* pixels = 0;
+	if(ImageDecoderWrite(decoder, gStartupJPEG, (size_t)(gStartupJPEGEnd - gStartupJPEG), 0))
+		pixels = ImageDecoderClose(decoder, 0);
+	else
+		ImageDecoderAbort(decoder);
+
+	if(pixels == 0)
+	{
+		g_warning("Can't decode the startup screen");
+		pixels = gdk_pixbuf_new(GDK_COLORSPACE_RGB, FALSE, 8, geometry->width, geometry->height);
+		gdk_pixbuf_fill(pixels, 0x000000ff);
+	}
+
+	DebugPrintf("-startupPixelsNew\n");
+	return(pixels);
+}
+
+
+typedef struct AppOptions
+{
+	char const*		serviceURL;
+	char**			serviceURLs;	// from the command line, one per output (the last also serves any more)
+	int				serviceURLCount;
+	char const*		outputs;		// monitors to fill, "all" or "0,1,...", 0 for the whole screen as one
+	unsigned int	delayMS;
+	unsigned int	poolHighWater;	// progress item ceiling for the Download pool
+	int				streaming;		// decode from the libcurl write callback (zero-copy)
+
+	unsigned int	prefetchDepth;	// scaled frames to keep ready; 0 shows each image as it arrives
+	unsigned int	intervalMS;		// presentation interval when prefetching
+	int				push;			// the URL is a multipart stream of photos, not one photo per request
+	unsigned int	displayPollS;	// how often to check whether the display is powered (see Sleep), 0 for never
+	int				manifest;		// the URL is a playlist of photos and their timings (see Manifest)
+	int				preview;		// show each photo as it decodes (without prefetch, push or GL)
+
+	ScaleOptions	scale;
+
+	int				useGL;			// display through the GL renderer (PIFRAME_GL builds)
+	char const*		decodeDevice;	// V4L2 JPEG decoder (PIFRAME_V4L2 builds), 0 for software
+	double			maxMegapixels;	// ceiling on decoded photos; 0 for none
+	int				clientHints;	// send the screen size and decodable formats with each request
+	char const*		peers;			// LAN peers whose caches to use, "host[:port],..." (0 for none)
+	unsigned int	peerPort;		// serve the cache to peers on this port (0 for not)
+	char const*		peerAddress;	// ... on this local address only (0 for every interface)
+
+	Transition		transition;		// between consecutive photos
+	unsigned int	transitionMS;	// transition duration; 0 swaps immediately
+
+	char const*		cacheDirectory;	// disk cache for downloaded photos (0 for the user cache directory)
+	unsigned int	cacheMB;		// disk cache size cap; 0 disables the cache
+
+	unsigned int	frameCacheMB;	// cache of scaled frames (needs the disk cache); 0 disables it
+	int				frameCacheOnDisk;	// keep scaled frames as memory-mapped files rather than in memory
+
+	char const*		metricsPath;	// per-photo timings log ("-" for stdout), 0 for none
+	char const*		controlPath;	// UNIX socket for commands and stats (see Control), 0 for none
+
+	unsigned int	connectTimeoutMS;	// Download timeouts (see DownloadInitOptions), 0 for none
+	unsigned int	stallTimeoutMS;
+	unsigned int	totalTimeoutMS;
+
+} AppOptions;
+
+#define kDefaultPrefetchIntervalMS (10000)	// 10 seconds
+#define kRetryDelayMS (10000)	// 10 seconds
+#define kDefaultConnectTimeoutMS (10000)	// 10 seconds
+#define kDefaultStallTimeoutMS (30000)		// 30 seconds
+
+// a frame held for the instant the server asked for
+typedef struct NextImageTimedFrame
+{
+	GdkPixbuf*		pixels;			// the frame (owned)
+	gint64			presentTime;	// wall clock, as g_get_real_time()
+
+} NextImageTimedFrame;
+
+// why the pipeline is asleep (see Sleep)
+typedef enum NextImageSleepReason
+{
+	kNextImageSleepSignal = 1 << 0,		// SIGUSR1 (SIGUSR2 wakes it)
+	kNextImageSleepDisplayOff = 1 << 1,	// the display's power is off (options.displayPollS)
+	kNextImageSleepCommand = 1 << 2,	// "sleep" on the control socket ("wake" wakes it)
+
+} NextImageSleepReason;
+
+// a photo in the manifest's playlist
+typedef struct NextImageEntry
+{
+	char*			url;			// absolute
+	unsigned int	durationMS;		// how long it's shown
+	char*			hash;			// its hex SHA-256, 0 if not given
+
+} NextImageEntry;
+
+typedef struct NextImageContext
+{
+	AppOptions		options;		// (serviceURL is this output's)
+	ScreenGeometry	geometry;		// the output it fills
+	GtkWidget*		window;
+
+	// (the unscaled photos aren't kept: each one is released as soon as its frame exists)
+	GtkWidget*		newImage;
+	GdkPixbuf*		newBuffer;				// screen-sized pixels shown by newImage (owned)
+
+	GtkWidget*		previousImage;
+	GdkPixbuf*		previousBuffer;			// screen-sized pixels shown by previousImage (owned)
+
+	GQueue			spareBuffers;			// screen-sized buffers free for prefetched frames
+
+	ImageDownload*	currentDownload;
+	ImageStream*	currentStream;	// push mode
+	int				fetching;		// a download (or the push stream) is scheduled or in flight
+	guint			fetchTimer;		// the scheduled fetch's timeout, 0 once it has started
+	int				frameMissed;	// a skipped decode's frame left the frame cache: the next fetch decodes
+	gulong			networkHandler;	// waiting for the network before the first fetch: its network-changed handler, or 0
+	guint			networkTimer;	// ... and the retry delay's timeout, or 0
+	char*			controlURL;		// options.serviceURL once the control socket set it (owned)
+	unsigned int	sleepReasons;	// NextImageSleepReason bits: nothing is fetched or shown while any is set
+	gint64			presentStart;	// when the last frame was handed over, until it's painted (0 when none)
+
+	// prefetch pipeline (options.prefetchDepth > 0)
+	GQueue			readyFrames;	// scaled GdkPixbufs waiting for their slot, oldest first
+	guint			presentTimer;	// presentation clock, 0 while stopped
+	int				presentPending;	// a slot came with nothing ready: show the next frame on arrival
+
+	// frames the server gave a presentation time (see kImagePresentHeader)
+	gint64			presentTime;	// the current download's, filled in by completion
+	GQueue			timedFrames;	// NextImageTimedFrame instances, soonest first
+	guint			timedTimer;		// for the soonest, 0 when there's none
+	gint64			presentDue;		// when the frame being presented was due, until it's painted (0 if untimed)
+
+	// manifest mode (options.manifest)
+	GPtrArray*		playlist;		// NextImageEntry instances, 0 until a manifest first arrives
+	unsigned int	playlistNext;	// the entry to fetch next; the manifest is fetched again past the last
+	gint64			playlistClock;	// when the next photo's slot starts (wall clock), 0 until the first
+	unsigned int	entryMS;		// the downloading entry's duration
+	GByteArray*		manifest;		// the manifest being downloaded, 0 when none is
+	int				manifestStale;	// ... from a URL the control socket has since replaced: dropped when it's done
+
+	// previews (options.preview)
+	GdkPixbuf*		previewSource;	// the downloading photo as decoded so far, 0 until its first preview (owned)
+	int				previewing;		// what's in front (or being transitioned to) is its preview
+
+	// transitions (software path)
+	GdkPixbuf*		transitionFrame;	// the frame being transitioned to, 0 when idle (owned)
+	GdkPixbuf*		blendBuffer;		// screen-sized composite shown by previousImage during a transition (owned)
+	guint			transitionTick;		// frame clock tick callback on previousImage, 0 when idle
+	gint64			transitionStart;	// frame time of the first transition frame, 0 until then
+	int				transitionSkip;		// frames left to skip after a composite that overran a frame
+
+#if defined(PIFRAME_GL)
+	GLRenderer*		gl;				// if non-0, frames are unscaled and shown by the GPU (no widgets or buffers)
+#endif
+
+} NextImageContext;
+
+
+static gboolean		onNextDownloadDelay(gpointer user);
+static gboolean		onNextImagePresentTick(gpointer user);
+
+// Fills the widget behind with 'scaledPixels' and brings it to the front.
+//   Takes ownership of 'scaledPixels', which may already be the widget's
+//   own buffer (filled in place); a buffer it replaces becomes spare.
+static void		nextImageSwap(NextImageContext* nextImage, GdkPixbuf* scaledPixels)
+{
+	DebugPrintf("+nextImageSwap\n");
+	if(nextImage->newBuffer != scaledPixels)
+	{
+		if(nextImage->newBuffer != 0)
+			g_queue_push_tail(&nextImage->spareBuffers, nextImage->newBuffer);
+		nextImage->newBuffer = scaledPixels;
+	}
+
+	// (setting the same pixbuf again makes GtkImage pick up the new pixels)
+	gtk_image_set_from_pixbuf(GTK_IMAGE(nextImage->newImage), scaledPixels);
+
+	// reorder widget Z-order so that 'nextImage->newImage' is above 'nextImage->previousImage'
+	GdkWindow* newImageWindow = gtk_widget_get_parent_window(nextImage->newImage);
+	GdkWindow* previousImageWindow = gtk_widget_get_parent_window(nextImage->previousImage);
+	gdk_window_restack(newImageWindow, previousImageWindow, TRUE);
+
+	// swap widget references
+	GtkWidget* temp = nextImage->previousImage;
+	nextImage->previousImage = nextImage->newImage;
+	nextImage->newImage = temp;
+
+	GdkPixbuf* tempBuffer = nextImage->previousBuffer;
+	nextImage->previousBuffer = nextImage->newBuffer;
+	nextImage->newBuffer = tempBuffer;
+	DebugPrintf("-nextImageSwap\n");
+}
+
+// ends a running transition by swapping in its frame
+static void		nextImageFinishTransition(NextImageContext* nextImage)
+{
+	if(nextImage->transitionFrame == 0)
+		return;
+
+	if(nextImage->transitionTick != 0)
+		gtk_widget_remove_tick_callback(nextImage->previousImage, nextImage->transitionTick);
+	nextImage->transitionTick = 0;
+
+	GdkPixbuf* scaledPixels = nextImage->transitionFrame;
+	nextImage->transitionFrame = 0;
+	nextImageSwap(nextImage, scaledPixels);
+}
+
+// Runs once per display frame during a transition.  Progress follows the
+//   frame clock rather than a frame count, so frames that are slow to
+//   composite make the transition coarser, never longer.  A composite
+//   that takes longer than a refresh period skips as many frames as it
+//   overran, which leaves the main loop time to paint and keeps a slow
+//   board from queueing up work behind vsync.
+static gboolean		onNextImageTransitionTick(GtkWidget* widget, GdkFrameClock* clock, gpointer user)
+{
+	(void)widget;
+	NextImageContext* nextImage = (NextImageContext*)user;
+	gint64 now = gdk_frame_clock_get_frame_time(clock);
+
+	if(nextImage->transitionStart == 0)
+		nextImage->transitionStart = now;
+
+	double progress = (double)(now - nextImage->transitionStart) / (1000.0 * (double)nextImage->options.transitionMS);
+	if(progress >= 1.0)
+	{
+		nextImage->transitionTick = 0;	// (removed by returning G_SOURCE_REMOVE)
+		nextImageFinishTransition(nextImage);
+		return(G_SOURCE_REMOVE);
+	}
+
+	if(nextImage->transitionSkip > 0)
+	{
+		nextImage->transitionSkip--;
+		return(G_SOURCE_CONTINUE);
+	}
+
+	gint64 start = g_get_monotonic_time();
+
+	TransitionCompose(nextImage->options.transition, nextImage->previousBuffer, nextImage->transitionFrame, nextImage->blendBuffer, progress);
+	gtk_image_set_from_pixbuf(GTK_IMAGE(nextImage->previousImage), nextImage->blendBuffer);
+
+	gint64 cost = g_get_monotonic_time() - start, refreshInterval = 0;
+	gdk_frame_clock_get_refresh_info(clock, now, &refreshInterval, 0);
+	if(refreshInterval <= 0)
+		refreshInterval = 16667;	// (60 Hz)
+
+	nextImage->transitionSkip = (int)(cost / refreshInterval);
+	return(G_SOURCE_CONTINUE);
+}
+
+// Shows 'scaledPixels' (taking ownership), through the configured transition.
+//   A frame that arrives while a transition is still running ends it first.
+static void		nextImagePresent(NextImageContext* nextImage, GdkPixbuf* scaledPixels)
+{
+	DebugPrintf("+nextImagePresent\n");
+#if defined(PIFRAME_GL)
+	if(nextImage->gl != 0)
+	{
+		GLRendererShow(nextImage->gl, scaledPixels);
+		g_object_unref(scaledPixels);	// (the renderer keeps its own reference)
+		nextImage->presentStart = g_get_monotonic_time();
+		DebugPrintf("-nextImagePresent GL\n");
+		return;
+	}
+#endif
+
+	nextImageFinishTransition(nextImage);
+
+	nextImage->presentStart = g_get_monotonic_time();	// (until the next paint, see onNextImageAfterPaint)
+
+	// a photo replaces its own preview without a transition
+	int previewed = nextImage->previewing;
+	nextImage->previewing = 0;
+
+	GdkPixbuf* from = nextImage->previousBuffer;
+	if(previewed || (nextImage->options.transition == kTransitionNone) || (nextImage->options.transitionMS == 0)
+		|| (from == 0) || (gdk_pixbuf_get_width(from) != gdk_pixbuf_get_width(scaledPixels))
+		|| (gdk_pixbuf_get_height(from) != gdk_pixbuf_get_height(scaledPixels)))
+	{
+		nextImageSwap(nextImage, scaledPixels);	// (nothing to transition from, or the screen changed)
+		DebugPrintf("-nextImagePresent\n");
+		return;
+	}
+
+	nextImage->transitionFrame = scaledPixels;
+	nextImage->blendBuffer = screenBufferNew(nextImage->blendBuffer, &nextImage->geometry);
+	nextImage->transitionStart = 0;
+	nextImage->transitionSkip = 0;
+	nextImage->transitionTick = gtk_widget_add_tick_callback(nextImage->previousImage, &onNextImageTransitionTick, (gpointer)nextImage, 0);
+	DebugPrintf("-nextImagePresent transition\n");
+}
+
+// main thread: the frame clock painted; the last frame handed over is on screen
+static void		onNextImageAfterPaint(GdkFrameClock* clock, gpointer user)
+{
+	(void)clock;
+	NextImageContext* nextImage = (NextImageContext*)user;
+
+	if(nextImage->presentStart != 0)
+	{
+		MetricsRecordPresent(g_get_monotonic_time() - nextImage->presentStart, nextImage->transitionFrame != 0, nextImage->presentDue);
+		nextImage->presentStart = 0;
+		nextImage->presentDue = 0;
+	}
+}
+
+// Turns decoded 'pixels' into a frame to be passed (with its reference)
+//   to nextImagePresent().  Prefetched frames are scaled into spare
+//   buffers, and otherwise straight into the buffer behind (it isn't
+//   visible.)  The GL renderer scales on the GPU, so its frames are the
+//   pixels as-is.
+// Frames of photos with a content 'hash' go into the frame cache, and
+//   with no 'pixels' the frame comes from there instead; that returns
+//   0 if the frame cache no longer has it.
+static GdkPixbuf*	nextImagePrepareFrame(NextImageContext* nextImage, GdkPixbuf* pixels, char const* hash, Metrics* metrics)
+{
+#if defined(PIFRAME_GL)
+	if(nextImage->gl != 0)
+	{
+		if(pixels != 0)
+			g_object_ref(pixels);
+		return(pixels);
+	}
+#endif
+
+	GdkPixbuf* scaledPixels;
+	if(nextImage->options.prefetchDepth > 0)
+		scaledPixels = screenBufferNew((GdkPixbuf*)g_queue_pop_head(&nextImage->spareBuffers), &nextImage->geometry);
+	else
+	{
+		nextImageFinishTransition(nextImage);	// (the buffer behind may be what it's transitioning to)
+		scaledPixels = nextImage->newBuffer = screenBufferNew(nextImage->newBuffer, &nextImage->geometry);
+	}
+
+	gint64 start = g_get_monotonic_time();
+	if(pixels == 0)
+	{
+		if((hash != 0) && FrameCacheFetch(hash, scaledPixels))
+		{
+			metrics->scaleUS = g_get_monotonic_time() - start;
+			return(scaledPixels);
+		}
+
+		if(nextImage->options.prefetchDepth > 0)
+			g_queue_push_head(&nextImage->spareBuffers, scaledPixels);
+		return(0);
+	}
+
+	scaleToFill(pixels, scaledPixels);
+	metrics->scaleUS = g_get_monotonic_time() - start;
+
+	if(hash != 0)
+		FrameCacheStore(hash, scaledPixels);
+	return(scaledPixels);
+}
+
+// main thread: more of the downloading photo was decoded.  The new 'area'
+//   is added to the preview source, and only the screen pixels it covers
+//   are rescaled (quickly: it's only a preview) into the frame showing
+//   the preview.  The first preview is presented like any other frame.
+static void		onNextDownloadPreview(void* context, GdkPixbuf* area, GdkRectangle const* where, int width, int height)
+{
+	NextImageContext* nextImage = (NextImageContext*)context;
+	GdkPixbuf* source = nextImage->previewSource;
+
+	if((source == 0) || (gdk_pixbuf_get_width(source) != width) || (gdk_pixbuf_get_height(source) != height))
+	{
+		if(source != 0)
+			g_object_unref(source);
+		source = nextImage->previewSource = gdk_pixbuf_new(GDK_COLORSPACE_RGB, FALSE, 8, width, height);
+		gdk_pixbuf_fill(source, 0x000000ff);	// (black until it arrives)
+		MetricsTrackPixels(source);
+	}
+	gdk_pixbuf_copy_area(area, 0, 0, where->width, where->height, source, where->x, where->y);
+
+	GdkPixbuf* frame;
+	if(nextImage->previewing)
+		frame = (nextImage->transitionFrame != 0)? nextImage->transitionFrame : nextImage->previousBuffer;
+	else
+	{
+		nextImageFinishTransition(nextImage);
+		frame = nextImage->newBuffer = screenBufferNew(nextImage->newBuffer, &nextImage->geometry);
+		where = 0;	// (all of it)
+	}
+
+	// the fill-and-crop mapping of scaleToFill(), for just the screen pixels under 'where'
+	int screenWidth = gdk_pixbuf_get_width(frame);
+	int screenHeight = gdk_pixbuf_get_height(frame);
+	double scale = MAX((double)screenWidth / (double)width, (double)screenHeight / (double)height);
+	double offsetX = 0.5 * ((double)screenWidth - scale * (double)width);
+	double offsetY = 0.5 * ((double)screenHeight - scale * (double)height);
+
+	GdkRectangle screen = {.x = 0, .y = 0, .width = screenWidth, .height = screenHeight};
+	GdkRectangle dirty = screen;
+	if(where != 0)
+	{
+		// (a pixel of margin: the filter reaches into the neighbours)
+		dirty.x = (int)floor(offsetX + scale * (double)where->x) - 1;
+		dirty.y = (int)floor(offsetY + scale * (double)where->y) - 1;
+		dirty.width = (int)ceil(scale * (double)where->width) + 3;
+		dirty.height = (int)ceil(scale * (double)where->height) + 3;
+	}
+
+	if(gdk_rectangle_intersect(&dirty, &screen, &dirty))
+		gdk_pixbuf_scale(source, frame, dirty.x, dirty.y, dirty.width, dirty.height, offsetX, offsetY, scale, scale, GDK_INTERP_BILINEAR);
+
+	DebugPrintf("*onNextDownloadPreview %ix%i at %i,%i\n", dirty.width, dirty.height, dirty.x, dirty.y);
+	if(!nextImage->previewing)
+	{
+		nextImagePresent(nextImage, frame);
+		nextImage->previewing = 1;
+	}
+	else if(nextImage->transitionFrame == 0)
+		gtk_image_set_from_pixbuf(GTK_IMAGE(nextImage->previousImage), frame);	// (same pixbuf: picks up the new pixels)
+}
+
+// curlThread: a cached photo is about to be decoded again; skip it if its frame is cached too
+static int			onNextImageCached(void* context, char const* hash)
+{
+#if defined(PIFRAME_GL)
+	if(((NextImageContext*)context)->gl != 0)
+		return(0);	// (the GL renderer needs the pixels)
+#endif
+	ScreenGeometry const* geometry = &((NextImageContext*)context)->geometry;
+
+	// (a frame evicted or resized before the main thread copies it out is fetched again and decoded: see nextImageReceive)
+	return(FrameCacheHas(hash, geometry->width, geometry->height));
+}
+
+// main thread: the screen (or a monitor) changed; follow the output with the window and widgets (buffers follow lazily)
+static void		onNextImageScreenChanged(GdkScreen* screen, gpointer user)
+{
+	NextImageContext* nextImage = (NextImageContext*)user;
+	ScreenGeometryUpdate(&nextImage->geometry);
+	ScreenGeometry const* geometry = &nextImage->geometry;
+
+	if((geometry->monitor != kScreenWhole) && (geometry->monitor < gdk_screen_get_n_monitors(screen)))
+	{
+		gtk_window_move(GTK_WINDOW(nextImage->window), geometry->x, geometry->y);
+		gtk_window_fullscreen_on_monitor(GTK_WINDOW(nextImage->window), screen, geometry->monitor);
+	}
+
+#if defined(PIFRAME_GL)
+	if(nextImage->gl != 0)
+	{
+		gtk_widget_set_size_request(nextImage->gl->area, geometry->width, geometry->height);
+		return;
+	}
+#endif
+	gtk_widget_set_size_request(nextImage->newImage, geometry->width, geometry->height);
+	gtk_widget_set_size_request(nextImage->previousImage, geometry->width, geometry->height);
+}
+
+static void		nextImageScheduleFetch(NextImageContext* nextImage, unsigned int delayMS)
+{
+	if(nextImage->fetching)
+		return;
+
+	nextImage->fetching = 1;
+	nextImage->fetchTimer = gdk_threads_add_timeout(delayMS, &onNextDownloadDelay, (void*)nextImage);
+}
+
+// the network is up (or assumed to be): stop waiting for it and make the first fetch.
+//   Later changes are left to the retries; another fetch from here would
+//   overrun -n, or not wait for a timed frame to be shown.
+static void		nextImageNetworkReady(NextImageContext* nextImage)
+{
+	if(nextImage->networkHandler != 0)
+		g_signal_handler_disconnect(g_network_monitor_get_default(), nextImage->networkHandler);
+	if(nextImage->networkTimer != 0)
+		g_source_remove(nextImage->networkTimer);
+	nextImage->networkHandler = 0;
+	nextImage->networkTimer = 0;
+
+	nextImageScheduleFetch(nextImage, 0);
+}
+
+// main thread: the network changed before the first fetch (connected only until then)
+static void		onNextImageNetworkChanged(GNetworkMonitor* monitor, gboolean available, gpointer user)
+{
+	(void)monitor;
+	DebugPrintf("*onNextImageNetworkChanged available=%i\n", available);
+	if(available)
+		nextImageNetworkReady((NextImageContext*)user);
+}
+
+// main thread: the network monitor has said nothing for a while; try anyway
+static gboolean		onNextImageNetworkWait(gpointer user)
+{
+	NextImageContext* nextImage = (NextImageContext*)user;
+	nextImage->networkTimer = 0;	// (1-shot: removed as it returns)
+	nextImageNetworkReady(nextImage);
+	return(FALSE);
+}
+
+// prefetching: keep downloading until the ready queue is full
+static void		nextImageRefill(NextImageContext* nextImage)
+{
+	if(g_queue_get_length(&nextImage->readyFrames) + g_queue_get_length(&nextImage->timedFrames) < nextImage->options.prefetchDepth)
+		nextImageScheduleFetch(nextImage, nextImage->options.delayMS);
+}
+
+// prefetching: show the oldest ready frame, if there is one
+static void		nextImagePresentReady(NextImageContext* nextImage)
+{
+	GdkPixbuf* scaledPixels = (GdkPixbuf*)g_queue_pop_head(&nextImage->readyFrames);
+
+	DebugPrintf("*nextImagePresentReady %s, %i left\n", (scaledPixels != 0)? "frame" : "underrun", g_queue_get_length(&nextImage->readyFrames));
+	if(scaledPixels != 0)
+	{
+		nextImagePresent(nextImage, scaledPixels);	// (reference passed on)
+		nextImage->presentPending = 0;
+	}
+	else
+		nextImage->presentPending = 1;	// the next arrival is shown immediately
+
+	nextImageRefill(nextImage);
+}
+
+////////////////////////////////////////////////////////////////
+// Timed frames: a frame that came with a presentation time is
+//   decoded and scaled as soon as it arrives, then held until the
+//   wall clock reaches that time and swapped in on the spot, so
+//   that frames sharing an NTP-synchronized clock swap within a
+//   display frame of each other.  The timer runs on the monotonic
+//   clock, rounded up to the millisecond, and is checked against
+//   the wall clock when it fires in case that was stepped.  Without
+//   prefetching, the next request waits until the frame is shown.
+
+static gboolean		onNextImageTimedDue(gpointer user);
+
+static gint			nextImageCompareTimed(gconstpointer a, gconstpointer b, gpointer user)
+{
+	(void)user;
+	gint64 first = ((NextImageTimedFrame const*)a)->presentTime;
+	gint64 second = ((NextImageTimedFrame const*)b)->presentTime;
+	return((first > second) - (first < second));
+}
+
+// (re)arms the timer for the soonest held frame
+static void		nextImageArmTimed(NextImageContext* nextImage)
+{
+	if(nextImage->timedTimer != 0)
+		g_source_remove(nextImage->timedTimer);
+	nextImage->timedTimer = 0;
+
+	NextImageTimedFrame* frame = (NextImageTimedFrame*)g_queue_peek_head(&nextImage->timedFrames);
+	if(frame == 0)
+		return;
+
+	gint64 waitMS = (MAX(frame->presentTime - g_get_real_time(), 0) + 999) / 1000;
+	nextImage->timedTimer = gdk_threads_add_timeout_full(G_PRIORITY_HIGH, (guint)MIN(waitMS, (gint64)G_MAXUINT), &onNextImageTimedDue, (gpointer)nextImage, 0);
+}
+
+// takes ownership of 'scaledPixels'; a time already past shows it right away
+static void		nextImageHold(NextImageContext* nextImage, GdkPixbuf* scaledPixels, gint64 presentTime)
+{
+	NextImageTimedFrame* frame = g_new(NextImageTimedFrame, 1);
+	frame->pixels = scaledPixels;
+	frame->presentTime = presentTime;
+
+	DebugPrintf("*nextImageHold for %" G_GINT64_FORMAT " us from now\n", presentTime - g_get_real_time());
+	g_queue_insert_sorted(&nextImage->timedFrames, frame, &nextImageCompareTimed, 0);
+	nextImageArmTimed(nextImage);
+}
+
+static gboolean		onNextImageTimedDue(gpointer user)
+{
+	NextImageContext* nextImage = (NextImageContext*)user;
+	nextImage->timedTimer = 0;
+
+	NextImageTimedFrame* frame = (NextImageTimedFrame*)g_queue_peek_head(&nextImage->timedFrames);
+	if(frame->presentTime - g_get_real_time() >= 1000)
+	{
+		nextImageArmTimed(nextImage);	// (the wall clock was stepped back)
+		return(FALSE);
+	}
+	g_queue_pop_head(&nextImage->timedFrames);
+
+	DebugPrintf("*onNextImageTimedDue late by %" G_GINT64_FORMAT " us\n", g_get_real_time() - frame->presentTime);
+	nextImage->presentDue = frame->presentTime;
+	nextImagePresent(nextImage, frame->pixels);	// (reference passed on)
+	g_free(frame);
+
+	nextImageArmTimed(nextImage);
+
+	if(nextImage->options.prefetchDepth > 0)
+		nextImageRefill(nextImage);
+	else
+		nextImageScheduleFetch(nextImage, nextImage->options.delayMS);
+	return(FALSE);	// (re-armed for the next one, if any)
+}
+
+static gboolean		onNextImagePresentTick(gpointer user)
+{
+	NextImageContext* nextImage = (NextImageContext*)user;
+
+	nextImagePresentReady(nextImage);
+
+	if(nextImage->presentPending)
+	{
+		// stop the clock on underrun; it restarts with the next arrival
+		nextImage->presentTimer = 0;
+		return(FALSE);
+	}
+	return(TRUE);
+}
+
+// Shows (or queues) a photo that arrived, then asks for the next one.
+//   'source' tags its metrics: "get", "frame" (from the frame cache) or "push".
+//   A 'presentTime' (0 if none) holds the frame until then (see Timed frames.)
+static void		nextImageReceive(NextImageContext* nextImage, GdkPixbuf* pixels, char const* hash, GError* error, char const* source, Metrics* metrics, gint64 presentTime)
+{
+	DebugPrintf("+nextImageReceive\n");
+	int minimumDelay = nextImage->options.delayMS;
+
+	if(nextImage->sleepReasons != 0)
+	{
+		DebugPrintf("-nextImageReceive asleep\n");
+		return;	// (a push part that was on its way)
+	}
+
+	if(nextImage->previewSource != 0)
+	{
+		g_object_unref(nextImage->previewSource);	// (the photo itself is here)
+		nextImage->previewSource = 0;
+	}
+	if(error != 0)
+		nextImage->previewing = 0;	// (a partial photo stays up until the next one)
+
+	// (no pixels without an error: the photo's frame is in the frame cache)
+	GdkPixbuf* scaledPixels = ((pixels != 0) || (error == 0))? nextImagePrepareFrame(nextImage, pixels, hash, metrics) : 0;
+	if(scaledPixels != 0)
+		MetricsRecordImage((pixels != 0)? source : "frame", metrics);
+	else if((pixels == 0) && (error == 0))
+	{
+		// the decode was skipped for a frame that's gone from the frame cache since: fetch the photo again now, decoding it
+		nextImage->frameMissed = 1;
+		nextImageScheduleFetch(nextImage, 0);
+		DebugPrintf("-nextImageReceive frame missed\n");
+		return;
+	}
+
+	if((scaledPixels != 0) && (presentTime != 0))
+	{
+		nextImageHold(nextImage, scaledPixels, presentTime);
+		if(nextImage->options.prefetchDepth > 0)
+			nextImageRefill(nextImage);
+
+		DebugPrintf("-nextImageReceive timed\n");
+		return;
+	}
+
+	if((scaledPixels != 0) && (nextImage->options.prefetchDepth > 0))
+	{
+		DebugPrintf("+nextImageReceive (pixels != 0) prefetch\n");
+
+		// the frame is ready now; it's shown when its presentation slot comes
+		g_queue_push_tail(&nextImage->readyFrames, scaledPixels);
+
+		if(nextImage->options.push && (g_queue_get_length(&nextImage->readyFrames) > nextImage->options.prefetchDepth))
+		{
+			// the server sets the pace: the newest frames win
+			g_queue_push_tail(&nextImage->spareBuffers, g_queue_pop_head(&nextImage->readyFrames));
+		}
+
+		if(nextImage->presentPending)
+		{
+			nextImagePresentReady(nextImage);
+			if(nextImage->presentTimer == 0)
+				nextImage->presentTimer = gdk_threads_add_timeout(nextImage->options.intervalMS, &onNextImagePresentTick, (void*)nextImage);
+		}
+
+		nextImageRefill(nextImage);
+
+		DebugPrintf("-nextImageReceive (pixels != 0) prefetch\n");
+		DebugPrintf("-nextImageReceive\n");
+		return;
+	}
+
+	if(scaledPixels != 0)
+	{
+		DebugPrintf("+nextImageReceive (pixels != 0)\n");
+
+		nextImagePresent(nextImage, scaledPixels);
+
+		DebugPrintf("-nextImageReceive (pixels != 0)\n");
+	}
+	else
+	{
+		DebugPrintf("+nextImageReceive (pixels == 0) error\n");
+
+		// handle *error
+		DebugPrintf("*nextImageReceive: download error, no photo update.\n");
+
+		minimumDelay = kRetryDelayMS;
+
+		DebugPrintf("-nextImageReceive (pixels == 0) error\n");
+		// we continue, essentially repeating the download (widgets don't swap)
+	}
+
+	// kick off next download
+
+	nextImageScheduleFetch(nextImage, minimumDelay);
+	DebugPrintf("-nextImageReceive\n");
+}
+
+void	onNextDownloadComplete(void* context, GdkPixbuf* pixels, char const* hash, GError* error, Metrics const* downloadMetrics)
+{
+	NextImageContext* nextImage = (NextImageContext*)context;
+	Metrics metrics;
+	if(downloadMetrics != 0)
+		metrics = *downloadMetrics;
+	else
+		memset(&metrics, 0, sizeof(metrics));
+
+	nextImage->currentDownload = 0;
+	nextImage->fetching = 0;
+
+	gint64 presentTime = nextImage->presentTime;
+	gint64 clock = nextImage->playlistClock;
+	if(nextImage->options.manifest && (error == 0))
+	{
+		// the photo's slot follows the last one's, unless it missed all of it (then it starts now)
+		gint64 now = g_get_real_time();
+		presentTime = nextImage->playlistClock;
+		if((presentTime == 0) || (presentTime + 1000 * (gint64)nextImage->entryMS < now))
+			presentTime = now;
+		nextImage->playlistClock = presentTime + 1000 * (gint64)nextImage->entryMS;
+	}
+
+	nextImageReceive(nextImage, pixels, hash, error, "get", &metrics, presentTime);
+
+	if(nextImage->frameMissed && nextImage->options.manifest)
+	{
+		// fetching it again: the same entry, in the same slot
+		nextImage->playlistClock = clock;
+		if(nextImage->playlistNext > 0)
+			nextImage->playlistNext--;
+	}
+}
+
+// push mode: a part of the stream arrived (the stream stays open, so no new fetch starts)
+static void		onNextStreamPart(void* context, GdkPixbuf* pixels, GError* error, Metrics const* metrics, gint64 presentTime)
+{
+	Metrics partMetrics = *metrics;
+	nextImageReceive((NextImageContext*)context, pixels, 0, error, "push", &partMetrics, presentTime);
+}
+
+// push mode: the stream ended; reconnect after a while
+static void		onNextStreamEnd(void* context, GError* error)
+{
+	DebugPrintf("*onNextStreamEnd %s\n", (error != 0)? error->message : "clean");
+	NextImageContext* nextImage = (NextImageContext*)context;
+
+	nextImage->currentStream = 0;
+	nextImage->fetching = 0;
+
+	if(nextImage->sleepReasons == 0)
+		nextImageScheduleFetch(nextImage, kRetryDelayMS);
+}
+
+////////////////////////////////////////////////////////////////
+// Sleep: while nobody can see the screen (the display's power is
+//   off, or the frame was told with SIGUSR1), nothing is fetched,
+//   decoded or presented.  What's in flight is cancelled, the
+//   presentation clocks stop and every buffer but the one on screen
+//   and a single frame kept for waking is released, so the app makes
+//   no wakeups of its own beyond the display check.  On waking
+//   (SIGUSR2, or the display's power back on) the kept frame is
+//   shown at once and fetching picks up where it left off.
+
+#define kDisplayDRMDirectory "/sys/class/drm"
+
+// 1 if any connected DRM connector is powered, 0 if none is, -1 if it can't be told
+static int		nextImageDisplayPowered(void)
+{
+	int powered = -1;
+	GDir* directory = g_dir_open(kDisplayDRMDirectory, 0, 0);
+	if(directory == 0)
+		return(powered);
+
+	char const* name;
+	while((name = g_dir_read_name(directory)) != 0)
+	{
+		if(strchr(name, '-') == 0)
+			continue;	// (a card, not a connector: "card0-HDMI-A-1")
+
+		char* path = g_build_filename(kDisplayDRMDirectory, name, "status", NULL);
+		char* status = 0;
+		g_file_get_contents(path, &status, 0, 0);
+		g_free(path);
+
+		path = g_build_filename(kDisplayDRMDirectory, name, "dpms", NULL);
+		char* dpms = 0;
+		g_file_get_contents(path, &dpms, 0, 0);
+		g_free(path);
+
+		if((status != 0) && (dpms != 0) && !strcmp(g_strstrip(status), "connected"))
+		{
+			if(!strcmp(g_strstrip(dpms), "On"))
+				powered = 1;
+			else if(powered < 0)
+				powered = 0;	// (Off, Standby or Suspend)
+		}
+		g_free(status);
+		g_free(dpms);
+	}
+	g_dir_close(directory);
+	return(powered);
+}
+
+// unrefs the pixbufs in 'frames' and empties it
+static void		nextImageFramesClear(GQueue* frames)
+{
+	GdkPixbuf* pixels;
+	while((pixels = (GdkPixbuf*)g_queue_pop_head(frames)) != 0)
+		g_object_unref(pixels);
+}
+
+static void		nextImageSleep(NextImageContext* nextImage)
+{
+	DebugPrintf("+nextImageSleep\n");
+
+	// (a fetch that's only scheduled finds the pipeline asleep when it's due)
+	if(nextImage->currentDownload != 0)
+	{
+		ImageDownloadStop(nextImage->currentDownload);
+		nextImage->currentDownload = 0;
+		nextImage->fetching = 0;
+	}
+	if(nextImage->currentStream != 0)
+		ImageStreamStop(nextImage->currentStream);	// (fetching until it ends)
+
+	if(nextImage->presentTimer != 0)
+		g_source_remove(nextImage->presentTimer);
+	nextImage->presentTimer = 0;
+	if(nextImage->timedTimer != 0)
+		g_source_remove(nextImage->timedTimer);
+	nextImage->timedTimer = 0;
+
+	nextImageFinishTransition(nextImage);
+
+	// keep the next frame (a timed one loses its time), release the rest
+	GdkPixbuf* kept = (GdkPixbuf*)g_queue_pop_head(&nextImage->readyFrames);
+	NextImageTimedFrame* frame;
+	while((frame = (NextImageTimedFrame*)g_queue_pop_head(&nextImage->timedFrames)) != 0)
+	{
+		if(kept == 0)
+			kept = frame->pixels;
+		else
+			g_object_unref(frame->pixels);
+		g_free(frame);
+	}
+	nextImageFramesClear(&nextImage->readyFrames);
+	if(kept != 0)
+		g_queue_push_head(&nextImage->readyFrames, kept);
+
+	nextImageFramesClear(&nextImage->spareBuffers);
+
+	if(nextImage->blendBuffer != 0)
+		g_object_unref(nextImage->blendBuffer);
+	nextImage->blendBuffer = 0;
+	if(nextImage->previewSource != 0)
+		g_object_unref(nextImage->previewSource);
+	nextImage->previewSource = 0;
+
+	// (the buffer behind isn't visible; it's allocated again for the next frame)
+	if(nextImage->newBuffer != 0)
+	{
+		gtk_image_clear(GTK_IMAGE(nextImage->newImage));
+		g_object_unref(nextImage->newBuffer);
+		nextImage->newBuffer = 0;
+	}
+
+	nextImage->presentPending = 1;
+	nextImage->playlistClock = 0;	// (the playlist starts its clock again on waking)
+	DebugPrintf("-nextImageSleep %s\n", (kept != 0)? "frame kept" : "no frame");
+}
+
+static void		nextImageWake(NextImageContext* nextImage)
+{
+	DebugPrintf("*nextImageWake\n");
+	GdkPixbuf* ready = (GdkPixbuf*)g_queue_pop_head(&nextImage->readyFrames);
+	if(ready != 0)
+	{
+		nextImagePresent(nextImage, ready);	// (reference passed on)
+		nextImage->presentPending = 0;
+
+		if(nextImage->options.manifest)
+			nextImage->playlistClock = g_get_real_time() + 1000 * (gint64)nextImage->options.intervalMS;
+		else if(nextImage->options.prefetchDepth > 0)
+			nextImage->presentTimer = gdk_threads_add_timeout(nextImage->options.intervalMS, &onNextImagePresentTick, (void*)nextImage);
+	}
+
+	if(nextImage->options.prefetchDepth > 0)
+		nextImageRefill(nextImage);
+	else
+		nextImageScheduleFetch(nextImage, 0);
+}
+
+// sets or clears one reason to sleep; the pipeline sleeps while there's any
+static void		nextImageSetSleep(NextImageContext* nextImage, unsigned int reason, int asleep)
+{
+	unsigned int was = nextImage->sleepReasons;
+	nextImage->sleepReasons = asleep? (was | reason) : (was & ~reason);
+
+	if((was == 0) && (nextImage->sleepReasons != 0))
+		nextImageSleep(nextImage);
+	else if((was != 0) && (nextImage->sleepReasons == 0))
+		nextImageWake(nextImage);
+}
+
+// the same for every output (a GPtrArray of NextImageContext instances)
+static void		nextImageSetSleepAll(GPtrArray* outputs, unsigned int reason, int asleep)
+{
+	unsigned int i;
+	for(i = 0; i < outputs->len; i++)
+		nextImageSetSleep((NextImageContext*)g_ptr_array_index(outputs, i), reason, asleep);
+}
+
+static gboolean		onNextImageSleepSignal(gpointer user)
+{
+	nextImageSetSleepAll((GPtrArray*)user, kNextImageSleepSignal, 1);
+	return(G_SOURCE_CONTINUE);
+}
+
+static gboolean		onNextImageWakeSignal(gpointer user)
+{
+	nextImageSetSleepAll((GPtrArray*)user, kNextImageSleepSignal, 0);
+	return(G_SOURCE_CONTINUE);
+}
+
+// Main thread, every options.displayPollS: follow the displays' power
+//   (an unknown state changes nothing.)  The outputs sleep together,
+//   while no connected display is powered.
+static gboolean		onNextImageDisplayPoll(gpointer user)
+{
+	int powered = nextImageDisplayPowered();
+	if(powered >= 0)
+		nextImageSetSleepAll((GPtrArray*)user, kNextImageSleepDisplayOff, !powered);
+	return(G_SOURCE_CONTINUE);
+}
+
+// A service (or manifest entry) URL with {width}, {height}, {dpr} and {output} filled in
+//   for the screen as it is now, so that a server that doesn't
+//   read client hints can still be asked for a fitting photo.
+static char*		nextImageURLNew(NextImageContext* nextImage, char const* pattern)
+{
+	ScreenGeometry const* geometry = &nextImage->geometry;
+	char const* names[] = {"{width}", "{height}", "{dpr}", "{output}"};
+	int values[] = {geometry->width, geometry->height, geometry->scale, MAX(geometry->monitor, 0)};
+	char* url = g_strdup(pattern);
+
+	int i;
+	for(i = 0; i < 4; i++)
+	{
+		char** parts = g_strsplit(url, names[i], -1);
+		char* value = g_strdup_printf("%i", values[i]);
+		g_free(url);
+		url = g_strjoinv(value, parts);
+		g_free(value);
+		g_strfreev(parts);
+	}
+	return(url);
+}
+
+////////////////////////////////////////////////////////////////
+// Manifest: with options.manifest the service URL names a
+//   playlist rather than a photo, one line per photo:
+//
+//     <url> [<seconds to show it>] [<hex SHA-256 of the photo>]
+//
+//   Relative URLs are resolved against the manifest's, blank lines
+//   and lines starting with '#' are ignored, and a missing duration
+//   is options.intervalMS.  The photos are fetched in order, ahead of
+//   the display, and each one is held for its slot on the playlist's
+//   own clock (see Timed frames); a photo whose hash the disk cache
+//   holds is served from there without a request.  Each time the
+//   playlist wraps the manifest is fetched again, revalidated through
+//   the disk cache so that an unchanged one costs a 304, and one that
+//   can't be fetched leaves the old playlist playing.
+
+#define kManifestMaxBytes (1024 * 1024)
+#define kManifestPrefetchDepth (2)	// -n when it isn't given
+
+static void		nextImageEntryFree(NextImageEntry* entry)
+{
+	g_free(entry->url);
+	g_free(entry->hash);
+	g_free(entry);
+}
+
+// parses a manifest into NextImageEntry instances (possibly none)
+static GPtrArray*	nextImagePlaylistNew(char const* text, char const* base, unsigned int defaultMS)
+{
+	GPtrArray* playlist = g_ptr_array_new_with_free_func((GDestroyNotify)&nextImageEntryFree);
+	CURLU* resolver = curl_url();
+	gchar** lines = g_strsplit(text, "\n", -1);
+	int i;
+
+	for(i = 0; lines[i] != 0; i++)
+	{
+		char* line = g_strstrip(lines[i]);
+		if((line[0] == 0) || (line[0] == '#'))
+			continue;
+
+		gchar** fields = g_strsplit_set(line, " \t", -1);
+		char const* words[3] = {0, 0, 0};
+		int w, count = 0;
+		for(w = 0; (fields[w] != 0) && (count < 3); w++)
+		{
+			if(fields[w][0] != 0)
+				words[count++] = fields[w];
+		}
+
+		// (the resolver starts from the manifest's URL for every line)
+		char* url = 0;
+		if((curl_url_set(resolver, CURLUPART_URL, base, 0) != CURLUE_OK)
+			|| (curl_url_set(resolver, CURLUPART_URL, words[0], 0) != CURLUE_OK)
+			|| (curl_url_get(resolver, CURLUPART_URL, &url, 0) != CURLUE_OK))
+		{
+			DebugPrintf("*nextImagePlaylistNew bad URL \"%s\"\n", words[0]);
+			g_strfreev(fields);
+			continue;
+		}
+
+		NextImageEntry* entry = g_new(NextImageEntry, 1);
+		entry->url = g_strdup(url);
+		entry->durationMS = defaultMS;
+		entry->hash = 0;
+		curl_free(url);
+
+		char* end = 0;
+		double seconds = (words[1] != 0)? g_ascii_strtod(words[1], &end) : 0.0;
+		if((words[1] != 0) && (end != words[1]) && (*end == 0) && (seconds > 0.0))
+			entry->durationMS = (unsigned int)MIN(seconds * 1000.0, (double)G_MAXUINT);
+
+		if((words[2] != 0) && (strlen(words[2]) == kDownloadPeerHashLength) && (strspn(words[2], "0123456789abcdefABCDEF") == kDownloadPeerHashLength))
+			entry->hash = g_ascii_strdown(words[2], -1);
+
+		g_ptr_array_add(playlist, entry);
+		g_strfreev(fields);
+	}
+
+	g_strfreev(lines);
+	curl_url_cleanup(resolver);
+	return(playlist);
+}
+
+// curlThread: the manifest arriving
+static int		onNextManifestData(DownloadOptions const* download, unsigned char const* data, size_t length)
+{
+	NextImageContext* nextImage = (NextImageContext*)download->context;
+	g_byte_array_append(nextImage->manifest, data, (guint)length);
+	return(nextImage->manifest->len <= kManifestMaxBytes);
+}
+
+// main thread: take the new playlist (an empty one is taken for a mistake) and carry on from its top
+static void		onNextManifestComplete(DownloadOptions const* download, int result, char const* reason)
+{
+	NextImageContext* nextImage = (NextImageContext*)download->context;
+	DebugPrintf("*onNextManifestComplete result=%i (%s), %u bytes%s\n", result, reason, nextImage->manifest->len, nextImage->manifestStale? ", stale" : "");
+
+	if((result == CURLE_OK) && !nextImage->manifestStale)
+	{
+		g_byte_array_append(nextImage->manifest, (guint8 const*)"", 1);
+		GPtrArray* playlist = nextImagePlaylistNew((char const*)nextImage->manifest->data, download->url, nextImage->options.intervalMS);
+		DebugPrintf("*onNextManifestComplete %u entries\n", playlist->len);
+
+		if(playlist->len > 0)
+		{
+			if(nextImage->playlist != 0)
+				g_ptr_array_unref(nextImage->playlist);
+			nextImage->playlist = playlist;
+		}
+		else
+			g_ptr_array_unref(playlist);
+	}
+	g_byte_array_unref(nextImage->manifest);
+	nextImage->manifest = 0;
+
+	nextImage->playlistNext = 0;
+	nextImage->fetching = 0;
+	int retry = (nextImage->playlist == 0) && !nextImage->manifestStale;	// (a stale one: fetch the new URL's now)
+	nextImage->manifestStale = 0;
+	nextImageScheduleFetch(nextImage, retry? kRetryDelayMS : 0);
+}
+
+// The entry to fetch next, or 0 once the playlist is played through
+//   (or hasn't arrived yet): the manifest is then fetched, and the
+//   next entry fetched when it's here.
+static NextImageEntry*	nextImagePlaylistNext(NextImageContext* nextImage)
+{
+	if((nextImage->playlist != 0) && (nextImage->playlistNext < nextImage->playlist->len))
+	{
+		NextImageEntry* entry = (NextImageEntry*)g_ptr_array_index(nextImage->playlist, nextImage->playlistNext++);
+		nextImage->entryMS = entry->durationMS;
+		return(entry);
+	}
+
+	char* url = nextImageURLNew(nextImage, nextImage->options.serviceURL);
+	DownloadOptions options =
+	{
+		.url = url,
+		.completeCallback = &onNextManifestComplete,
+		.context = (void*)nextImage,
+		.streamCallback = &onNextManifestData,
+		.cache = 1,
+		.failOnError = 1,
+	};
+	nextImage->manifest = g_byte_array_new();
+	DownloadNew(&options);
+	g_free(url);
+	return(0);
+}
+
+static gboolean		onNextDownloadDelay(gpointer user)
+{
+	(void)user;
+	DebugPrintf("+onNextDownloadDelay\n");
+	NextImageContext* nextImage = (NextImageContext*)user;
+	nextImage->fetchTimer = 0;
+
+	if(nextImage->sleepReasons != 0)
+	{
+		nextImage->fetching = 0;	// (waking fetches again)
+		DebugPrintf("-onNextDownloadDelay asleep\n");
+		return(FALSE);
+	}
+
+	NextImageEntry* entry = 0;
+	if(nextImage->options.manifest && ((entry = nextImagePlaylistNext(nextImage)) == 0))
+	{
+		DebugPrintf("-onNextDownloadDelay manifest\n");
+		return(FALSE);	// (still fetching: the manifest first)
+	}
+	char* url = nextImageURLNew(nextImage, (entry != 0)? entry->url : nextImage->options.serviceURL);
+
+	ImageDownloadOptions downloadOptions =
+	{
+		.url = url,
+		.completeCallback = &onNextDownloadComplete,
+		.context = nextImage,
+		.cachedCallback = nextImage->frameMissed? 0 : &onNextImageCached,
+		.metrics = MetricsEnabled(),
+		.streaming = nextImage->options.streaming,
+		.previewCallback = nextImage->options.preview? &onNextDownloadPreview : 0,
+
+		// a prefetch can wait; the screen can't (it's waiting with every fetch when not prefetching)
+		.priority = ((nextImage->options.prefetchDepth == 0) || nextImage->presentPending)? kDownloadPriorityUrgent : 0,
+		.pixelRatio = nextImage->geometry.scale,
+		.presentTime = &nextImage->presentTime,
+		.hash = (entry != 0)? entry->hash : 0,
+	};
+
+	nextImage->presentTime = 0;
+	nextImage->frameMissed = 0;
+
+	// decode no larger than needed to fill the screen
+	downloadOptions.targetWidth = nextImage->geometry.width;
+	downloadOptions.targetHeight = nextImage->geometry.height;
+
+	if(nextImage->options.push)
+	{
+		ImageStreamOptions streamOptions =
+		{
+			.url = url,
+			.partCallback = &onNextStreamPart,
+			.endCallback = &onNextStreamEnd,
+			.context = nextImage,
+			.targetWidth = nextImage->geometry.width,
+			.targetHeight = nextImage->geometry.height,
+			.pixelRatio = nextImage->geometry.scale,
+		};
+		nextImage->currentStream = ImageStreamNew(&streamOptions);
+	}
+	else
+		nextImage->currentDownload = ImageDownloadNew(&downloadOptions);
+	g_free(url);	// (both duplicate it)
+
+	DebugPrintf("-onNextDownloadDelay\n");
+	return(FALSE);	// don't repeat, 1-shot only
+}
+
+
+////////////////////////////////////////////////////////////////
+// Control: with options.controlPath, a UNIX socket there takes
+//   commands, one per line, and answers each one with lines of
+//   "<name> <value>" and then "ok" (or just "error <why>".)  A
+//   command goes to every output unless it starts with "@<output> "
+//   (numbered from 0, in -o order.)  Everything runs on the main
+//   loop, between frames, so nothing needs a lock:
+//
+//     url <url>          fetch from here from the next photo on
+//     delay <ms>         as -d
+//     interval <ms>      as -i
+//     prefetch <frames>  as -n
+//     cache <MiB>        as -M (0 empties the disk cache)
+//     frames <MiB>       as -F (0 empties the frame cache)
+//     skip               show the next frame that's ready now
+//     preload            fetch one more photo now, not after -d
+//     sleep, wake        as SIGUSR1 and SIGUSR2 (see Sleep)
+//     stats              queues, pools, caches, memory and the outputs
+//     trace [path]       write the trace there (see Trace)
+
+typedef struct ControlClient
+{
+	int				fd;
+	GPtrArray*		outputs;	// NextImageContext instances
+	GString*		line;		// received, up to a newline
+
+} ControlClient;
+
+#define kControlMaxLine (4096)	// a longer line drops the client
+#define kControlBacklog (4)
+
+// starts the fetch that's waiting for -d now, or another one if there's none on its way
+static void		nextImageFetchNow(NextImageContext* nextImage)
+{
+	if(nextImage->fetchTimer != 0)
+	{
+		g_source_remove(nextImage->fetchTimer);
+		nextImage->fetchTimer = 0;
+		nextImage->fetching = 0;
+	}
+	nextImageScheduleFetch(nextImage, 0);
+}
+
+// a command for one output; returns 0 (with 'reply' the reason) if it can't be done
+static int		controlOutputCommand(NextImageContext* nextImage, char const* command, char const* argument, GString* reply)
+{
+	unsigned int value = (argument != 0)? (unsigned int)strtoul(argument, 0, 10) : 0;
+
+	if(!strcmp(command, "url") && (argument != 0))
+	{
+		g_free(nextImage->controlURL);
+		nextImage->controlURL = g_strdup(argument);
+		nextImage->options.serviceURL = nextImage->controlURL;
+
+		if(nextImage->playlist != 0)
+			g_ptr_array_unref(nextImage->playlist);	// (the new manifest is fetched next)
+		nextImage->playlist = 0;
+		nextImage->manifestStale = (nextImage->manifest != 0);	// (and one on its way from the old URL isn't taken)
+		if(nextImage->currentStream != 0)
+			ImageStreamStop(nextImage->currentStream);	// (it reconnects to the new URL)
+	}
+	else if(!strcmp(command, "delay") && (argument != 0))
+		nextImage->options.delayMS = value;
+	else if(!strcmp(command, "interval") && (argument != 0) && (value > 0))
+		nextImage->options.intervalMS = value;	// (from the next slot)
+	else if(!strcmp(command, "prefetch") && (argument != 0))
+	{
+		if(nextImage->options.preview && (value > 0))
+		{
+			g_string_append(reply, "previews need no prefetch");
+			return(0);
+		}
+		nextImage->options.prefetchDepth = value;
+
+		if(value == 0)
+		{
+			// each photo is shown as it arrives from now on: stop the clock, and drop what it would have shown in between
+			if(nextImage->presentTimer != 0)
+				g_source_remove(nextImage->presentTimer);
+			nextImage->presentTimer = 0;
+			nextImage->presentPending = 0;
+			nextImageFramesClear(&nextImage->readyFrames);
+			nextImageFramesClear(&nextImage->spareBuffers);	// (only prefetching uses them)
+		}
+
+		// (with a depth, frames already ready are shown as their slots come)
+		if((nextImage->sleepReasons == 0) && (value > 0))
+			nextImageRefill(nextImage);
+		else if(nextImage->sleepReasons == 0)
+			nextImageScheduleFetch(nextImage, 0);
+	}
+	else if(!strcmp(command, "skip"))
+	{
+		if((nextImage->sleepReasons != 0) || g_queue_is_empty(&nextImage->readyFrames))
+		{
+			g_string_append(reply, "nothing ready");
+			return(0);
+		}
+
+		// the presentation clock starts again from this frame
+		if(nextImage->presentTimer != 0)
+			g_source_remove(nextImage->presentTimer);
+		nextImage->presentTimer = 0;
+		nextImagePresentReady(nextImage);
+		nextImage->presentTimer = gdk_threads_add_timeout(nextImage->options.intervalMS, &onNextImagePresentTick, (void*)nextImage);
+	}
+	else if(!strcmp(command, "preload"))
+	{
+		if(nextImage->sleepReasons != 0)
+		{
+			g_string_append(reply, "asleep");
+			return(0);
+		}
+		nextImageFetchNow(nextImage);
+	}
+	else if(!strcmp(command, "sleep") || !strcmp(command, "wake"))
+		nextImageSetSleep(nextImage, kNextImageSleepCommand, !strcmp(command, "sleep"));
+	else
+	{
+		g_string_append_printf(reply, "unknown command \"%s\"", command);
+		return(0);
+	}
+	return(1);
+}
+
+static void		controlStats(GPtrArray* outputs, GString* reply)
+{
+	DownloadPoolStats pool;
+	DownloadGetPoolStats(&pool);
+	unsigned int progress, results, decodeProgress, decodeResults;
+	DownloadDispatcherGetStats(0, &progress, &results);
+	ImageDownloadGetStats(&decodeProgress, &decodeResults);
+
+	g_string_append_printf(reply, "downloads %u\njobs %u\n", pool.downloads, pool.jobs);
+	g_string_append_printf(reply, "main_progress %u\nmain_results %u\ndecode_progress %u\ndecode_results %u\n", progress, results, decodeProgress, decodeResults);
+	g_string_append_printf(reply, "pool_in_use %u\npool_allocated %u\npool_peak %u\npool_high_water %u\npool_reused %u\npool_stalls %u\n",
+		pool.inUse, pool.allocated, pool.peak, pool.highWater, pool.reused, pool.stalls);
+
+	DownloadCacheStats cache;
+	DownloadGetCacheStats(&cache);
+	unsigned int frames;
+	size_t framesSize, framesCapacity;
+	FrameCacheGetStats(&frames, &framesSize, &framesCapacity);
+	g_string_append_printf(reply, "cache_entries %u\ncache_kb %lu\ncache_capacity_kb %lu\n", cache.entries, (unsigned long)(cache.size / 1024), (unsigned long)(cache.capacity / 1024));
+	g_string_append_printf(reply, "frames_entries %u\nframes_kb %lu\nframes_capacity_kb %lu\n", frames, (unsigned long)(framesSize / 1024), (unsigned long)(framesCapacity / 1024));
+
+	// resident now (from /proc), and at most
+	long residentPages = 0;
+	FILE* statm = fopen("/proc/self/statm", "r");
+	if(statm != 0)
+	{
+		if(fscanf(statm, "%*s %ld", &residentPages) != 1)
+			residentPages = 0;
+		fclose(statm);
+	}
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	gint64 pixelBytes, pixelPeak;
+	MetricsGetPixels(&pixelBytes, &pixelPeak);
+	g_string_append_printf(reply, "rss_kb %ld\npeak_rss_kb %ld\npixel_kb %" G_GINT64_FORMAT "\npixel_peak_kb %" G_GINT64_FORMAT "\n",
+		residentPages * (sysconf(_SC_PAGESIZE) / 1024), (long)usage.ru_maxrss, pixelBytes / 1024, pixelPeak / 1024);
+
+	unsigned int i;
+	for(i = 0; i < outputs->len; i++)
+	{
+		NextImageContext* nextImage = (NextImageContext*)g_ptr_array_index(outputs, i);
+		g_string_append_printf(reply, "output%u_url %s\noutput%u_monitor %i\noutput%u_size %ix%i\n",
+			i, nextImage->options.serviceURL, i, nextImage->geometry.monitor, i, nextImage->geometry.width, nextImage->geometry.height);
+		g_string_append_printf(reply, "output%u_state %s\noutput%u_ready %u\noutput%u_timed %u\noutput%u_spare %u\n",
+			i, (nextImage->sleepReasons != 0)? "asleep" : nextImage->fetching? "fetching" : "idle",
+			i, g_queue_get_length(&nextImage->readyFrames), i, g_queue_get_length(&nextImage->timedFrames), i, g_queue_get_length(&nextImage->spareBuffers));
+		g_string_append_printf(reply, "output%u_delay_ms %u\noutput%u_interval_ms %u\noutput%u_prefetch %u\n",
+			i, nextImage->options.delayMS, i, nextImage->options.intervalMS, i, nextImage->options.prefetchDepth);
+	}
+}
+
+// runs one command line, answering into 'reply'
+static void		controlCommand(GPtrArray* outputs, char* line, GString* reply)
+{
+	unsigned int first = 0, last = outputs->len, i;
+	DebugPrintf("*controlCommand \"%s\"\n", line);
+
+	if(line[0] == '@')
+	{
+		char* end = 0;
+		first = (unsigned int)strtoul(line + 1, &end, 10);
+		if((end == line + 1) || (first >= outputs->len))
+		{
+			g_string_append(reply, "error no such output\n");
+			return;
+		}
+		last = first + 1;
+		line = end;
+	}
+
+	gchar** words = g_strsplit(g_strstrip(line), " ", 2);
+	char const* command = (words[0] != 0)? words[0] : "";
+	char const* argument = ((words[0] != 0) && (words[1] != 0))? g_strstrip(words[1]) : 0;
+
+	GString* error = g_string_new(0);
+	int ok = 1;
+	if(!strcmp(command, "stats"))
+		controlStats(outputs, reply);
+	else if(!strcmp(command, "cache") && (argument != 0))
+	{
+		ok = DownloadSetCacheCapacity((unsigned int)strtoul(argument, 0, 10));
+		if(!ok)
+			g_string_append(error, "the disk cache is off");
+	}
+	else if(!strcmp(command, "frames") && (argument != 0))
+		FrameCacheSetCapacity((size_t)strtoul(argument, 0, 10) * 1024 * 1024);
+	else if(!strcmp(command, "trace"))
+	{
+#if defined(PIFRAME_TRACE)
+		char const* path = (argument != 0)? argument : TraceDefaultPath();
+		ok = TraceDump(path);
+		if(ok)
+			g_string_append_printf(reply, "trace %s\n", path);
+		else
+			g_string_append_printf(error, "can't write %s", path);
+#else
+		ok = 0;
+		g_string_append(error, "not built with PIFRAME_TRACE");
+#endif
+	}
+	else
+	{
+		for(i = first; (i < last) && ok; i++)
+			ok = controlOutputCommand((NextImageContext*)g_ptr_array_index(outputs, i), command, argument, error);
+	}
+
+	if(ok)
+		g_string_append(reply, "ok\n");
+	else
+		g_string_append_printf(reply, "error %s\n", error->str);
+	g_string_free(error, TRUE);
+	g_strfreev(words);
+}
+
+static void		controlClientFree(ControlClient* client)
+{
+	DebugPrintf("*controlClientFree %i\n", client->fd);
+	close(client->fd);
+	g_string_free(client->line, TRUE);
+	g_free(client);
+}
+
+// main thread: a client sent something (or hung up)
+static gboolean	onControlRead(gint fd, GIOCondition condition, gpointer user)
+{
+	(void)condition;
+	ControlClient* client = (ControlClient*)user;
+	char buffer[1024];
+	ssize_t length;
+
+	while((length = read(fd, buffer, sizeof(buffer))) > 0)
+	{
+		ssize_t i;
+		for(i = 0; i < length; i++)
+		{
+			if(buffer[i] != '\n')
+			{
+				g_string_append_c(client->line, buffer[i]);
+				continue;
+			}
+
+			GString* reply = g_string_new(0);
+			controlCommand(client->outputs, client->line->str, reply);
+			g_string_truncate(client->line, 0);
+
+			// (small replies: a client that doesn't read them loses the rest)
+			gsize sent = 0;
+			ssize_t written;
+			while((sent < reply->len) && ((written = send(fd, reply->str + sent, reply->len - sent, MSG_NOSIGNAL)) > 0))
+				sent += (gsize)written;
+			g_string_free(reply, TRUE);
+		}
+		if(client->line->len > kControlMaxLine)
+			break;
+	}
+
+	if((length >= 0) || ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR)))
+	{
+		controlClientFree(client);
+		return(G_SOURCE_REMOVE);
+	}
+	return(G_SOURCE_CONTINUE);
+}
+
+// main thread: a client connected
+static gboolean	onControlAccept(gint fd, GIOCondition condition, gpointer user)
+{
+	(void)condition;
+	int clientFD = accept(fd, 0, 0);
+	if(clientFD < 0)
+		return(G_SOURCE_CONTINUE);
+	g_unix_set_fd_nonblocking(clientFD, TRUE, 0);
+	fcntl(clientFD, F_SETFD, FD_CLOEXEC);
+
+	ControlClient* client = g_new(ControlClient, 1);
+	client->fd = clientFD;
+	client->outputs = (GPtrArray*)user;
+	client->line = g_string_new(0);
+	g_unix_fd_add(clientFD, G_IO_IN | G_IO_HUP | G_IO_ERR, &onControlRead, (gpointer)client);
+	DebugPrintf("*onControlAccept %i\n", clientFD);
+	return(G_SOURCE_CONTINUE);
+}
+
+// listens for control clients at 'path' (replacing a socket left there), readable by this user only
+static void		controlInit(char const* path, GPtrArray* outputs)
+{
+	struct sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	if(strlen(path) >= sizeof(address.sun_path))
+	{
+		g_warning("Control socket path too long: \"%s\"", path);
+		return;
+	}
+	strcpy(address.sun_path, path);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	struct stat info;
+	if((lstat(path, &info) == 0) && S_ISSOCK(info.st_mode))
+		unlink(path);	// (from a previous run)
+
+	mode_t mask = umask(0077);
+	int ok = (fd >= 0) && (bind(fd, (struct sockaddr*)&address, sizeof(address)) == 0) && (listen(fd, kControlBacklog) == 0);
+	umask(mask);
+
+	if(!ok)
+	{
+		g_warning("Can't listen for control at \"%s\": %s", path, g_strerror(errno));
+		if(fd >= 0)
+			close(fd);
+		return;
+	}
+	g_unix_fd_add(fd, G_IO_IN, &onControlAccept, (gpointer)outputs);
+	DebugPrintf("*controlInit listening at %s\n", path);
 }
 
 
@@ -622,167 +7080,287 @@ void				onImageDownloadComplete(DownloadOptions const* download, int result, cha
 ////////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////
 //
-// PiFrame application: requests images from a HTTP server and
-//   scales them to fill the screen.  After each image is
-//   downloaded and displayed, the application makes the next
-//   request immediately.  Therefore, timing is controlled by
-//   the HTTP server, which can wait for some time with an open
-//   connection before sending the image data.  Crucially, this
-//   allows for simple, flexible central coordination of many
-//   PiFrame instances.
-//
-// The application uses two GtkImage widgets that each fill the
-//   screen - one behind and one in front.  The widget behind
-//   is filled with new image data when a download is complete,
-//   the two widgets are swapped in z-order then the cycle
-//   starts again.
+// Benchmark (build with -DPIFRAME_BENCHMARK): replays a
+//   directory of photos through the real pipeline - Download
+//   (as file:// URLs, so the chunking, pool and dispatch are the
+//   same as for HTTP), ImageDownload's decode thread and decoder,
+//   then scaleToFill() - once per target resolution, with no
+//   server and no display.  Reports throughput, per-stage p50
+//   and p99 latencies and peak memory.
 //
-// The screen-filling policy chosen crops part of the source
-//   image (if necessary) in order to ensure all screen pixels
-//   are filled.
+// ./piframe-bench [-r 1920x1080,1280x720] [-n repeats] [-s] [-k kernel] [-j threads] [-H device] [-P megapixels] <directory>
 //
 ////////////////////////////////////////////////////////////////
 
+#if defined(PIFRAME_BENCHMARK)
 
-GdkPixbuf*	scaleToFillScreen(GdkPixbuf* pixels)
+typedef enum BenchmarkStage
 {
-	DebugPrintf("+scaleToFillScreen\n");
-	
-	// calculate scale and crop dimensions
-	GdkScreen* screen = gdk_screen_get_default();
-	
-	int		screenWidth = gdk_screen_get_width(screen),
-			screenHeight = gdk_screen_get_height(screen);
+	kBenchmarkStageTransfer = 0,	// request to last byte (file:// read)
+	kBenchmarkStageQueue,			// chunks and result waiting for the decode thread
+	kBenchmarkStageDecode,
+	kBenchmarkStageScale,
+	kBenchmarkStageTotal,			// request to scaled frame
+	kBenchmarkStageCount,
 
-	double	scale, xOff, yOff,
-			pWidth = (double)gdk_pixbuf_get_width(pixels),
-			pHeight = (double)gdk_pixbuf_get_height(pixels),
-			pAspect = pWidth / pHeight;
+} BenchmarkStage;
 
-	if(pAspect < ((double)screenWidth / (double)screenHeight))
-	{
-		scale = (double)screenWidth / pWidth;
-		yOff = ((scale * pHeight) - (double)screenHeight) / -2.0;
-		xOff = 0.0;
-	}
-	else
-	{
-		scale = ((double)screenHeight / pHeight);
-		xOff = ((scale * pWidth) - (double)screenWidth) / -2.0;
-		yOff = 0.0;
-	}
+static char const* const	kBenchmarkStageNames[kBenchmarkStageCount] = {"transfer", "queue", "decode", "scale", "total"};
 
-	GdkPixbuf* scaledPixels = gdk_pixbuf_new(gdk_pixbuf_get_colorspace(pixels), FALSE, gdk_pixbuf_get_bits_per_sample(pixels), screenWidth, screenHeight);
-	gdk_pixbuf_scale(	pixels, scaledPixels,
-						0, 0, screenWidth, screenHeight,
-						xOff, yOff, scale, scale,
-						GDK_INTERP_BILINEAR
-					);
+static struct
+{
+	GMainLoop*		loop;
+	GPtrArray*		urls;
+	unsigned int	repeats;
+	int				streaming;
 
-	DebugPrintf("-scaleToFillScreen\n");
-	return(scaledPixels);
-}
+	int				width;		// current target resolution
+	int				height;
+	GdkPixbuf*		buffer;		// screen-sized, reused
 
+	unsigned int	next;		// index of the next photo (over all repeats)
+	unsigned int	failures;
+	gint64			bytes;
+	gint64			started;	// current photo
+	Metrics			metrics;	// current photo
+	GArray*			samples[kBenchmarkStageCount];	// gint64 microseconds
 
-typedef struct AppOptions
-{
-	char const*		serviceURL;
-	unsigned int	delayMS;
+} gBenchmark;
 
-} AppOptions;
+static void		benchmarkNext(void);
 
-typedef struct NextImageContext
+static gint		benchmarkCompareSamples(gconstpointer a, gconstpointer b)
 {
-	AppOptions		options;
-
-	GtkWidget*		newImage;
-	GdkPixbuf*		newSourcePixbuf;
+	gint64 sampleA = *(gint64 const*)a, sampleB = *(gint64 const*)b;
+	return((sampleA > sampleB) - (sampleA < sampleB));
+}
 
-	GtkWidget*		previousImage;
-	GdkPixbuf*		previousSourcePixbuf;	// the previous unscaled pixbuf used to fill the previous image
+// nearest-rank percentile of sorted samples
+static gint64	benchmarkPercentile(GArray* samples, double percentile)
+{
+	if(samples->len == 0)
+		return(0);
 
-	ImageDownload*	currentDownload;
+	unsigned int rank = (unsigned int)ceil(percentile / 100.0 * samples->len);
+	return(g_array_index(samples, gint64, MAX(rank, 1) - 1));
+}
 
-} NextImageContext;
+static void		onBenchmarkComplete(void* context, GdkPixbuf* pixels, char const* hash, GError* error, Metrics const* metrics)
+{
+	(void)context;
+	(void)hash;
+	gBenchmark.metrics = *metrics;
 
+	if(pixels == 0)
+	{
+		fprintf(stderr, "%s: %s\n", (char const*)g_ptr_array_index(gBenchmark.urls, (gBenchmark.next - 1) % gBenchmark.urls->len), (error != 0)? error->message : "no image");
+		gBenchmark.failures++;
+		benchmarkNext();
+		return;
+	}
 
-static gboolean		onNextDownloadDelay(gpointer user);
+	gint64 start = g_get_monotonic_time();
+	scaleToFill(pixels, gBenchmark.buffer);
+	gint64 end = g_get_monotonic_time();
 
-void	onNextDownloadComplete(void* context, GdkPixbuf* pixels, GError* error)
-{
-	DebugPrintf("+onNextDownloadComplete\n");
-	NextImageContext* nextImage = (NextImageContext*)context;
+	gint64 samples[kBenchmarkStageCount] =
+	{
+		[kBenchmarkStageTransfer] = gBenchmark.metrics.ttfbUS + gBenchmark.metrics.transferUS,
+		[kBenchmarkStageQueue] = gBenchmark.metrics.queueUS,
+		[kBenchmarkStageDecode] = gBenchmark.metrics.decodeUS,
+		[kBenchmarkStageScale] = end - start,
+		[kBenchmarkStageTotal] = end - gBenchmark.started,
+	};
+	int stage;
+	for(stage = 0; stage < kBenchmarkStageCount; stage++)
+		g_array_append_val(gBenchmark.samples[stage], samples[stage]);
 
-	int minimumDelay = nextImage->options.delayMS;
+	gBenchmark.bytes += gBenchmark.metrics.bytes;
+	benchmarkNext();
+}
 
-	if(pixels != 0)
+static void		benchmarkNext(void)
+{
+	if(gBenchmark.next == gBenchmark.urls->len * gBenchmark.repeats)
 	{
-		DebugPrintf("+onNextDownloadComplete (pixels != 0)\n");
-
-		// release old pixmap (last photo)
-		g_object_unref(nextImage->previousSourcePixbuf);
+		g_main_loop_quit(gBenchmark.loop);
+		return;
+	}
 
-		nextImage->newSourcePixbuf = pixels;
-		g_object_ref(nextImage->newSourcePixbuf);
+	ImageDownloadOptions options =
+	{
+		.url = (char const*)g_ptr_array_index(gBenchmark.urls, gBenchmark.next % gBenchmark.urls->len),
+		.completeCallback = &onBenchmarkComplete,
+		.streaming = gBenchmark.streaming,
+		.targetWidth = gBenchmark.width,
+		.targetHeight = gBenchmark.height,
+		.metrics = 1,
+	};
 
-		GdkPixbuf* scaledPixels = scaleToFillScreen(pixels);
+	gBenchmark.next++;
+	gBenchmark.started = g_get_monotonic_time();
+	ImageDownloadNew(&options);
+}
 
-		gtk_image_set_from_pixbuf(GTK_IMAGE(nextImage->newImage), scaledPixels);
-		g_object_unref(scaledPixels);
+static void		benchmarkRun(int width, int height)
+{
+	int stage;
+
+	gBenchmark.width = width;
+	gBenchmark.height = height;
+	gBenchmark.buffer = gdk_pixbuf_new(GDK_COLORSPACE_RGB, FALSE, 8, width, height);
+	MetricsTrackPixels(gBenchmark.buffer);
+	gBenchmark.next = 0;
+	gBenchmark.failures = 0;
+	gBenchmark.bytes = 0;
+	for(stage = 0; stage < kBenchmarkStageCount; stage++)
+		gBenchmark.samples[stage] = g_array_new(FALSE, FALSE, sizeof(gint64));
+
+	gint64 start = g_get_monotonic_time();
+	benchmarkNext();
+	g_main_loop_run(gBenchmark.loop);
+	double seconds = (double)(g_get_monotonic_time() - start) / 1e6;
+
+	unsigned int count = gBenchmark.samples[kBenchmarkStageTotal]->len;
+	printf("%ix%i: %u photos (%u failed) in %.2f s, %.2f photos/s, %.2f MB/s in\n", width, height, count, gBenchmark.failures, seconds, count / seconds, gBenchmark.bytes / seconds / 1e6);
+	printf("    %-10s %10s %10s %10s   (ms)\n", "stage", "p50", "p99", "max");
+
+	for(stage = 0; stage < kBenchmarkStageCount; stage++)
+	{
+		GArray* samples = gBenchmark.samples[stage];
+		g_array_sort(samples, &benchmarkCompareSamples);
+		printf("    %-10s %10.2f %10.2f %10.2f\n", kBenchmarkStageNames[stage],
+			benchmarkPercentile(samples, 50.0) / 1e3, benchmarkPercentile(samples, 99.0) / 1e3, benchmarkPercentile(samples, 100.0) / 1e3);
+		g_array_free(samples, TRUE);
+	}
 
-		// reorder widget Z-order so that 'nextImage->newImage' is above 'nextImage->previousImage'
-		GdkWindow* newImageWindow = gtk_widget_get_parent_window(nextImage->newImage);
-		GdkWindow* previousImageWindow = gtk_widget_get_parent_window(nextImage->previousImage);
-		gdk_window_restack(newImageWindow, previousImageWindow, TRUE);
+	g_object_unref(gBenchmark.buffer);
+}
 
-		// swap widget references
-		GtkWidget* temp = nextImage->previousImage;
-		nextImage->previousImage = nextImage->newImage;
-		nextImage->newImage = temp;
+static int		benchmarkMain(int argc, char** argv)
+{
+	char const* resolutions = "1920x1080";
+	ScaleOptions scale = {.kernel = kScaleKernelSIMD, .threads = 0};
+	ImageDownloadInitOptions imageDownloadInitOptions = {.decodeDevice = 0};
+	int c;
 
-		// the current photo is the new old photo (reference conserved)
-		nextImage->previousSourcePixbuf = nextImage->newSourcePixbuf;
-		nextImage->newSourcePixbuf = 0;
+	gBenchmark.repeats = 1;
+	gBenchmark.streaming = 0;
 
-		DebugPrintf("-onNextDownloadComplete (pixels != 0)\n");
+	optind = 1;
+	while((c = getopt(argc, argv, "r:n:sk:j:H:P:")) != -1)
+	{
+		switch(c)
+		{
+		case 'r':	// target resolutions
+			resolutions = optarg;
+			break;
+		case 'n':	// passes over the corpus
+			gBenchmark.repeats = MAX(atoi(optarg), 1);
+			break;
+		case 's':	// streaming decode
+			gBenchmark.streaming = 1;
+			break;
+		case 'k':	// scale kernel
+			scale.kernel = !strcmp(optarg, "scalar")? kScaleKernelScalar : !strcmp(optarg, "gdk")? kScaleKernelGdk : kScaleKernelSIMD;
+			break;
+		case 'j':	// scale threads
+			scale.threads = atoi(optarg);
+			break;
+		case 'H':	// hardware JPEG decoder
+			imageDownloadInitOptions.decodeDevice = optarg;
+			break;
+		case 'P':	// pixel ceiling (megapixels)
+			imageDownloadInitOptions.maxPixels = (gint64)(MAX(atof(optarg), 0.0) * 1e6);
+			break;
+		}
 	}
-	else
+
+	if(optind >= argc)
 	{
-		DebugPrintf("+onNextDownloadComplete (pixels == 0) error\n");
+		fprintf(stderr, "usage: %s [-r WxH[,WxH...]] [-n repeats] [-s] [-k simd|scalar|gdk] [-j threads] [-H device] [-P megapixels] <directory>\n", argv[0]);
+		return(1);
+	}
 
-		// handle *error
-		DebugPrintf("*onNextDownloadComplete: download error, no photo update.\n");
+	// the corpus: every JPEG and PNG in the directory, as file:// URLs
+	GError* error = 0;
+	GDir* directory = g_dir_open(argv[optind], 0, &error);
+	if(directory == 0)
+	{
+		fprintf(stderr, "%s\n", error->message);
+		return(1);
+	}
 
-		minimumDelay = 10000;	// 10 seconds
+	char* base = realpath(argv[optind], 0);	// (file: URLs need an absolute path)
+	if(base == 0)
+	{
+		fprintf(stderr, "can't resolve %s\n", argv[optind]);
+		g_dir_close(directory);
+		return(1);
+	}
+	gBenchmark.urls = g_ptr_array_new();
+	char const* name;
+	while((name = g_dir_read_name(directory)) != 0)
+	{
+		char* lower = g_ascii_strdown(name, -1);
+		if(g_str_has_suffix(lower, ".jpg") || g_str_has_suffix(lower, ".jpeg") || g_str_has_suffix(lower, ".png"))
+		{
+			char* path = g_build_filename(base, name, NULL);
+			g_ptr_array_add(gBenchmark.urls, g_filename_to_uri(path, 0, 0));
+			g_free(path);
+		}
+		g_free(lower);
+	}
+	g_dir_close(directory);
+	free(base);
 
-		DebugPrintf("-onNextDownloadComplete (pixels == 0) error\n");
-		// we continue, essentially repeating the download (widgets don't swap)
+	if(gBenchmark.urls->len == 0)
+	{
+		fprintf(stderr, "no JPEG or PNG files in %s\n", argv[optind]);
+		return(1);
 	}
 
-	// kick off next download
+	DownloadInitOptions downloadInitOptions = {.poolHighWater = 0};	// (no disk cache: every photo is decoded)
+	DownloadInit(&downloadInitOptions);
+	ImageDownloadInit(&imageDownloadInitOptions);
+	ScaleInit(&scale);
 
-	gdk_threads_add_timeout(minimumDelay, &onNextDownloadDelay, (void*)nextImage);
-	DebugPrintf("-onNextDownloadComplete\n");
-}
+	gBenchmark.loop = g_main_loop_new(0, FALSE);
+	if(!g_thread_new("curl-thread", &curlThread, 0))
+		return(1);
 
-static gboolean		onNextDownloadDelay(gpointer user)
-{
-	(void)user;
-	DebugPrintf("+onNextDownloadDelay\n");
-	NextImageContext* nextImage = (NextImageContext*)user;
+	printf("%u photos, %u pass(es), %s decode, %s scaler\n", gBenchmark.urls->len, gBenchmark.repeats, gBenchmark.streaming? "streaming" : "chunked",
+		(scale.kernel == kScaleKernelScalar)? "scalar" : (scale.kernel == kScaleKernelGdk)? "gdk" : "simd");
 
-	ImageDownloadOptions downloadOptions =
+	gchar** sizes = g_strsplit(resolutions, ",", -1);
+	int i;
+	for(i = 0; sizes[i] != 0; i++)
 	{
-		.url = nextImage->options.serviceURL,
-		.completeCallback = &onNextDownloadComplete,
-		.context = nextImage,
-	};
-	nextImage->currentDownload = ImageDownloadNew(&downloadOptions);
-
-	DebugPrintf("-onNextDownloadDelay\n");
-	return(FALSE);	// don't repeat, 1-shot only
+		int width = 0, height = 0;
+		if((sscanf(sizes[i], "%ix%i", &width, &height) == 2) && (width > 0) && (height > 0))
+			benchmarkRun(width, height);
+		else
+			fprintf(stderr, "Warning: bad resolution ignored: \"%s\"\n", sizes[i]);
+	}
+	g_strfreev(sizes);
+
+	DownloadPoolStats pool;
+	DownloadGetPoolStats(&pool);
+
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	gint64 pixelBytes, pixelPeak;
+	MetricsGetPixels(&pixelBytes, &pixelPeak);
+	printf("peak RSS %li KiB, pixel buffers peak %" G_GINT64_FORMAT " KiB, chunk pool peak %u of %u, %u stalls\n",
+		(long)usage.ru_maxrss, pixelPeak / 1024, pool.peak, pool.highWater, pool.stalls);
+#if defined(PIFRAME_TRACE)
+	if(TraceDump(TraceDefaultPath()))
+		printf("trace written to %s\n", TraceDefaultPath());
+#endif
+	return(0);
 }
 
+#endif	// PIFRAME_BENCHMARK
 
 
 void	parseOptions(AppOptions* outOptions, int argc, char** argv)
@@ -790,43 +7368,210 @@ void	parseOptions(AppOptions* outOptions, int argc, char** argv)
 	optind = 1;
 
 	int c, i, haveURL = 0;
-	while((c = getopt(argc, argv, "d:")) != -1)
+	while((c = getopt(argc, argv, "d:c:sn:i:k:j:gt:T:C:M:F:mplL:H:P:vx:aU:S:w:o:K:")) != -1)
 	{
 		switch(c)
 		{
 		case 'd':	// delay
 			outOptions->delayMS =  atoi(optarg);
 			break;
+		case 'c':	// chunk pool high-water mark (in 128 KiB chunks)
+			outOptions->poolHighWater = atoi(optarg);
+			break;
+		case 's':	// streaming (zero-copy) decode
+			outOptions->streaming = 1;
+			break;
+		case 'n':	// prefetch depth
+			outOptions->prefetchDepth = atoi(optarg);
+			break;
+		case 'i':	// presentation interval (prefetch mode)
+			outOptions->intervalMS = atoi(optarg);
+			break;
+		case 'k':	// scale kernel
+			if(!strcmp(optarg, "simd"))
+				outOptions->scale.kernel = kScaleKernelSIMD;
+			else if(!strcmp(optarg, "scalar"))
+				outOptions->scale.kernel = kScaleKernelScalar;
+			else if(!strcmp(optarg, "gdk"))
+				outOptions->scale.kernel = kScaleKernelGdk;
+			else
+				fprintf(stderr, "Warning: unknown scale kernel ignored: \"%s\"\n", optarg);
+			break;
+		case 'j':	// scale threads
+			outOptions->scale.threads = atoi(optarg);
+			break;
+		case 'g':	// GL renderer
+#if defined(PIFRAME_GL)
+			outOptions->useGL = 1;
+#else
+			fprintf(stderr, "Warning: -g ignored, this build has no GL renderer (build with -DPIFRAME_GL)\n");
+#endif
+			break;
+		case 'H':	// hardware JPEG decoder
+#if defined(PIFRAME_V4L2)
+			outOptions->decodeDevice = optarg;
+#else
+			fprintf(stderr, "Warning: -H ignored, this build has no V4L2 decoder (build with -DPIFRAME_V4L2)\n");
+#endif
+			break;
+		case 'P':	// pixel ceiling
+			outOptions->maxMegapixels = MAX(atof(optarg), 0.0);
+			break;
+		case 'v':	// progressive preview
+			outOptions->preview = 1;
+			break;
+		case 'a':	// client hints
+			outOptions->clientHints = 1;
+			break;
+		case 'U':	// LAN peers
+			outOptions->peers = optarg;
+			break;
+		case 'S':	// serve the cache to peers: [address:]port, the address bracketed if it's IPv6
+			{
+				char const* colon = strrchr(optarg, ':');
+				outOptions->peerPort = (unsigned int)atoi((colon != 0)? colon + 1 : optarg);
+				outOptions->peerAddress = 0;
+				if(colon != 0)
+				{
+					char const* host = optarg;
+					size_t length = (size_t)(colon - optarg);
+					if((length >= 2) && (host[0] == '[') && (host[length - 1] == ']'))
+					{
+						host++;
+						length -= 2;
+					}
+					outOptions->peerAddress = g_strndup(host, length);	// (kept for the process)
+				}
+			}
+			break;
+		case 't':	// transition
+			if(!strcmp(optarg, "none"))
+				outOptions->transition = kTransitionNone;
+			else if(!strcmp(optarg, "fade"))
+				outOptions->transition = kTransitionFade;
+			else if(!strcmp(optarg, "slide"))
+				outOptions->transition = kTransitionSlide;
+			else
+				fprintf(stderr, "Warning: unknown transition ignored: \"%s\"\n", optarg);
+			break;
+		case 'T':	// transition duration
+			outOptions->transitionMS = atoi(optarg);
+			break;
+		case 'C':	// cache directory
+			outOptions->cacheDirectory = optarg;
+			break;
+		case 'M':	// cache size cap
+			outOptions->cacheMB = atoi(optarg);
+			break;
+		case 'F':	// frame cache size cap
+			outOptions->frameCacheMB = atoi(optarg);
+			break;
+		case 'm':	// frame cache on disk (memory-mapped)
+			outOptions->frameCacheOnDisk = 1;
+			break;
+		case 'p':	// push stream
+			outOptions->push = 1;
+			break;
+		case 'o':	// outputs
+			outOptions->outputs = optarg;
+			break;
+		case 'w':	// display power check interval
+			outOptions->displayPollS = (unsigned int)atoi(optarg);
+			break;
+		case 'l':	// manifest
+			outOptions->manifest = 1;
+			break;
+		case 'L':	// metrics log
+			outOptions->metricsPath = optarg;
+			break;
+		case 'K':	// control socket
+			outOptions->controlPath = optarg;
+			break;
+		case 'x':	// timeouts: connect[,stall[,total]] in seconds
+			{
+				unsigned int* timeouts[] = {&outOptions->connectTimeoutMS, &outOptions->stallTimeoutMS, &outOptions->totalTimeoutMS};
+				char** values = g_strsplit(optarg, ",", 3);
+				int t;
+				for(t = 0; (t < 3) && (values[t] != 0); t++)
+				{
+					if(values[t][0] != 0)
+						*timeouts[t] = (unsigned int)(MAX(atof(values[t]), 0.0) * 1000.0);
+				}
+				g_strfreev(values);
+			}
+			break;
 		}
 	}
 
+	if(outOptions->manifest && outOptions->push)
+	{
+		fprintf(stderr, "Warning: -p ignored, a manifest lists photos to fetch one by one\n");
+		outOptions->push = 0;
+	}
+	if(outOptions->manifest && (outOptions->prefetchDepth == 0))
+		outOptions->prefetchDepth = kManifestPrefetchDepth;
+
+	if(outOptions->preview && ((outOptions->prefetchDepth > 0) || outOptions->push || outOptions->useGL))
+	{
+		fprintf(stderr, "Warning: -v ignored, previews need no -n, -l, -p or -g\n");
+		outOptions->preview = 0;
+	}
+
+	// (one URL per output, see -o)
 	for(i = optind; i < argc; i++)
 	{
 		if(!haveURL)
 		{
 			outOptions->serviceURL = argv[i];
+			outOptions->serviceURLs = argv + i;
 			haveURL = 1;
 		}
-		else
-			fprintf(stderr, "Warning: extra argument ignored: \"%s\"\n", argv[i]);
+		outOptions->serviceURLCount++;
 	}
 }
 
-int		main(int argc, char** argv)
+// The monitors -o asks for ("all", or numbers separated by commas), as
+//   GDK numbers them; without -o, the whole screen is one output.
+static GArray*		outputMonitorsNew(char const* outputs)
 {
-	// specify defaults options here
-	AppOptions options =
-	{
-		.serviceURL = "",
-		.delayMS = 1,
-	};
-	parseOptions(&options, argc, argv);
+	GArray* monitors = g_array_new(FALSE, FALSE, sizeof(int));
+	int count = gdk_screen_get_n_monitors(gdk_screen_get_default());
+	int m;
 
-	DownloadInit();
+	if((outputs != 0) && !strcmp(outputs, "all"))
+	{
+		for(m = 0; m < count; m++)
+			g_array_append_val(monitors, m);
+	}
+	else if(outputs != 0)
+	{
+		gchar** numbers = g_strsplit(outputs, ",", -1);
+		int i;
+		for(i = 0; numbers[i] != 0; i++)
+		{
+			char* end = 0;
+			m = (int)strtol(numbers[i], &end, 10);
+			if((end != numbers[i]) && (*end == 0) && (m >= 0) && (m < count))
+				g_array_append_val(monitors, m);
+			else
+				fprintf(stderr, "Warning: no monitor \"%s\" (of %i), ignored\n", numbers[i], count);
+		}
+		g_strfreev(numbers);
+	}
 
-	gtk_init(&argc, &argv);
+	if(monitors->len == 0)
+	{
+		m = kScreenWhole;
+		g_array_append_val(monitors, m);
+	}
+	return(monitors);
+}
 
-	// Create the main, top level window
+// Sets up an output filling 'monitor' (or kScreenWhole) with photos
+//   from 'url': its window, showing the startup screen, and its context.
+static NextImageContext*	nextImageNew(AppOptions const* options, int monitor, char const* url)
+{
+	// Create the output's top level window
 	GtkWidget* window = gtk_window_new(GTK_WINDOW_TOPLEVEL);
 
 	// Give it the title
@@ -843,41 +7588,229 @@ int		main(int argc, char** argv)
 	//   stop the main GTK+ loop by returning 0
 	g_signal_connect(window, "destroy", G_CALLBACK(gtk_main_quit), NULL);
 
-	// load the pixels for the startup screen from a local file
-	GError* err = 0;
-	GdkPixbuf* startupPixels = gdk_pixbuf_new_from_file("startup.jpg", &err);
+	// set up the download
+	NextImageContext* context = malloc(sizeof(NextImageContext));
+
+	// inherit the app options
+	memcpy(&context->options, options, sizeof(AppOptions));
+	context->options.serviceURL = url;
+
+	memset(&context->geometry, 0, sizeof(context->geometry));
+	context->geometry.monitor = monitor;
+	ScreenGeometryUpdate(&context->geometry);
+	context->window = window;
+
+	// decode the (built-in) startup screen at the output's size
+	GdkPixbuf* startupPixels = startupPixelsNew(&context->geometry);
+
+	context->previousImage = 0;
+	context->newImage = 0;
+	context->previousBuffer = 0;
+	context->newBuffer = 0;
+	g_queue_init(&context->spareBuffers);
+	
+	context->currentDownload = 0;
+	context->currentStream = 0;
+	context->presentStart = 0;
+	context->fetching = 0;
+	context->fetchTimer = 0;
+	context->frameMissed = 0;
+	context->networkHandler = 0;
+	context->networkTimer = 0;
+	context->controlURL = 0;
+	context->sleepReasons = 0;
+
+	g_queue_init(&context->readyFrames);
+	context->presentTimer = 0;
+	context->presentPending = 1;	// the first photo replaces the startup screen as soon as it's ready
+
+	context->presentTime = 0;
+	g_queue_init(&context->timedFrames);
+	context->timedTimer = 0;
+	context->presentDue = 0;
+
+	context->playlist = 0;
+	context->playlistNext = 0;
+	context->playlistClock = 0;
+	context->entryMS = 0;
+	context->manifest = 0;
+	context->manifestStale = 0;
+
+	context->previewSource = 0;
+	context->previewing = 0;
+
+	context->transitionFrame = 0;
+	context->blendBuffer = 0;
+	context->transitionTick = 0;
+	context->transitionStart = 0;
+	context->transitionSkip = 0;
+
+	ScreenGeometry const* geometry = &context->geometry;
+#if defined(PIFRAME_GL)
+	context->gl = 0;
+	if(options->useGL)
+	{
+		// a single GL area fills the window; the GPU scales and crops
+		context->gl = GLRendererNew(options->transition, options->transitionMS);
+		gtk_container_add(GTK_CONTAINER(window), context->gl->area);
+		gtk_widget_set_size_request(context->gl->area, geometry->width, geometry->height);
+		GLRendererShow(context->gl, startupPixels);
+	}
+	else
+#endif
+	{
+		// each widget owns its own screen-sized buffer from here on
+		GdkPixbuf* topBuffer = scaleToFillScreen(startupPixels, geometry);
+		GdkPixbuf* bottomBuffer = gdk_pixbuf_copy(topBuffer);
+		GtkWidget* topImage = gtk_image_new_from_pixbuf(topBuffer);
+		GtkWidget* bottomImage = gtk_image_new_from_pixbuf(bottomBuffer);
 
-	GdkPixbuf* scaledPixels = scaleToFillScreen(startupPixels);
-	GtkWidget* topImage = gtk_image_new_from_pixbuf(scaledPixels);
-	GtkWidget* bottomImage = gtk_image_new_from_pixbuf(scaledPixels);
-	g_object_unref(scaledPixels);
+		GtkWidget* fixedContainer = gtk_fixed_new();
 
-	GtkWidget* fixedContainer = gtk_fixed_new();
+		gtk_container_add(GTK_CONTAINER(window), fixedContainer);
+		gtk_fixed_put(GTK_FIXED(fixedContainer), bottomImage, 0, 0);
+		gtk_fixed_put(GTK_FIXED(fixedContainer), topImage, 0, 0);
 
-	gtk_container_add(GTK_CONTAINER(window), fixedContainer);
-	gtk_fixed_put(GTK_FIXED(fixedContainer), bottomImage, 0, 0);
-	gtk_fixed_put(GTK_FIXED(fixedContainer), topImage, 0, 0);
+		gtk_widget_set_size_request(topImage, geometry->width, geometry->height);
+		gtk_widget_set_size_request(bottomImage, geometry->width, geometry->height);
 
-	
-	GdkScreen* screen = gdk_screen_get_default();
-	
-	int		screenWidth = gdk_screen_get_width(screen),
-			screenHeight = gdk_screen_get_height(screen);
+		context->previousImage = bottomImage;
+		context->newImage = topImage;
+		g_object_ref(context->previousImage);
+		g_object_ref(context->newImage);
+
+		context->previousBuffer = bottomBuffer;	// (keeps references)
+		context->newBuffer = topBuffer;
+	}
+	g_object_unref(startupPixels);	// (scaled, or held by the GL renderer until uploaded)
 
-	gtk_widget_set_size_request(topImage, screenWidth, screenHeight);
-	gtk_widget_set_size_request(bottomImage, screenWidth, screenHeight);
+	GdkScreen* screen = gdk_screen_get_default();
+	g_signal_connect(screen, "size-changed", G_CALLBACK(&onNextImageScreenChanged), (gpointer)context);
+	g_signal_connect(screen, "monitors-changed", G_CALLBACK(&onNextImageScreenChanged), (gpointer)context);
 
-	// make everything visible
+	// make everything visible, on its own monitor
+	if(monitor != kScreenWhole)
+		gtk_window_move(GTK_WINDOW(window), geometry->x, geometry->y);
 	gtk_widget_show_all(window);
 
-	gtk_window_fullscreen(GTK_WINDOW(window));
+	if(MetricsEnabled())
+		g_signal_connect(gtk_widget_get_frame_clock(window), "after-paint", G_CALLBACK(&onNextImageAfterPaint), (gpointer)context);
+
+	if(monitor != kScreenWhole)
+		gtk_window_fullscreen_on_monitor(GTK_WINDOW(window), screen, monitor);
+	else
+		gtk_window_fullscreen(GTK_WINDOW(window));
 
 	GdkCursor* noCursor = gdk_cursor_new_for_display(gdk_display_get_default(), GDK_BLANK_CURSOR);
-	gdk_window_set_cursor(gtk_widget_get_parent_window(fixedContainer), noCursor);
-	gdk_window_set_cursor(gtk_widget_get_parent_window(bottomImage), noCursor);
-	gdk_window_set_cursor(gtk_widget_get_parent_window(topImage), noCursor);
+	gdk_window_set_cursor(gtk_widget_get_window(window), noCursor);
+	if(context->newImage != 0)
+	{
+		gdk_window_set_cursor(gtk_widget_get_parent_window(context->newImage), noCursor);
+		gdk_window_set_cursor(gtk_widget_get_parent_window(context->previousImage), noCursor);
+	}
+	g_object_unref(noCursor);
+
+	return(context);
+}
+
+int		main(int argc, char** argv)
+{
+#if defined(PIFRAME_BENCHMARK)
+	return(benchmarkMain(argc, argv));
+#endif
+
+	// specify defaults options here
+	AppOptions options =
+	{
+		.serviceURL = "",
+		.serviceURLs = 0,
+		.serviceURLCount = 0,
+		.outputs = 0,
+		.delayMS = 1,
+		.poolHighWater = 0,	// (Download default)
+		.streaming = 0,
+		.prefetchDepth = 0,
+		.intervalMS = kDefaultPrefetchIntervalMS,
+		.push = 0,
+		.displayPollS = 0,
+		.manifest = 0,
+		.preview = 0,
+		.scale =
+		{
+			.kernel = kScaleKernelSIMD,
+			.threads = 0,	// (one band per processor)
+		},
+		.useGL = 0,
+		.decodeDevice = 0,
+		.maxMegapixels = 0,
+		.clientHints = 0,
+		.peers = 0,
+		.peerPort = 0,
+		.peerAddress = 0,
+		.transition = kTransitionNone,
+		.transitionMS = kDefaultTransitionMS,
+		.cacheDirectory = 0,
+		.cacheMB = kDefaultCacheCapacity / (1024 * 1024),
+		.frameCacheMB = 0,
+		.frameCacheOnDisk = 0,
+		.metricsPath = 0,
+		.controlPath = 0,
+		.connectTimeoutMS = kDefaultConnectTimeoutMS,
+		.stallTimeoutMS = kDefaultStallTimeoutMS,
+		.totalTimeoutMS = 0,	// (the server can hold a request as long as it likes)
+	};
+	parseOptions(&options, argc, argv);
+
+	char* cacheDirectory = (options.cacheDirectory != 0)? g_strdup(options.cacheDirectory) : g_build_filename(g_get_user_cache_dir(), "piframe", NULL);
+
+	DownloadInitOptions downloadInitOptions =
+	{
+		.poolHighWater = options.poolHighWater,
+		.cacheDirectory = cacheDirectory,
+		.cacheCapacity = (size_t)options.cacheMB * 1024 * 1024,
+		.connectTimeoutMS = options.connectTimeoutMS,
+		.stallTimeoutMS = options.stallTimeoutMS,
+		.totalTimeoutMS = options.totalTimeoutMS,
+		.peers = options.peers,
+		.peerPort = options.peerPort,
+		.peerAddress = options.peerAddress,
+	};
+	MetricsInit(options.metricsPath);
+	DownloadInit(&downloadInitOptions);
+
+	char* frameCacheDirectory = g_build_filename(cacheDirectory, "frames", NULL);
+	FrameCacheOptions frameCacheOptions =
+	{
+		.capacity = (size_t)options.frameCacheMB * 1024 * 1024,
+		.directory = options.frameCacheOnDisk? frameCacheDirectory : 0,
+	};
+	FrameCacheInit(&frameCacheOptions);
+
+	ImageDownloadInitOptions imageDownloadInitOptions =
+	{
+		.decodeDevice = options.decodeDevice,
+		.maxPixels = (gint64)(options.maxMegapixels * 1e6),
+		.clientHints = options.clientHints,
+	};
+	ImageDownloadInit(&imageDownloadInitOptions);
+	ScaleInit(&options.scale);
+
+	gtk_init(&argc, &argv);
+
+	// one output (a NextImageContext and its window) per monitor asked for,
+	//   all of them sharing the download, decode and cache subsystems
+	GArray* monitors = outputMonitorsNew(options.outputs);
+	GPtrArray* outputs = g_ptr_array_new();
+	unsigned int i;
+	for(i = 0; i < monitors->len; i++)
+	{
+		char const* url = (options.serviceURLCount > 0)? options.serviceURLs[MIN((int)i, options.serviceURLCount - 1)] : options.serviceURL;
+		g_ptr_array_add(outputs, nextImageNew(&options, g_array_index(monitors, int, i), url));
+	}
+	if(options.serviceURLCount > (int)monitors->len)
+		fprintf(stderr, "Warning: %i URLs for %u outputs, the rest ignored\n", options.serviceURLCount, monitors->len);
+	g_array_free(monitors, TRUE);
 
-	
 	// Start the main loop, and do nothing (block) until
 	//   the application is closed
 	if(!g_thread_new("curl-thread", &curlThread, 0) != 0)
@@ -886,26 +7819,38 @@ int		main(int argc, char** argv)
 		return(0);
 	}
 
+	// kick off the first downloads as soon as there's a network; after a
+	//   power cut the router is often still booting, so if it isn't up yet,
+	//   wait for it (or a retry delay, in case the monitor doesn't know)
+	GNetworkMonitor* networkMonitor = g_network_monitor_get_default();
+	for(i = 0; i < outputs->len; i++)
+	{
+		NextImageContext* context = (NextImageContext*)g_ptr_array_index(outputs, i);
+		DebugPrintf("*Using url=\"%s\" on output %i, delay=%i\n\n", context->options.serviceURL, context->geometry.monitor, context->options.delayMS);
 
-	// set up the download
-	NextImageContext* context = malloc(sizeof(NextImageContext));
-
-	// inherit the app options
-	memcpy(&context->options, &options, sizeof(AppOptions));
-	
-	context->previousImage = bottomImage;
-	context->newImage = topImage;
-	g_object_ref(context->previousImage);
-	g_object_ref(context->newImage);
-	
-	context->previousSourcePixbuf = startupPixels;	// (keeps reference)
-	context->newSourcePixbuf = 0;
-	context->currentDownload = 0;
+		if(g_network_monitor_get_network_available(networkMonitor))
+			nextImageScheduleFetch(context, 0);
+		else
+		{
+			context->networkHandler = g_signal_connect(networkMonitor, "network-changed", G_CALLBACK(&onNextImageNetworkChanged), (gpointer)context);
+			context->networkTimer = gdk_threads_add_timeout(kRetryDelayMS, &onNextImageNetworkWait, (void*)context);
+		}
+	}
 
-	DebugPrintf("*Using url=\"%s\", delay=%i\n\n", context->options.serviceURL, context->options.delayMS);
+	// sleep while the screen is off (see Sleep)
+	g_unix_signal_add(SIGUSR1, &onNextImageSleepSignal, (gpointer)outputs);
+	g_unix_signal_add(SIGUSR2, &onNextImageWakeSignal, (gpointer)outputs);
+#if defined(PIFRAME_TRACE)
+	g_unix_signal_add(SIGHUP, &onTraceSignal, 0);	// (see Trace)
+#endif
+	if(options.displayPollS > 0)
+	{
+		onNextImageDisplayPoll((gpointer)outputs);	// (a display that's already off: no first fetch)
+		g_timeout_add_seconds(options.displayPollS, &onNextImageDisplayPoll, (gpointer)outputs);
+	}
 
-	// kick off the first download
-	gdk_threads_add_timeout(5000, &onNextDownloadDelay, (void*)context);
+	if(options.controlPath != 0)
+		controlInit(options.controlPath, outputs);
 
 
 	gtk_main();